@@ -23,6 +23,9 @@
 #define MAX_DESCRIPCION 100
 #define MAX_TRABAJADORES 5
 #define NOMBRE_SEMAFORO "/gestor_tareas_sem"
+#define PRIORIDAD_MIN 1
+#define PRIORIDAD_MAX 5
+#define NUM_PRIORIDADES (PRIORIDAD_MAX - PRIORIDAD_MIN + 1)
 
 // Definición de los estados de las tareas
 typedef enum {
@@ -44,10 +47,20 @@ typedef struct {
     pid_t proceso_asignado;
 } Tarea;
 
+// Cola FIFO de tareas pendientes de una misma prioridad. Guarda posiciones
+// del array de tareas en orden de llegada; como cada tarea entra una sola
+// vez, nunca tiene más de MAX_TAREAS
+typedef struct {
+    int posiciones[MAX_TAREAS];
+    int inicio; // Siguiente posición a asignar
+    int num;
+} ColaPrioridad;
+
 // Estructura para la memoria compartida
 typedef struct {
     Tarea tareas[MAX_TAREAS];
     int num_tareas;
+    ColaPrioridad colas[NUM_PRIORIDADES]; // Tareas pendientes por prioridad
     int trabajadores_activos;
     pthread_mutex_t mutex;
     pthread_cond_t nueva_tarea;
@@ -68,6 +81,8 @@ void *hilo_monitor(void *arg);
 void *hilo_trabajador(void *arg);
 int agregar_tarea(const char *descripcion, int prioridad);
 int asignar_tarea();
+void encolar_tarea(int pos);
+int desencolar_tarea();
 int completar_tarea(int id_tarea);
 int cancelar_tarea(int id_tarea);
 void mostrar_tareas();
@@ -112,8 +127,9 @@ void inicializar_gestor() {
         pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
         pthread_cond_init(&gestor->nueva_tarea, &cond_attr);
         
-        // Limpiar el array de tareas
+        // Limpiar el array de tareas y las colas de prioridad
         memset(gestor->tareas, 0, sizeof(gestor->tareas));
+        memset(gestor->colas, 0, sizeof(gestor->colas));
         
         sem_post(sem_gestor);
     }
@@ -170,8 +186,15 @@ void *hilo_trabajador(void *arg) {
     printf("[Trabajador %d] Iniciado\n", mi_id);
     
     while (continuar) {
-        // Intentar tomar una tarea
-        int id_tarea = asignar_tarea();
+        // Tomar una tarea o dormir en nueva_tarea hasta que llegue alguna.
+        // Se comprueba con el mutex tomado, así que el aviso de agregar_tarea
+        // no se puede perder entre la comprobación y la espera
+        int id_tarea;
+        pthread_mutex_lock(&gestor->mutex);
+        while ((id_tarea = asignar_tarea()) < 0 && continuar) {
+            pthread_cond_wait(&gestor->nueva_tarea, &gestor->mutex);
+        }
+        pthread_mutex_unlock(&gestor->mutex);
         
         if (id_tarea > 0) {
             // Procesar la tarea asignada
@@ -192,10 +215,6 @@ void *hilo_trabajador(void *arg) {
                     break;
                 }
             }
-        } else {
-            // Si no hay tareas disponibles, esperar
-            struct timespec ts = {0, 500000000}; // 500ms
-            nanosleep(&ts, NULL);
         }
     }
     
@@ -206,7 +225,7 @@ void *hilo_trabajador(void *arg) {
 
 // Función para agregar una nueva tarea
 int agregar_tarea(const char *descripcion, int prioridad) {
-    if (prioridad < 1 || prioridad > 5) {
+    if (prioridad < PRIORIDAD_MIN || prioridad > PRIORIDAD_MAX) {
         return -1;  // Prioridad inválida
     }
     
@@ -231,17 +250,23 @@ int agregar_tarea(const char *descripcion, int prioridad) {
     gestor->tareas[pos].tiempo_fin = 0;
     gestor->tareas[pos].proceso_asignado = 0;
     
+    // Ponerla a la cola de su prioridad
+    encolar_tarea(pos);
+    
     // Incrementar contador de tareas
     gestor->num_tareas++;
     
     // Guardar el ID para retornarlo
     int nuevo_id = gestor->tareas[pos].id;
     
-    // Señalizar que hay una nueva tarea disponible
-    pthread_cond_signal(&gestor->nueva_tarea);
-    
     sem_post(sem_gestor);
     
+    // Despertar a un trabajador dormido. Se avisa con el mutex tomado para
+    // que no se cuele entre su comprobación y su espera
+    pthread_mutex_lock(&gestor->mutex);
+    pthread_cond_signal(&gestor->nueva_tarea);
+    pthread_mutex_unlock(&gestor->mutex);
+    
     printf("Tarea %d agregada: %s (Prioridad: %d)\n", 
            nuevo_id, descripcion, prioridad);
     
@@ -254,17 +279,8 @@ int asignar_tarea() {
     
     sem_wait(sem_gestor);
     
-    // Buscar tareas pendientes por orden de prioridad
-    int mayor_prioridad = 0;
-    int indice_seleccionado = -1;
-    
-    for (int i = 0; i < gestor->num_tareas; i++) {
-        if (gestor->tareas[i].estado == PENDIENTE && 
-            gestor->tareas[i].prioridad > mayor_prioridad) {
-            mayor_prioridad = gestor->tareas[i].prioridad;
-            indice_seleccionado = i;
-        }
-    }
+    // La primera tarea de la cola más prioritaria no vacía
+    int indice_seleccionado = desencolar_tarea();
     
     // Si se encontró una tarea pendiente, asignarla
     if (indice_seleccionado >= 0) {
@@ -280,6 +296,36 @@ int asignar_tarea() {
     return id_tarea;
 }
 
+// Añadir una tarea pendiente al final de la cola de su prioridad
+// (requiere sem_gestor)
+void encolar_tarea(int pos) {
+    ColaPrioridad *cola = &gestor->colas[gestor->tareas[pos].prioridad - PRIORIDAD_MIN];
+    
+    cola->posiciones[(cola->inicio + cola->num) % MAX_TAREAS] = pos;
+    cola->num++;
+}
+
+// Sacar la tarea pendiente de mayor prioridad y, a igual prioridad, la más
+// antigua (requiere sem_gestor). Las tareas canceladas se quedan en su cola
+// y se descartan aquí al llegar su turno. Devuelve su posición o -1
+int desencolar_tarea() {
+    for (int p = NUM_PRIORIDADES - 1; p >= 0; p--) {
+        ColaPrioridad *cola = &gestor->colas[p];
+        
+        while (cola->num > 0) {
+            int pos = cola->posiciones[cola->inicio];
+            cola->inicio = (cola->inicio + 1) % MAX_TAREAS;
+            cola->num--;
+            
+            if (gestor->tareas[pos].estado == PENDIENTE) {
+                return pos;
+            }
+        }
+    }
+    
+    return -1;
+}
+
 // Función para marcar una tarea como completada
 int completar_tarea(int id_tarea) {
     int resultado = -1;
@@ -570,6 +616,12 @@ int main(int argc, char *argv[]) {
             sleep(1);
         }
         
+        // El manejador de señales no puede usar la variable de condición:
+        // despertar aquí al hilo trabajador si está esperando tareas
+        pthread_mutex_lock(&gestor->mutex);
+        pthread_cond_broadcast(&gestor->nueva_tarea);
+        pthread_mutex_unlock(&gestor->mutex);
+        
         // Esperar a que el hilo trabajador termine
         pthread_join(hilo_worker, NULL);
     }
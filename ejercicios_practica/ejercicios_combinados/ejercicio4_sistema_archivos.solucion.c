@@ -5,6 +5,8 @@
  * hilos, memoria compartida y mecanismos de sincronización.
  */
 
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,288 +15,4599 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <semaphore.h>
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h> // PATH_MAX
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h> // Esperas entre procesos (ver esperar_futex)
+#if defined(__x86_64__)
+#include <nmmintrin.h> // _mm_crc32_u64 (se elige en tiempo de ejecución)
+#endif
 
 #define MAX_NODOS 5
 #define MAX_ARCHIVOS 20
 #define MAX_NOMBRE 50
-#define MAX_CONTENIDO 1024
+#define MAX_CONTENIDO 1024 // Tamaño de línea de comandos (no limita los archivos)
 #define MAX_OPERACIONES 100
 #define NOMBRE_SEM_ARCHIVOS "/sem_archivos"
-#define NOMBRE_SEM_LOGS "/sem_logs"
+
+// Cabecera del segmento persistente: identifica el formato para poder
+// reabrirlo en un arranque en caliente sin reinicializarlo
+#define MAGIA_SISTEMA 0x53464F53u // "SOFS"
+#define VERSION_SISTEMA 14
+
+// Reparto en shards (--shards): cada shard es un segmento independiente con
+// su propia tabla, índice, trie, región de datos y locks. Un archivo vive en
+// el shard del hash de su primer componente, así que cada directorio de
+// primer nivel queda entero en un shard
+#define MAX_SHARDS 8
+
+// Los bloqueos de archivo son leases con fecha de expiración (ms de
+// CLOCK_MONOTONIC). Un montículo de expiraciones permite al hilo de
+// sincronización dormir justo hasta la siguiente, sin sondeos periódicos
+#define DURACION_LEASE_MS 30000
+// Nodos (o hilos) que pueden esperar a la vez el bloqueo de un archivo
+// (bits de ColaEspera.cancelados)
+#define MAX_ESPERAS_ARCHIVO 64
+// Cada cuánto revisa quien espera un bloqueo si debe terminar o si el
+// primero de la cola pertenece a un nodo caído
+#define PAUSA_ESPERA_MS 500
+
+// Log de operaciones sin bloqueos: cada escritor obtiene un ticket con
+// fetch-add y publica su entrada con un número de secuencia por hueco
+// (impar: escritura en curso, 2 * (ticket + 1): entrada del ticket completa)
+#define MAX_ESPERA_LOG 1000 // Esperas máximas a un escritor de la vuelta anterior
+#define MAX_REINTENTOS_INSTANTANEA 100 // Copias fallidas de un archivo antes de omitirlo
+#define MAGIA_LOG 0x474F4C53u // "SLOG"
+#define CAPACIDAD_LOG_DURABLE 65536 // Entradas del log en disco (--log-archivo)
+// Consultas del log: cada entrada enlaza con la anterior de su nodo y con la
+// anterior de su cubeta de nombre, y las cabezas de esas cadenas se cambian
+// con un exchange atómico, así que los índices tampoco bloquean a nadie.
+// Los tickets están ordenados por tiempo salvo por MARGEN_TIEMPO_LOG segundos
+// (un escritor puede tardar en rellenar su entrada), lo que permite buscar
+// una ventana de tiempo por bisección
+#define TAM_INDICE_LOG 256 // Cubetas del índice por nombre (potencia de 2)
+#define MARGEN_TIEMPO_LOG 1
+
+// Modo por lotes: cada grupo de hasta TAM_LOTE comandos se aplica con una
+// sola adquisición de lock_tabla y sus resultados se emiten con un write.
+// Un lote binario empieza por la línea MAGIA_LOTE y sigue con registros
+// CabeceraLote + nombre + datos
+#define TAM_LOTE 1024
+#define MAGIA_LOTE "SFLB\n"
+
+// Replicación entre nodos por sockets Unix: cada nodo aplica sus operaciones
+// en su propio almacén y envía registros (CabeceraRegistro + nombre + datos)
+// a sus pares, que los aplican por grupos y confirman la última secuencia.
+// Cada conexión empieza con un saludo (nodo y época del emisor) al que el
+// receptor responde con la última secuencia de esa época que ya aplicó: al
+// reconectar sólo se reenvía lo que falta y lo repetido se descarta
+#define MAGIA_REPLICACION 0x52504C53u // "SLPR"
+#define TAM_BUFFER_REPLICACION (256 * 1024) // Lectura de registros de un par
+#define CAPACIDAD_TIEMPOS 65536 // Instantes de envío recordados para medir latencias
+#define ESPERA_REPLICACION_MS 5000 // Espera máxima de las confirmaciones
+#define MAX_HISTORIAL_REPLICACION (64 * 1024 * 1024) // Bytes retenidos para pares desconectados
+
+// Write-ahead log (--wal): cada operación aplicada se anota con su LSN antes
+// de soltar sus locks y no se da por terminada hasta que el registro está en
+// disco. Un hilo por proceso escribe los registros acumulados con un único
+// fdatasync (group commit); un error de escritura detiene el nodo. Un checkpoint guarda una imagen del segmento en
+// <wal>.base y vacía el WAL; tras una caída se carga la imagen y se reaplican
+// los registros posteriores
+#define SUFIJO_IMAGEN_BASE ".base"
+
+// Instantáneas exportables (exportar/importar, --importar): cabecera, tabla
+// de metadatos y región de contenidos empaquetada, tal como se guardan
+// (comprimidos o no, y una sola vez los compartidos dentro de un shard).
+// Se escriben de una vez y se cargan proyectando el archivo con mmap
+#define MAGIA_INSTANTANEA 0x50414E53u // "SNAP"
+#define VERSION_INSTANTANEA 1
+
+// Estadísticas de contención: cada nodo acumula en su propia fila del
+// segmento las adquisiciones de cada clase de lock y las operaciones de cada
+// tipo. Los tiempos de retención y de operación se miden en una de cada
+// MUESTREO_ESTADISTICAS (potencia de 2) para no pagar dos lecturas del reloj
+// en cada una; las esperas se miden siempre que el lock estaba ocupado
+#define MUESTREO_ESTADISTICAS 16
+
+// Benchmark de carga: histogramas de latencia log-lineales, con
+// 2^BITS_SUBCUBETAS cubetas por cada potencia de 2 (error relativo < 6.25 %)
+#define BITS_SUBCUBETAS 4
+#define NUM_CUBETAS_LATENCIA (64 << BITS_SUBCUBETAS)
+
+// Índice hash de nombres (direccionamiento abierto con sondeo lineal).
+// TAM_INDICE debe ser potencia de 2 y al menos el doble de MAX_ARCHIVOS
+// para mantener el factor de carga por debajo de 0.5
+#define TAM_INDICE 64
+#define INDICE_VACIO 0
+#define INDICE_BORRADO -1
+// Reconstruir índice y lista de posiciones libres cuando se acumulan borrados
+#define UMBRAL_COMPACTACION (TAM_INDICE / 4)
+
+// Jerarquía de directorios: los nombres son rutas ("docs/2024/informe") y
+// sus componentes forman un trie (primer hijo / siguiente hermano) dentro de
+// la memoria compartida. Los directorios se crean al crear un archivo bajo
+// ellos y desaparecen al quedarse vacíos. El nodo 0 es la raíz
+#define MAX_NODOS_DIRECTORIO (4 * MAX_ARCHIVOS)
+#define RAIZ_DIRECTORIO 0
+
+_Static_assert((TAM_INDICE & (TAM_INDICE - 1)) == 0 && TAM_INDICE >= 2 * MAX_ARCHIVOS,
+               "TAM_INDICE debe ser potencia de 2 y >= 2 * MAX_ARCHIVOS");
+
+// Región de datos: el contenido de los archivos se guarda en extensiones de
+// bloques contiguos dentro de la memoria compartida, a continuación de la
+// tabla de metadatos
+#define TAM_BLOQUE 256
+#define NUM_BLOQUES_DATOS 65536 // 16 MiB por defecto (configurable con --bloques)
+#define BLOQUES_PARA(bytes) (((bytes) + TAM_BLOQUE - 1) / TAM_BLOQUE)
+// Cada archivo ocupa una extensión y, durante una reasignación, puede haber
+// una más: nunca hay más huecos que extensiones ocupadas + 1
+#define MAX_EXTENSIONES_LIBRES (MAX_ARCHIVOS + 2)
+// Deduplicación: tabla de contenidos por (CRC32C, tamaño) con direccionamiento
+// abierto. Cada contenido distinto ocupa una celda, así que nunca hay más de
+// MAX_ARCHIVOS en uso
+#define TAM_CONTENIDOS TAM_INDICE
+
+// Transacciones: como cada archivo aparece una sola vez, nunca tienen más
+// escrituras que archivos caben en todos los shards
+#define MAX_ESCRITURAS_TX (MAX_SHARDS * MAX_ARCHIVOS)
+
+// Compresión de contenidos (--compresion): bloques en formato LZ4 propio,
+// sin dependencias. Sólo se guarda comprimido lo que así ocupa menos bloques
+#define UMBRAL_COMPRESION 1024 // Tamaño mínimo por defecto para comprimir
+#define BITS_HASH_LZ 12 // Tabla de posiciones de 4096 entradas
+#define MIN_COINCIDENCIA_LZ 4
+#define DISTANCIA_MAXIMA_LZ 65535
+#define MARGEN_FINAL_LZ 12 // Ninguna coincidencia empieza en los últimos 12 bytes...
+#define FINAL_LITERALES_LZ 5 // ... ni llega a los últimos 5
+
+// Suma de comprobación del contenido: CRC32C (polinomio de Castagnoli,
+// representación reflejada), acelerada con SSE4.2 si el procesador la tiene
+#define POLINOMIO_CRC32C 0x82F63B78u
+
+// Estructura para representar una extensión (bloques contiguos)
+typedef struct {
+    int inicio; // Primer bloque
+    int num_bloques;
+} Extension;
+
+// Contenido deduplicado: los archivos con el mismo contenido comparten su
+// extensión, que ya no se modifica en el sitio mientras esté en la tabla
+typedef struct {
+    uint32_t crc; // CRC32C del contenido
+    int tamanio;
+    int tamanio_comprimido; // Como en Archivo: forma parte de la clave
+    Extension datos;
+    int referencias; // Archivos y vistas abiertas que lo usan (0: celda libre)
+} ContenidoCompartido;
 
 // Estructura para representar un archivo
 typedef struct {
     char nombre[MAX_NOMBRE];
-    char contenido[MAX_CONTENIDO];
+    Extension datos; // Bloques que contienen el contenido
     int tamanio;
+    int tamanio_comprimido; // Bytes guardados si está comprimido (0: sin comprimir)
+    uint32_t crc; // CRC32C del contenido
     int propietario; // ID del nodo propietario
     time_t ultima_modificacion;
     int bloqueado; // 0: no bloqueado, 1: bloqueado
     int nodo_bloqueo; // ID del nodo que tiene el bloqueo
+    int64_t expiracion_lease; // Fin del lease del bloqueo (ms monotónicos)
+    int en_uso; // 0: posición libre
+    unsigned int generacion; // Cambia al liberar la posición: valida referencias (posición, generación)
+    int siguiente_libre; // Siguiente posición libre (sólo si en_uso == 0)
+    int nodo_directorio; // Hoja del trie de directorios que lo representa
 } Archivo;
 
+// Nodo del trie de directorios
+typedef struct {
+    char componente[MAX_NOMBRE]; // Nombre dentro del directorio padre
+    int padre; // -1 en la raíz
+    int primer_hijo; // -1: sin hijos
+    int siguiente_hermano; // Siguiente hijo del mismo padre (o siguiente nodo libre)
+    int archivo; // Posición del archivo + 1, o 0 si es un directorio
+} NodoDirectorio;
+
+// Entrada de un listado de directorio (ver listar_directorio)
+typedef struct {
+    char ruta[MAX_NOMBRE];
+    int archivo; // Posición del archivo + 1, o 0 si es un directorio
+    int tamanio;
+} EntradaDirectorio;
+
+// Tipos de operación (se guardan en el log)
+typedef enum {
+    OP_CREAR = 0,
+    OP_LEER = 1,
+    OP_ESCRIBIR = 2,
+    OP_ELIMINAR = 3,
+    OP_ANEXAR = 4,
+    OP_RENOMBRAR = 5,
+    OP_BLOQUEAR = 6, // Sólo en las estadísticas
+    OP_DESBLOQUEAR = 7,
+    OP_COPIAR = 8, // datos: nombre del destino
+    OP_TRANSACCION = 9, // nombre: primer archivo; datos: escrituras (ver codificar_transaccion)
+    NUM_TIPOS_OPERACION,
+    // Registros internos del WAL (sin estadísticas ni entradas en el log)
+    OP_PROGRESO_REPLICACION = NUM_TIPOS_OPERACION, // datos: ProgresoReplicacion
+    OP_RESINCRONIZAR // datos: archivos del nodo de origen (ver resincronizar_par)
+} TipoOperacion;
+
+// Clases de lock de las estadísticas (la de escritura sigue a la de lectura)
+typedef enum {
+    LOCK_TABLA_LECTURA = 0,
+    LOCK_TABLA_ESCRITURA,
+    LOCK_ARCHIVO_LECTURA,
+    LOCK_ARCHIVO_ESCRITURA,
+    LOCK_DATOS,
+    LOCK_LEASES,
+    LOCK_LOG, // Huecos del anillo ocupados por un escritor de la vuelta anterior
+    NUM_CLASES_LOCK
+} ClaseLock;
+
+// Contadores de una clase de lock en un nodo (tiempos en ns)
+typedef struct {
+    _Atomic uint64_t adquisiciones;
+    _Atomic uint64_t contendidas; // El primer intento encontró el lock ocupado
+    _Atomic uint64_t espera_ns, max_espera_ns;
+    _Atomic uint64_t muestras; // Adquisiciones con la retención medida
+    _Atomic uint64_t retencion_ns, max_retencion_ns;
+} ContadoresLock;
+
+// Contadores de un tipo de operación en un nodo (tiempos en ns)
+typedef struct {
+    _Atomic uint64_t operaciones;
+    _Atomic uint64_t muestras; // Operaciones medidas
+    _Atomic uint64_t tiempo_ns, max_ns;
+    _Atomic uint64_t espera_ns; // Parte del tiempo medido bloqueada en locks
+} ContadoresOperacion;
+
+// Contadores de compresión de un nodo (tiempos en ns)
+typedef struct {
+    _Atomic uint64_t compresiones; // Contenidos por encima del umbral
+    _Atomic uint64_t bytes_originales, bytes_guardados; // Sin comprimir lo que no compensa
+    _Atomic uint64_t compresion_ns;
+    _Atomic uint64_t descompresiones;
+    _Atomic uint64_t bytes_descomprimidos;
+    _Atomic uint64_t descompresion_ns;
+} ContadoresCompresion;
+
+// Fila de estadísticas de un nodo, alineada para no compartir líneas de
+// caché con las de otros nodos
+typedef struct {
+    ContadoresLock locks[NUM_CLASES_LOCK];
+    ContadoresOperacion operaciones[NUM_TIPOS_OPERACION];
+    ContadoresCompresion compresion;
+} __attribute__((aligned(64))) EstadisticasNodo;
+
+// Adquisición en curso de un lock por un hilo (ver tomar_rwlock)
+typedef struct {
+    int clase;
+    int64_t instante; // ns, 0 si no se mide su retención
+} AdquisicionLock;
+
 // Estructura para representar un registro en el log
 typedef struct {
+    _Atomic uint64_t secuencia; // Publicación de la entrada (ver registrar_log)
     time_t timestamp;
     int nodo;
-    int tipo_operacion; // 0: crear, 1: leer, 2: escribir, 3: eliminar
+    int tipo_operacion; // TipoOperacion
     char nombre_archivo[MAX_NOMBRE];
+    uint64_t anterior_nodo; // Ticket + 1 de la entrada anterior del mismo nodo (0: ninguna)
+    uint64_t anterior_nombre; // Ídem de la misma cubeta de nombre
 } LogEntry;
 
+// Cabezas de las cadenas de entradas por nodo y por nombre (ticket + 1 de la
+// última entrada de cada una; 0: vacía)
+typedef struct {
+    _Atomic uint64_t ultimo_nodo[MAX_NODOS];
+    _Atomic uint64_t ultimo_nombre[TAM_INDICE_LOG];
+} IndicesLog;
+
+// Log en disco: cabecera seguida de CAPACIDAD_LOG_DURABLE entradas. Tiene su
+// propio contador de tickets para conservar la historia entre ejecuciones
+typedef struct {
+    uint32_t magia;
+    uint32_t capacidad;
+    _Atomic uint64_t siguiente;
+    IndicesLog indices;
+    LogEntry entradas[];
+} LogDurable;
+
+// Un anillo del log (el de la memoria compartida o el durable)
+typedef struct {
+    LogEntry *entradas;
+    uint32_t capacidad;
+    _Atomic uint64_t *siguiente;
+    IndicesLog *indices;
+} AnilloLog;
+
+// Filtro de una consulta del log (los campos sin usar no filtran)
+typedef struct {
+    int nodo; // -1: cualquiera
+    const char *nombre; // NULL: cualquiera
+    time_t desde, hasta; // 0: sin límite
+} FiltroLog;
+
+// Copia de los metadatos visibles de un archivo (ver instantanea_archivos)
+typedef struct {
+    char nombre[MAX_NOMBRE];
+    int tamanio;
+    int propietario;
+    time_t ultima_modificacion;
+    int bloqueado;
+    int nodo_bloqueo;
+} InfoArchivo;
+
+// Vista de sólo lectura del contenido de un archivo dentro de la proyección
+// compartida (ver abrir_vista)
+typedef struct {
+    const char *datos;
+    char *copia; // Contenido propio de la vista (NULL: apunta a la proyección)
+    int longitud;
+    unsigned int version; // Secuencia de la posición al abrir la vista
+    int posicion;
+    int shard; // Shard del archivo (el hilo puede cambiar de shard con la vista abierta)
+    Extension fijada; // Extensión retenida con una referencia (num_bloques 0: ninguna)
+    uint32_t crc; // CRC del contenido fijado (lo localiza en la tabla de contenidos)
+} VistaArchivo;
+
+// Cola FIFO de espera del bloqueo de una posición de la tabla: cada nodo
+// que espera saca un ticket y lo consigue cuando le llega el turno y el
+// archivo está libre. Los tickets abandonados se marcan para saltarlos, y
+// los de nodos caídos se reclaman (ver reclamar_turnos). Se duerme en un
+// futex y no en una condición compartida (ver avisar_futex)
+typedef struct {
+    pthread_mutex_t mutex; // Protege la cola (después del lock del archivo)
+    _Atomic uint32_t avisos; // Cambia en cada aviso (palabra del futex)
+    uint32_t turno; // Ticket del primero de la cola
+    uint32_t siguiente; // Próximo ticket a repartir
+    uint64_t cancelados; // Bit ticket % MAX_ESPERAS_ARCHIVO: ticket abandonado
+    int nodos[MAX_ESPERAS_ARCHIVO]; // Nodo que sacó cada ticket (ticket % MAX_ESPERAS_ARCHIVO)
+} ColaEspera;
+
+// Entrada del montículo de expiraciones de leases
+typedef struct {
+    int64_t expiracion;
+    int posicion; // Posición del archivo en la tabla
+} EntradaLease;
+
+// Operaciones del benchmark de carga
+typedef enum {
+    CARGA_CREAR = 0,
+    CARGA_LEER,
+    CARGA_ESCRIBIR,
+    CARGA_ELIMINAR,
+    CARGA_BLOQUEAR, // Bloquear y, si se consigue, desbloquear
+    NUM_OPERACIONES_CARGA
+} OperacionCarga;
+
+// Histograma de latencias de un tipo de operación (ver cubeta_latencia)
+typedef struct {
+    uint64_t operaciones;
+    uint64_t errores;
+    uint64_t max_ns;
+    uint64_t cubetas[NUM_CUBETAS_LATENCIA];
+} HistogramaLatencia;
+
+// Comando leído de un lote
+typedef struct {
+    int tipo; // OP_CREAR, OP_ESCRIBIR, OP_ANEXAR, OP_ELIMINAR, OP_RENOMBRAR u OP_COPIAR
+    char nombre[MAX_NOMBRE];
+    char *datos; // Memoria propia del comando (puede contener bytes nulos)
+    int longitud;
+    int desplazamiento; // OP_ESCRIBIR: primer byte a sobrescribir (-1: contenido completo)
+    int resultado;
+} ComandoLote;
+
+// Escritura preparada dentro de una transacción
+typedef struct {
+    char nombre[MAX_NOMBRE];
+    char *datos; // Memoria propia
+    int longitud;
+} EscrituraTx;
+
+// Transacción de varios archivos (propia del proceso hasta confirmarla)
+typedef struct {
+    EscrituraTx escrituras[MAX_ESCRITURAS_TX];
+    int num_escrituras;
+} Transaccion;
+
+// Cabecera de cada registro de un lote binario (orden de bytes nativo)
+typedef struct {
+    uint32_t tipo;
+    uint32_t longitud_nombre;
+    uint32_t longitud_datos;
+} CabeceraLote;
+
+// Cabecera de cada registro de replicación (orden de bytes nativo: los
+// nodos son procesos de la misma máquina). La siguen el nombre y los datos
+// (en OP_RENOMBRAR y OP_COPIAR, la ruta de destino)
+typedef struct {
+    uint64_t secuencia; // Numeración propia del nodo de origen, desde 1
+    uint32_t tipo; // TipoOperacion
+    uint32_t nodo; // Nodo de origen
+    int32_t desplazamiento; // Como en ComandoLote
+    uint32_t longitud_nombre;
+    uint32_t longitud_datos;
+} CabeceraRegistro;
+
+// Saludo con el que un emisor abre cada conexión de replicación
+typedef struct {
+    uint32_t magia; // MAGIA_REPLICACION
+    uint32_t nodo; // Nodo de origen
+    uint64_t epoca; // Ejecución del emisor: su numeración empieza de nuevo en cada una
+} SaludoReplicacion;
+
+// Progreso de la replicación recibida de un origen (persistente con el
+// segmento y anotado en el WAL junto con los registros que cubre)
+typedef struct {
+    uint64_t epoca; // 0: nunca se recibió nada
+    uint64_t secuencia; // Última secuencia de esa época ya aplicada
+} ProgresoReplicacion;
+
+// Cabecera de cada registro del WAL: un registro como los de replicación,
+// con el LSN en secuencia, precedido de su CRC32C
+typedef struct {
+    uint32_t crc; // CRC32C de nombre + datos + registro
+    uint32_t reservado;
+    CabeceraRegistro registro;
+} CabeceraWal;
+
+// Cabecera de una instantánea exportada. La siguen num_archivos entradas
+// EntradaInstantanea y tam_contenidos bytes de contenidos
+typedef struct {
+    uint32_t magia;
+    uint32_t version;
+    uint32_t tam_entrada; // sizeof(EntradaInstantanea): detecta cambios de formato
+    uint32_t num_archivos;
+    uint64_t tam_contenidos;
+    uint32_t crc; // CRC32C de las entradas y los contenidos
+    uint32_t reservado;
+} CabeceraInstantanea;
+
+// Metadatos de un archivo en una instantánea
+typedef struct {
+    char nombre[MAX_NOMBRE];
+    int32_t propietario;
+    int64_t ultima_modificacion;
+    uint32_t crc; // CRC32C del contenido sin comprimir
+    int32_t tamanio;
+    int32_t tamanio_comprimido; // 0: guardado sin comprimir
+    uint64_t desplazamiento; // Inicio del contenido guardado en la región de contenidos
+} EntradaInstantanea;
+
+// WAL de este proceso (no está en la memoria compartida)
+typedef struct {
+    int activo;
+    int fd; // -1: sin WAL
+    pthread_t hilo;
+    pthread_mutex_t mutex; // Protege todo lo que sigue
+    pthread_cond_t hay_registros;
+    pthread_cond_t hay_durables;
+    char *pendiente; // Registros aún no escritos
+    size_t tam_pendiente, capacidad_pendiente;
+    uint64_t primero_pendiente; // Cota inferior del LSN del primer registro de pendiente
+    uint64_t ultimo_pendiente; // LSN del último registro añadido
+    uint64_t durable; // LSN del último registro de este proceso ya en disco
+    uint64_t registros, sincronizaciones, bytes;
+} EstadoWal;
+
+// Conexión saliente hacia un par
+typedef struct {
+    int id;
+    int fd; // -1: sin conectar
+    uint64_t enviado; // Bytes del historial ya enviados (posición absoluta)
+    _Atomic uint64_t confirmado; // Última secuencia aplicada por el par
+    _Atomic int caido; // El hilo de confirmaciones vio cerrarse la conexión
+    int resincronizar; // Le faltan registros ya descartados del historial
+    pthread_t hilo_confirmaciones;
+} ParReplicacion;
+
+// Estado de la replicación de este proceso (no está en la memoria compartida)
+typedef struct {
+    int activa;
+    ParReplicacion pares[MAX_NODOS];
+    int num_pares;
+    int fd_escucha;
+    int receptores[MAX_NODOS]; // Conexiones entrantes (-1: hueco libre)
+    pthread_t hilos_receptores[MAX_NODOS];
+    _Atomic int receptor_terminado[MAX_NODOS]; // El hilo del hueco ya acabó
+    pthread_t hilo_emisor, hilo_servidor;
+    pthread_mutex_t mutex; // Protege todo lo que sigue
+    pthread_cond_t hay_registros;
+    pthread_cond_t hay_confirmaciones;
+    char *pendiente; // Registros aún no pasados al historial
+    size_t tam_pendiente, capacidad_pendiente;
+    char *historial; // Registros enviados o por enviar (sólo los toca el emisor)
+    size_t tam_historial, capacidad_historial;
+    uint64_t base_historial; // Posición absoluta del primer byte del historial
+    uint64_t secuencia_base; // Secuencia del último registro descartado del historial
+    uint64_t secuencia_historial; // Secuencia del último registro del historial
+    uint64_t ultima_secuencia;
+    uint64_t epoca; // Época de este proceso como emisor (ver SaludoReplicacion)
+    pthread_mutex_t origenes[MAX_NODOS]; // Serializa los receptores de un mismo origen
+    int64_t instantes[CAPACIDAD_TIEMPOS]; // Instante de cada registro (us)
+    uint64_t confirmaciones; // Pares (registro, par) confirmados
+    int64_t suma_latencias, max_latencia; // us
+    uint64_t recibidos, conflictos;
+} EstadoReplicacion;
+
+// Cabecera versionada al principio del segmento
+typedef struct {
+    uint32_t magia;
+    uint32_t version;
+    uint64_t tam_total; // Tamaño de la proyección completa
+    uint64_t tam_metadatos; // sizeof(SistemaArchivos): detecta cambios de formato
+    uint64_t checkpoints; // Checkpoints completados
+    time_t ultimo_checkpoint;
+    int apagado_limpio; // 1 si el último nodo cerró tras un checkpoint
+    uint64_t lsn_checkpoint; // Último LSN incluido en la imagen base del WAL
+    int num_shards; // Shards del sistema (todos los segmentos lo repiten)
+    int shard; // Índice de este segmento
+} Cabecera;
+
 // Estructura para la memoria compartida
 typedef struct {
-    Archivo archivos[MAX_ARCHIVOS];
+    Cabecera cabecera; // Debe ser el primer campo
+    Archivo archivos[MAX_ARCHIVOS]; // Las posiciones no cambian mientras el archivo existe
     int num_archivos;
+    int max_posicion; // Posiciones [0, max_posicion) usadas alguna vez
+    int primera_libre; // Lista de posiciones libres por debajo de max_posicion (-1: vacía)
+    int indice[TAM_INDICE]; // Posición del archivo + 1, o INDICE_VACIO/INDICE_BORRADO
+    int num_borrados; // Celdas INDICE_BORRADO en el índice
+    NodoDirectorio directorio[MAX_NODOS_DIRECTORIO]; // Trie de rutas (protegido por lock_tabla)
+    int primer_nodo_libre; // Lista de nodos libres del trie (-1: vacía)
+    pthread_rwlock_t lock_tabla; // Protege la tabla y el índice (escritura: crear/eliminar)
+    pthread_rwlock_t locks_archivos[MAX_ARCHIVOS]; // Un lock lector/escritor por posición
+    _Atomic unsigned int secuencia_archivos[MAX_ARCHIVOS]; // Seqlock de los metadatos: impar durante un cambio
+    pthread_mutex_t lock_datos; // Protege la lista de huecos de la región de datos
+    Extension libres[MAX_EXTENSIONES_LIBRES]; // Huecos libres ordenados por inicio
+    int num_libres;
+    ContenidoCompartido contenidos[TAM_CONTENIDOS]; // Contenidos deduplicados (protegido por lock_datos)
+    int num_bloques; // Tamaño de la región de datos en bloques
+    size_t desplazamiento_datos; // Inicio de la región de datos desde el principio del segmento
+    // Estado común a todos los shards: sólo se usa el del shard principal
     LogEntry log[MAX_OPERACIONES];
-    int indice_log;
+    _Atomic uint64_t indice_log; // Siguiente ticket del log (no se reinicia al dar la vuelta)
+    IndicesLog indices_log;
+    _Atomic uint64_t ultimo_lsn; // Último LSN asignado en el WAL (común a todos los nodos)
+    _Atomic uint64_t wal_pendiente[MAX_NODOS]; // Cota inferior del LSN más antiguo aún no en disco (0: ninguno)
     int nodos_activos[MAX_NODOS];
+    pid_t pid_nodos[MAX_NODOS]; // Permite detectar nodos que terminaron sin finalizar
+    _Atomic int64_t latido_nodos[MAX_NODOS]; // Última actividad de cada nodo (ms monotónicos)
+    EstadisticasNodo estadisticas[MAX_NODOS]; // Contención por nodo (ver tomar_rwlock)
+    ProgresoReplicacion replicado[MAX_NODOS]; // Lo ya aplicado de cada origen (protegido por las tablas)
+    pthread_mutex_t lock_leases; // Protege el montículo de leases
+    _Atomic uint32_t avisos_leases; // Despierta a los hilos de sincronización (palabra del futex)
+    EntradaLease heap_leases[MAX_ARCHIVOS]; // Montículo de mínimos por expiración
+    int num_leases;
+    int pos_heap[MAX_ARCHIVOS]; // Posición de cada archivo en el montículo + 1 (0: ninguna)
+    ColaEspera esperas[MAX_ARCHIVOS]; // Esperas de bloqueo por posición (bloquear_archivo_espera)
 } SistemaArchivos;
 
 // Variables globales
-SistemaArchivos *sistema = NULL;
-sem_t *sem_archivos = NULL;
-sem_t *sem_logs = NULL;
+__thread SistemaArchivos *sistema = NULL; // Shard sobre el que opera este hilo (ver usar_shard)
+SistemaArchivos *shards[MAX_SHARDS];
+SistemaArchivos *principal = NULL; // shards[0]: guarda además el estado común (nodos, log, LSN)
+int num_shards = 1; // --shards
+sem_t *sem_archivos = NULL; // Inicialización y estado de los nodos
 int id_nodo;
 int continuar = 1;
+int modo_silencioso = 0; // Suprime los mensajes de cada operación (benchmark)
+int num_bloques_datos = NUM_BLOQUES_DATOS;
+size_t tam_sistema = 0; // Tamaño total de la proyección (metadatos + datos)
+const char *nombre_shm = NULL; // --shm: objeto de memoria compartida con nombre
+const char *ruta_persistente = NULL; // --archivo: archivo en disco
+int fd_shards[MAX_SHARDS] = {-1, -1, -1, -1, -1, -1, -1, -1}; // Segmentos persistentes (-1: anónimo)
+int intervalo_checkpoint = 0; // Segundos entre checkpoints automáticos (0: nunca)
+const char *ruta_log_durable = NULL; // --log-archivo: copia del log en un archivo proyectado
+LogDurable *log_durable = NULL;
+size_t tam_log_durable = 0;
+const char *ruta_lote = NULL; // --lote: ejecutar un lote y salir
+const char *ruta_importacion = NULL; // --importar: cargar una instantánea al arrancar
+int64_t duracion_lease = DURACION_LEASE_MS; // --lease
+const char *dir_replicacion = NULL; // --replicacion: directorio de los sockets
+EstadoReplicacion replicacion = {
+    .fd_escucha = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .hay_registros = PTHREAD_COND_INITIALIZER,
+    .hay_confirmaciones = PTHREAD_COND_INITIALIZER
+};
+const char *ruta_wal = NULL; // --wal: write-ahead log
+int umbral_compresion = 0; // --compresion: comprimir desde este tamaño (0: nunca)
+Transaccion transaccion; // Transacción abierta desde la línea de comandos
+int transaccion_abierta = 0;
+EstadoWal wal = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .hay_registros = PTHREAD_COND_INITIALIZER,
+    .hay_durables = PTHREAD_COND_INITIALIZER
+};
+const char *nombres_locks[NUM_CLASES_LOCK] = {
+    "tabla/lectura", "tabla/escritura", "archivo/lectura", "archivo/escritura",
+    "datos", "leases", "log"
+};
+const char *nombres_estadisticas[NUM_TIPOS_OPERACION] = {
+    "crear", "leer", "escribir", "eliminar", "anexar", "renombrar", "bloquear", "desbloquear",
+    "copiar", "transaccion"
+};
+// Estado de las estadísticas propio de cada hilo, por shard (un hilo puede
+// tener tomados a la vez locks de varios)
+__thread AdquisicionLock adquisicion_tabla[MAX_SHARDS];
+__thread AdquisicionLock adquisicion_archivos[MAX_SHARDS][MAX_ARCHIVOS];
+__thread AdquisicionLock adquisicion_datos[MAX_SHARDS], adquisicion_leases[MAX_SHARDS];
+__thread uint64_t espera_hilo; // ns bloqueado en locks (acumulado)
+__thread uint64_t espera_inicio_operacion; // espera_hilo al empezar la operación medida
+__thread unsigned int contador_muestreo;
+const char *nombres_carga[NUM_OPERACIONES_CARGA] = {
+    "crear", "leer", "escribir", "eliminar", "bloquear"
+};
+uint32_t tabla_crc32c[256];
+uint32_t potencias_crc32c[32]; // x^(2^k) módulo el polinomio
+uint32_t crc32c_tabla(uint32_t crc, const void *datos, size_t n);
+uint32_t (*crc32c)(uint32_t crc, const void *datos, size_t n) = crc32c_tabla;
 
 // Prototipos de funciones
 void inicializar_sistema();
+int proyectar_shard(int k, int nuevo);
+void desproyectar_shards();
+int indice_shard(const char *nombre);
+void usar_shard(const char *nombre);
+int shard_de(const void *direccion);
+void tomar_tablas(int escritura);
+void soltar_tablas();
+void inicializar_sincronizacion();
+void inicializar_estructura(size_t desplazamiento);
+int validar_cabecera();
+int arranque_en_caliente();
+void liberar_estado_huerfano();
+void recontar_contenidos();
+int checkpoint_sistema();
+int escribir_checkpoint();
+void *hilo_checkpoint(void *arg);
 void finalizar_sistema();
+int escribir_todo(int fd, const char *datos, size_t n);
+void ruta_imagen_base(char *ruta, size_t tam);
+int guardar_imagen_base();
+int sustituir_archivo(const char *temporal, const char *ruta);
+int exportar_instantanea(const char *ruta);
+int aplicar_importacion(const EntradaInstantanea *entrada, const char *guardado);
+long importar_instantanea(const char *ruta);
+int comparar_lsn(const void *a, const void *b);
+int recuperar_wal();
+void abrir_wal(int primero);
+void cerrar_wal();
+uint64_t registrar_wal(int tipo, int nodo, const char *nombre, const char *datos, int longitud,
+                       int desplazamiento);
+void esperar_wal(uint64_t lsn);
+void fallo_wal(const char *causa);
+uint64_t anotar_operacion(int tipo, const char *nombre, const char *datos, int longitud,
+                          int desplazamiento);
+void *hilo_wal(void *arg);
+void mostrar_wal();
+unsigned int hash_nombre(const char *nombre);
+int buscar_en_indice(const char *nombre);
+int buscar_archivo(const char *nombre);
+void indexar_archivo(int idx);
+void reconstruir_indice();
+int reservar_posicion();
+void liberar_posicion(int idx);
+void compactar_tabla();
+void inicializar_directorio();
+int reservar_nodo_directorio();
+void quitar_nodo_directorio(int n);
+void podar_directorios(int n);
+int validar_ruta(const char *ruta);
+int buscar_hijo(int padre, const char *componente, int longitud);
+int buscar_ruta(const char *ruta);
+int crear_directorios(const char *ruta, int longitud);
+int insertar_ruta(const char *ruta, int idx);
+int recolectar_subarbol(int n, int *archivos, int max);
+int aplicar_renombrado(const char *origen, const char *destino, int nodo);
+int mover_entre_shards(const char *origen, const char *destino, int nodo);
+void tomar_tablas_par(const char *a, const char *b);
+void soltar_tablas_par(const char *a, const char *b);
+int renombrar(const char *origen, const char *destino);
+int aplicar_copia(const char *origen, const char *destino, int nodo);
+int copiar_archivo(const char *origen, const char *destino);
+void tx_inicio(Transaccion *tx);
+int tx_escribir(Transaccion *tx, const char *nombre, const char *contenido, int longitud);
+void tx_abortar(Transaccion *tx);
+char *codificar_transaccion(const Transaccion *tx, int *longitud);
+int decodificar_transaccion(const char *datos, int longitud, Transaccion *tx);
+int aplicar_transaccion(Transaccion *tx, int nodo);
+int comparar_posiciones(const void *a, const void *b);
+int tx_confirmar(Transaccion *tx);
+void recolectar_entradas(int n, char *ruta, int largo, EntradaDirectorio *entradas, int *num);
+int listar_directorio(const char *ruta);
+char *direccion_bloque(int bloque);
+int reservar_bloques(int n);
+void liberar_bloques(int inicio, int n);
+int hash_contenido(uint32_t crc, int tamanio);
+int buscar_contenido(uint32_t crc, int tamanio, int tamanio_comprimido, const char *guardado);
+int celda_contenido(const Archivo *archivo);
+void insertar_contenido(const Archivo *archivo);
+void quitar_contenido(int c);
+void soltar_contenido(Archivo *archivo);
+int privatizar_contenido(Archivo *archivo);
+void registrar_contenido(Archivo *archivo);
+int cota_comprimido(int n);
+unsigned char *escribir_longitud_lz(unsigned char *salida, int resto);
+unsigned char *escribir_secuencia_lz(unsigned char *salida, const unsigned char *literales,
+                                     int num_literales, int distancia, int largo);
+int comprimir_lz(const char *origen, int n, char *destino);
+int leer_longitud_lz(const unsigned char **entrada, const unsigned char *fin);
+int descomprimir_lz(const char *origen, int n, char *destino, int capacidad);
+char *comprimir_contenido(const char *contenido, int longitud, int *tamanio_comprimido);
+int leer_contenido(const Archivo *archivo, char *destino);
+int modificar_comprimido(Archivo *archivo, int desplazamiento, const char *datos, int longitud);
+int asignar_contenido(Archivo *archivo, const char *contenido, int longitud, uint32_t crc);
+int guardar_contenido(Archivo *archivo, const char *guardado, int guardados, int longitud,
+                      int tamanio_comprimido, uint32_t crc);
+int ampliar_extension(Archivo *archivo, int necesarios);
+void inicializar_crc32c();
+uint32_t multiplicar_crc32c(uint32_t a, uint32_t b);
+uint32_t desplazar_crc32c(uint32_t crc, size_t bytes);
+uint32_t sustituir_crc32c(uint32_t crc, const char *antes, const char *despues,
+                          size_t n, size_t cola);
+void benchmark_lecturas(int segundos);
+int cubeta_latencia(uint64_t ns);
+uint64_t limite_cubeta(int cubeta);
+uint64_t percentil_latencia(const HistogramaLatencia *histograma, double percentil);
+int parsear_mezcla(const char *texto, int *pesos);
+void benchmark_carga(int procesos, int segundos, const char *mezcla);
+void mostrar_histograma(const char *nombre, const HistogramaLatencia *histograma, int segundos);
+int leer_comando_lote(FILE *entrada, int binario, ComandoLote *comando);
+int aplicar_progreso(const char *datos, int longitud, int nodo);
+int aplicar_resincronizacion(const char *datos, int longitud, int nodo);
+void aplicar_lote(ComandoLote *lote, int n, int nodo);
+long ejecutar_lote(const char *ruta);
+int64_t ahora_us();
+int anadir_bytes(char **buffer, size_t *tam, size_t *capacidad, const void *datos, size_t n);
+void replicar_operacion(int tipo, const char *nombre, const char *datos, int longitud,
+                        int desplazamiento);
+int enviar_todo(int fd, const char *datos, size_t n);
+void ruta_socket(int nodo, char *ruta, size_t tam);
+uint64_t posicion_tras_secuencia(uint64_t secuencia);
+void recortar_historial();
+int resincronizar_par(ParReplicacion *par);
+int conectar_par(ParReplicacion *par);
+void desconectar_par(ParReplicacion *par);
+void *hilo_confirmaciones(void *arg);
+void *hilo_emisor_replicacion(void *arg);
+void *hilo_servidor_replicacion(void *arg);
+void *hilo_receptor_replicacion(void *arg);
+int iniciar_replicacion(const char *lista_pares);
+int esperar_replicacion(int espera_ms);
+void detener_replicacion();
+void mostrar_replicacion();
+void benchmark_replicacion(int operaciones, int tamanio);
+int64_t ahora_ns();
+void actualizar_maximo(_Atomic uint64_t *maximo, uint64_t valor);
+int toca_muestra();
+void contar_adquisicion(int clase, int64_t espera);
+void contar_retencion(int clase, int64_t adquirido);
+AdquisicionLock *adquisicion_rwlock(pthread_rwlock_t *lock);
+void tomar_rwlock(pthread_rwlock_t *lock, int escritura);
+void tomar_lectura(pthread_rwlock_t *lock);
+void tomar_escritura(pthread_rwlock_t *lock);
+void soltar_rwlock(pthread_rwlock_t *lock);
+void tomar_mutex(pthread_mutex_t *mutex);
+void soltar_mutex(pthread_mutex_t *mutex);
+void tomar_mutex_compartido(pthread_mutex_t *mutex);
+void reparar_mutex(pthread_mutex_t *mutex);
+void rehacer_leases();
+void sanear_libres();
+void sanear_cola(ColaEspera *cola);
+int64_t iniciar_medida();
+void terminar_medida(int tipo, int64_t inicio);
+void mostrar_estadisticas(int nodo);
+void mostrar_deduplicacion(void);
+int volcar_estadisticas(const char *ruta);
+void reiniciar_estadisticas();
+int64_t ahora_ms();
+void latir();
+void intercambiar_leases(int a, int b);
+void subir_lease(int k);
+void bajar_lease(int k);
+void programar_lease(int posicion, int64_t expiracion);
+void cancelar_lease(int posicion);
+void expirar_leases_nodo(int nodo);
+void expirar_lease(int posicion);
+void despertar_sincronizacion();
 void *hilo_sincronizacion(void *arg);
+void *hilo_latido(void *arg);
 void *hilo_monitor(void *arg);
+int aplicar_crear(const char *nombre, const char *contenido, int longitud, int nodo);
+int aplicar_escritura(int i, const char *contenido, int longitud, int nodo);
+int aplicar_anexo(int i, const char *texto, int longitud, int nodo);
+int aplicar_escritura_parcial(int i, int desplazamiento, const char *datos, int longitud, int nodo);
+int aplicar_eliminacion(int pos, int nodo);
 int crear_archivo(const char *nombre, const char *contenido);
-int leer_archivo(const char *nombre, char *buffer);
+int leer_archivo(const char *nombre, char *buffer, int tam_buffer);
+int abrir_vista(const char *nombre, VistaArchivo *vista);
+void cerrar_vista(VistaArchivo *vista);
+int vista_vigente(const VistaArchivo *vista);
+int enviar_vista(int fd, const VistaArchivo *vista, const char *cabecera);
 int escribir_archivo(const char *nombre, const char *nuevo_contenido);
+int anexar_archivo(const char *nombre, const char *texto);
+int escribir_parcial_archivo(const char *nombre, int desplazamiento, const char *texto);
+int verificar_archivo(const char *nombre);
 int eliminar_archivo(const char *nombre);
+void avisar_futex(_Atomic uint32_t *avisos);
+void esperar_futex(_Atomic uint32_t *avisos, pthread_mutex_t *mutex, int64_t espera_ms);
+void avanzar_turno(ColaEspera *cola);
+void cancelar_turno(ColaEspera *cola, uint32_t ticket);
+int nodo_caido(int nodo);
+void reclamar_turnos(ColaEspera *cola);
+void cancelar_esperas_nodo(int nodo);
+void avisar_esperas(int i);
+int bloquear_archivo_espera(const char *nombre, int espera_ms);
 void registrar_log(int tipo_operacion, const char *nombre_archivo);
+AnilloLog anillo_log(int durable);
+int cubeta_log(const char *nombre);
+void anotar_log(const AnilloLog *anillo, int tipo_operacion, const char *nombre_archivo);
+void escribir_entrada_log(LogEntry *entrada, uint64_t ticket, int tipo_operacion,
+                          const char *nombre_archivo, uint64_t anterior_nodo,
+                          uint64_t anterior_nombre);
+int leer_entrada_log(LogEntry *entrada, uint64_t ticket, LogEntry *copia);
+int copiar_entrada_log(const AnilloLog *anillo, uint64_t ticket, LogEntry *copia);
+int cumple_filtro_log(const LogEntry *entrada, const FiltroLog *filtro);
+uint64_t buscar_instante_log(const AnilloLog *anillo, uint64_t inicio, uint64_t fin, time_t desde);
+int consultar_log(const AnilloLog *anillo, const FiltroLog *filtro, LogEntry *resultados);
+void abrir_log_durable();
+int crear_log_durable();
+void iniciar_cambio(int posicion);
+void publicar_cambio(int posicion);
+int instantanea_archivos(InfoArchivo *destino);
+int instantanea_shard(InfoArchivo *destino);
 void mostrar_archivos();
-void mostrar_log();
+void mostrar_entrada_log(const LogEntry *entrada);
+void mostrar_log(const FiltroLog *filtro);
+time_t leer_instante(const char *texto);
 void mostrar_estado_nodos();
 void manejador_sigint(int sig);
 
 // Inicializar el sistema de archivos
 void inicializar_sistema() {
-    // Crear memoria compartida
-    sistema = mmap(NULL, sizeof(SistemaArchivos), PROT_READ | PROT_WRITE,
-                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-                  
-    if (sistema == MAP_FAILED) {
-        perror("Error al crear la memoria compartida");
-        exit(EXIT_FAILURE);
-    }
+    // La región de datos empieza en el primer bloque tras los metadatos
+    size_t desplazamiento = BLOQUES_PARA(sizeof(SistemaArchivos)) * TAM_BLOQUE;
+    tam_sistema = desplazamiento + (size_t)num_bloques_datos * TAM_BLOQUE;
     
-    // Inicializar semáforos
+    // Inicializar semáforo
     sem_archivos = sem_open(NOMBRE_SEM_ARCHIVOS, O_CREAT, 0644, 1);
-    sem_logs = sem_open(NOMBRE_SEM_LOGS, O_CREAT, 0644, 1);
     
-    if (sem_archivos == SEM_FAILED || sem_logs == SEM_FAILED) {
-        perror("Error al crear los semáforos");
-        munmap(sistema, sizeof(SistemaArchivos));
+    if (sem_archivos == SEM_FAILED) {
+        perror("Error al crear el semáforo");
         exit(EXIT_FAILURE);
     }
     
-    // Bloquear semáforo para inicializar estructura
+    // Bloquear semáforo: sólo un proceso crea o valida el segmento a la vez
     sem_wait(sem_archivos);
     
-    // Inicializar estructura de sistema de archivos
-    memset(sistema->archivos, 0, sizeof(sistema->archivos));
-    sistema->num_archivos = 0;
-    sistema->indice_log = 0;
-    memset(sistema->nodos_activos, 0, sizeof(sistema->nodos_activos));
-    
-    // Marcar este nodo como activo
-    sistema->nodos_activos[id_nodo] = 1;
+    // El shard principal decide si el sistema es nuevo; si ya existía, su
+    // cabecera manda sobre --shards
+    int nuevo = proyectar_shard(0, 1);
+    if (nuevo < 0) {
+        sem_post(sem_archivos);
+        exit(EXIT_FAILURE);
+    }
+    principal = sistema = shards[0];
+    if (!nuevo && principal->cabecera.magia == MAGIA_SISTEMA && principal->cabecera.num_shards >= 1 &&
+        principal->cabecera.num_shards <= MAX_SHARDS) {
+        num_shards = principal->cabecera.num_shards;
+    }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
-}
-
-// Finalizar el sistema de archivos y liberar recursos
-void finalizar_sistema() {
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+    for (int k = 1; k < num_shards; k++) {
+        if (proyectar_shard(k, nuevo) < 0) {
+            desproyectar_shards();
+            sem_post(sem_archivos);
+            exit(EXIT_FAILURE);
+        }
+    }
     
-    // Marcar este nodo como inactivo
-    sistema->nodos_activos[id_nodo] = 0;
+    int vivos = 0;
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        if (nuevo) {
+            inicializar_estructura(desplazamiento);
+        } else if (!validar_cabecera()) {
+            printf("Error: El segmento existente no tiene un formato compatible\n");
+            desproyectar_shards();
+            sem_post(sem_archivos);
+            exit(EXIT_FAILURE);
+        }
+    }
+    sistema = principal;
+    if (!nuevo) {
+        vivos = arranque_en_caliente();
+    }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    // Con WAL, el primer nodo que abre un segmento nuevo o no cerrado
+    // limpiamente reconstruye el estado desde la imagen base y el WAL
+    if (ruta_wal != NULL && vivos == 0 && (nuevo || !principal->cabecera.apagado_limpio) &&
+        recuperar_wal() < 0) {
+        desproyectar_shards();
+        sem_post(sem_archivos);
+        exit(EXIT_FAILURE);
+    }
     
-    // Liberar recursos
-    munmap(sistema, sizeof(SistemaArchivos));
-    sem_close(sem_archivos);
-    sem_close(sem_logs);
+    // Marcar este nodo como activo
+    if (principal->nodos_activos[id_nodo]) {
+        printf("Error: El nodo %d ya está activo\n", id_nodo);
+        desproyectar_shards();
+        sem_post(sem_archivos);
+        exit(EXIT_FAILURE);
+    }
+    principal->nodos_activos[id_nodo] = 1;
+    principal->pid_nodos[id_nodo] = getpid();
+    principal->cabecera.apagado_limpio = 0;
+    latir();
     
-    // Intentar eliminar semáforos si es el último nodo
-    int nodos_restantes = 0;
-    for (int i = 0; i < MAX_NODOS; i++) {
-        if (sistema->nodos_activos[i]) {
-            nodos_restantes++;
-        }
+    if (ruta_wal != NULL) {
+        abrir_wal(vivos == 0);
     }
     
-    if (nodos_restantes == 0) {
-        sem_unlink(NOMBRE_SEM_ARCHIVOS);
-        sem_unlink(NOMBRE_SEM_LOGS);
+    // Desbloquear semáforo
+    sem_post(sem_archivos);
+    
+    if (ruta_log_durable != NULL) {
+        abrir_log_durable();
     }
 }
 
-// Función para el hilo de sincronización
-void *hilo_sincronizacion(void *arg) {
-    struct timespec ts = {0, 500000000}; // 500ms
+// Abrir y proyectar el segmento del shard k (requiere sem_archivos). En modo
+// persistente el shard 0 usa el nombre de --shm/--archivo y el shard k, ese
+// nombre seguido de ".k". Si el sistema es nuevo (nuevo = 1), un segmento
+// que quedara de una ejecución anterior se vacía; si no, debe existir con el
+// tamaño del principal. Devuelve 1 si el segmento es nuevo, 0 si ya existía
+// o -1 si hay un error
+int proyectar_shard(int k, int nuevo) {
+    SistemaArchivos *segmento;
     
-    while (continuar) {
-        // Pequeña pausa para no consumir demasiada CPU
-        nanosleep(&ts, NULL);
+    if (nombre_shm != NULL || ruta_persistente != NULL) {
+        // Modo persistente: objeto shm_open o archivo en disco compartido
+        // por procesos independientes
+        char nombre[PATH_MAX];
+        const char *base = (nombre_shm != NULL) ? nombre_shm : ruta_persistente;
+        if (k == 0) {
+            snprintf(nombre, sizeof(nombre), "%s", base);
+        } else {
+            snprintf(nombre, sizeof(nombre), "%s.%d", base, k);
+        }
         
-        // Bloquear semáforo
-        sem_wait(sem_archivos);
+        int fd;
+        if (nombre_shm != NULL) {
+            fd = shm_open(nombre, O_RDWR | O_CREAT, 0644);
+        } else {
+            fd = open(nombre, O_RDWR | O_CREAT, 0644);
+        }
         
-        // Verificar si hay archivos bloqueados por nodos inactivos
-        for (int i = 0; i < sistema->num_archivos; i++) {
-            if (sistema->archivos[i].bloqueado && 
-                !sistema->nodos_activos[sistema->archivos[i].nodo_bloqueo]) {
-                printf("[Sincronización] Liberando bloqueo del archivo %s de un nodo inactivo\n", 
-                       sistema->archivos[i].nombre);
-                sistema->archivos[i].bloqueado = 0;
-                sistema->archivos[i].nodo_bloqueo = -1;
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror("Error al abrir el segmento persistente");
+            if (fd >= 0) {
+                close(fd);
             }
+            return -1;
         }
         
-        // Desbloquear semáforo
-        sem_post(sem_archivos);
+        if (k == 0 && st.st_size > 0) {
+            // El segmento ya existe: su tamaño manda sobre --bloques
+            nuevo = 0;
+            tam_sistema = st.st_size;
+        } else if (!nuevo && st.st_size != (off_t)tam_sistema) {
+            printf("Error: Falta el segmento del shard %d o no tiene el tamaño del principal\n", k);
+            close(fd);
+            return -1;
+        } else if (nuevo && (ftruncate(fd, 0) < 0 || ftruncate(fd, tam_sistema) < 0)) {
+            perror("Error al dimensionar el segmento persistente");
+            close(fd);
+            return -1;
+        }
+        
+        segmento = mmap(NULL, tam_sistema, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (segmento == MAP_FAILED) {
+            close(fd);
+        } else {
+            fd_shards[k] = fd;
+        }
+    } else {
+        // Crear memoria compartida (las páginas de datos no usadas no ocupan memoria)
+        segmento = mmap(NULL, tam_sistema, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
     }
     
-    return NULL;
+    if (segmento == MAP_FAILED) {
+        perror("Error al crear la memoria compartida");
+        return -1;
+    }
+    
+    shards[k] = segmento;
+    return nuevo;
 }
 
-// Función para el hilo de monitoreo
-void *hilo_monitor(void *arg) {
-    struct timespec ts = {0, 2000000000}; // 2 segundos
+// Liberar las proyecciones y los descriptores de todos los shards abiertos
+void desproyectar_shards() {
+    for (int k = 0; k < MAX_SHARDS; k++) {
+        if (shards[k] != NULL) {
+            munmap(shards[k], tam_sistema);
+            shards[k] = NULL;
+        }
+        if (fd_shards[k] >= 0) {
+            close(fd_shards[k]);
+            fd_shards[k] = -1;
+        }
+    }
+    principal = sistema = NULL;
+}
+
+// Shard de un nombre: hash FNV-1a de su primer componente, mezclado con una
+// multiplicación de Fibonacci para no depender de los bits bajos, que
+// eligen la celda del índice dentro del shard
+int indice_shard(const char *nombre) {
+    unsigned int hash = 2166136261u;
     
-    while (continuar) {
-        // Pequeña pausa
-        nanosleep(&ts, NULL);
-        
-        // Mostrar estado actual del sistema
-        printf("\n=== ESTADO DEL SISTEMA (Nodo %d) ===\n", id_nodo);
-        mostrar_estado_nodos();
-        mostrar_archivos();
+    while (*nombre != '\0' && *nombre != '/') {
+        hash ^= (unsigned char)*nombre++;
+        hash *= 16777619u;
     }
     
-    return NULL;
+    return ((hash * 0x9E3779B1u) >> 16) % num_shards;
 }
 
-// Función para crear un nuevo archivo
-int crear_archivo(const char *nombre, const char *contenido) {
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
-    
-    // Verificar si el archivo ya existe
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        if (strcmp(sistema->archivos[i].nombre, nombre) == 0) {
-            sem_post(sem_archivos);
-            return -1; // El archivo ya existe
+// Hacer que este hilo opere sobre el shard del nombre dado
+void usar_shard(const char *nombre) {
+    sistema = shards[indice_shard(nombre)];
+}
+
+// Shard al que pertenece una dirección de algún segmento (p. ej. un lock)
+int shard_de(const void *direccion) {
+    for (int k = 1; k < num_shards; k++) {
+        if ((const char *)direccion >= (const char *)shards[k] &&
+            (const char *)direccion < (const char *)shards[k] + tam_sistema) {
+            return k;
         }
     }
     
-    // Verificar si hay espacio para más archivos
-    if (sistema->num_archivos >= MAX_ARCHIVOS) {
-        sem_post(sem_archivos);
-        return -2; // Sistema lleno
+    return 0;
+}
+
+// Tomar lock_tabla de todos los shards, siempre en orden de shard para que
+// dos hilos que los toman a la vez no se bloqueen mutuamente
+void tomar_tablas(int escritura) {
+    for (int k = 0; k < num_shards; k++) {
+        tomar_rwlock(&shards[k]->lock_tabla, escritura);
+    }
+}
+
+// Soltar lock_tabla de todos los shards tomada con tomar_tablas
+void soltar_tablas() {
+    for (int k = num_shards - 1; k >= 0; k--) {
+        soltar_rwlock(&shards[k]->lock_tabla);
+    }
+}
+
+// Inicializar los locks compartidos entre procesos
+void inicializar_sincronizacion() {
+    // La tabla prefiere escritores para que crear/eliminar no esperen
+    // indefinidamente detrás de un flujo continuo de lecturas
+    pthread_rwlockattr_t rwlock_attr;
+    pthread_rwlockattr_init(&rwlock_attr);
+    pthread_rwlockattr_setpshared(&rwlock_attr, PTHREAD_PROCESS_SHARED);
+    for (int i = 0; i < MAX_ARCHIVOS; i++) {
+        pthread_rwlock_init(&sistema->locks_archivos[i], &rwlock_attr);
     }
+    pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&sistema->lock_tabla, &rwlock_attr);
+    pthread_rwlockattr_destroy(&rwlock_attr);
     
-    // Crear el nuevo archivo
-    int idx = sistema->num_archivos;
-    strncpy(sistema->archivos[idx].nombre, nombre, MAX_NOMBRE - 1);
-    strncpy(sistema->archivos[idx].contenido, contenido, MAX_CONTENIDO - 1);
-    sistema->archivos[idx].tamanio = strlen(contenido);
-    sistema->archivos[idx].propietario = id_nodo;
-    sistema->archivos[idx].ultima_modificacion = time(NULL);
-    sistema->archivos[idx].bloqueado = 0;
-    sistema->archivos[idx].nodo_bloqueo = -1;
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST); // Ver reparar_mutex
+    pthread_mutex_init(&sistema->lock_datos, &mutex_attr);
+    pthread_mutex_init(&sistema->lock_leases, &mutex_attr);
     
-    // Incrementar contador de archivos
-    sistema->num_archivos++;
+    atomic_store(&sistema->avisos_leases, 0);
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    // Las colas de espera quedan vacías: sus nodos ya no existen
+    for (int i = 0; i < MAX_ARCHIVOS; i++) {
+        ColaEspera *cola = &sistema->esperas[i];
+        pthread_mutex_init(&cola->mutex, &mutex_attr);
+        atomic_store(&cola->avisos, 0);
+        cola->turno = cola->siguiente = 0;
+        cola->cancelados = 0;
+    }
+    pthread_mutexattr_destroy(&mutex_attr);
+}
+
+// Inicializar un segmento recién creado. mmap y ftruncate lo entregan lleno
+// de ceros, así que sólo se escriben los campos con valor inicial distinto
+void inicializar_estructura(size_t desplazamiento) {
+    sistema->primera_libre = -1;
     
-    // Registrar operación en el log
-    registrar_log(0, nombre);
+    inicializar_sincronizacion();
+    inicializar_directorio();
     
-    printf("[Nodo %d] Archivo %s creado correctamente\n", id_nodo, nombre);
-    return 0; // Éxito
+    // Al principio toda la región de datos es un único hueco
+    sistema->num_bloques = (tam_sistema - desplazamiento) / TAM_BLOQUE;
+    sistema->desplazamiento_datos = desplazamiento;
+    sistema->libres[0].inicio = 0;
+    sistema->libres[0].num_bloques = sistema->num_bloques;
+    sistema->num_libres = 1;
+    
+    // La cabecera se escribe al final: un segmento con la magia correcta
+    // está completamente inicializado
+    sistema->cabecera.version = VERSION_SISTEMA;
+    sistema->cabecera.tam_total = tam_sistema;
+    sistema->cabecera.tam_metadatos = sizeof(SistemaArchivos);
+    sistema->cabecera.num_shards = num_shards;
+    sistema->cabecera.shard = shard_de(sistema);
+    sistema->cabecera.magia = MAGIA_SISTEMA;
 }
 
-// Función para leer un archivo
-int leer_archivo(const char *nombre, char *buffer) {
-    int resultado = -1;
-    
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+// Comprobar que un segmento existente es de este programa y de esta
+// versión, y que es el shard que ocupa en este sistema
+int validar_cabecera() {
+    return sistema->cabecera.magia == MAGIA_SISTEMA &&
+           sistema->cabecera.version == VERSION_SISTEMA &&
+           sistema->cabecera.tam_metadatos == sizeof(SistemaArchivos) &&
+           sistema->cabecera.tam_total == tam_sistema &&
+           sistema->cabecera.num_shards == num_shards &&
+           sistema->cabecera.shard == shard_de(sistema);
+}
+
+// Reabrir un segmento existente sin reinicializarlo (requiere sem_archivos).
+// Sólo se revisan los nodos: si ninguno sigue vivo, los locks pueden haber
+// quedado tomados por un proceso que terminó y se reinician.
+// Devuelve el número de nodos vivos
+int arranque_en_caliente() {
+    int vivos = 0;
     
-    // Buscar el archivo
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        if (strcmp(sistema->archivos[i].nombre, nombre) == 0) {
-            // Copiar el contenido al buffer
-            strcpy(buffer, sistema->archivos[i].contenido);
-            resultado = sistema->archivos[i].tamanio;
-            break;
+    for (int i = 0; i < MAX_NODOS; i++) {
+        if (!principal->nodos_activos[i]) {
+            continue;
+        }
+        
+        // kill con señal 0 sólo comprueba si el proceso existe
+        if (principal->pid_nodos[i] > 0 &&
+            (kill(principal->pid_nodos[i], 0) == 0 || errno == EPERM)) {
+            vivos++;
+        } else {
+            principal->nodos_activos[i] = 0;
+            principal->pid_nodos[i] = 0;
         }
     }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
-    
-    if (resultado >= 0) {
-        // Registrar operación en el log
-        registrar_log(1, nombre);
-        printf("[Nodo %d] Archivo %s leído correctamente (%d bytes)\n", 
-               id_nodo, nombre, resultado);
+    if (vivos == 0) {
+        liberar_estado_huerfano();
+        
+        // Sin WAL no hay nada con que reconstruirlo (ver checkpoint_sistema)
+        if (!principal->cabecera.apagado_limpio && ruta_wal == NULL) {
+            printf("Aviso: el segmento no se cerró limpiamente y puede no ser coherente "
+                   "(último checkpoint: %llu; use --wal para recuperarse de una caída)\n",
+                   (unsigned long long)principal->cabecera.checkpoints);
+        }
     }
     
-    return resultado;
+    int archivos = 0;
+    for (int k = 0; k < num_shards; k++) {
+        archivos += shards[k]->num_archivos;
+    }
+    printf("Arranque en caliente: %d archivos en %d shards, %d nodos activos\n",
+           archivos, num_shards, vivos);
+    return vivos;
 }
 
-// Función para escribir en un archivo
-int escribir_archivo(const char *nombre, const char *nuevo_contenido) {
-    int resultado = -1;
+// Reiniciar en todos los shards el estado que sólo tiene sentido con los
+// procesos que lo crearon (requiere sem_archivos y que no quede ningún nodo vivo)
+void liberar_estado_huerfano() {
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        inicializar_sincronizacion();
+        
+        // Los leases pertenecían a procesos que ya no existen (y el reloj
+        // monotónico pudo reiniciarse): se liberan todos
+        for (int i = 0; i < sistema->max_posicion; i++) {
+            sistema->archivos[i].bloqueado = 0;
+            sistema->archivos[i].nodo_bloqueo = -1;
+        }
+        sistema->num_leases = 0;
+        
+        // Un nodo caído a mitad de un cambio deja su secuencia impar
+        for (int i = 0; i < MAX_ARCHIVOS; i++) {
+            if (atomic_load(&sistema->secuencia_archivos[i]) & 1) {
+                atomic_fetch_add(&sistema->secuencia_archivos[i], 1);
+            }
+        }
+        memset(sistema->pos_heap, 0, sizeof(sistema->pos_heap));
+        recontar_contenidos();
+    }
+    sistema = principal;
     
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+    // Los registros que esos nodos tuvieran sin escribir ya no llegarán al WAL
+    for (int n = 0; n < MAX_NODOS; n++) {
+        atomic_store(&principal->wal_pendiente[n], 0);
+    }
+}
+
+// Ajustar las referencias de la tabla de contenidos del shard actual a los
+// archivos que de verdad los usan (requiere que no quede ningún nodo vivo):
+// las vistas de un proceso caído dejan referencias de más (ver abrir_vista)
+void recontar_contenidos() {
+    int *usos = calloc(TAM_CONTENIDOS, sizeof(int));
+    ContenidoCompartido *sobrantes = malloc(TAM_CONTENIDOS * sizeof(ContenidoCompartido));
+    if (usos == NULL || sobrantes == NULL) {
+        free(usos);
+        free(sobrantes);
+        return;
+    }
     
-    // Buscar el archivo
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        if (strcmp(sistema->archivos[i].nombre, nombre) == 0) {
-            // Verificar si el archivo está bloqueado
-            if (sistema->archivos[i].bloqueado && 
-                sistema->archivos[i].nodo_bloqueo != id_nodo) {
-                sem_post(sem_archivos);
-                return -2; // Archivo bloqueado por otro nodo
-            }
-            
-            // Actualizar el contenido del archivo
-            strncpy(sistema->archivos[i].contenido, nuevo_contenido, MAX_CONTENIDO - 1);
-            sistema->archivos[i].tamanio = strlen(nuevo_contenido);
-            sistema->archivos[i].ultima_modificacion = time(NULL);
-            resultado = sistema->archivos[i].tamanio;
-            break;
+    for (int i = 0; i < sistema->max_posicion; i++) {
+        if (sistema->archivos[i].en_uso) {
+            int c = celda_contenido(&sistema->archivos[i]);
+            if (c >= 0) {
+                usos[c]++;
+            }
         }
     }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    // Quitar una celda desplaza otras: primero se ajustan las que siguen en
+    // uso y se apartan las que ya no usa nadie, y después se sueltan éstas
+    int num_sobrantes = 0;
+    for (int c = 0; c < TAM_CONTENIDOS; c++) {
+        if (sistema->contenidos[c].referencias > 0) {
+            if (usos[c] == 0) {
+                sobrantes[num_sobrantes++] = sistema->contenidos[c];
+                sistema->contenidos[c].referencias = 1;
+            } else {
+                sistema->contenidos[c].referencias = usos[c];
+            }
+        }
+    }
+    for (int k = 0; k < num_sobrantes; k++) {
+        Archivo retenido = {0};
+        retenido.crc = sobrantes[k].crc;
+        retenido.tamanio = sobrantes[k].tamanio;
+        retenido.datos = sobrantes[k].datos;
+        soltar_contenido(&retenido);
+    }
     
-    if (resultado >= 0) {
-        // Registrar operación en el log
-        registrar_log(2, nombre);
-        printf("[Nodo %d] Archivo %s modificado correctamente (%d bytes)\n", 
-               id_nodo, nombre, resultado);
+    free(usos);
+    free(sobrantes);
+}
+
+// Guardar un checkpoint del segmento persistente. Con la tabla en exclusiva
+// no hay ninguna escritura a medias, y la cabecera sólo se actualiza
+// después de que todos los datos estén en disco. Pero sin WAL el archivo
+// del segmento es la propia proyección MAP_SHARED: el núcleo puede escribir
+// sus páginas en cualquier momento, así que tras una caída el archivo puede
+// mezclar páginas de antes y de después del último checkpoint. En ese modo
+// sólo se garantiza una imagen coherente tras un cierre limpio (el último
+// nodo hace un checkpoint y marca apagado_limpio), y por eso --checkpoint
+// exige --wal. Con WAL también se
+// guarda la imagen base en un temporal que se renombra, y ésa sí sobrevive
+// a una caída (ver recuperar_wal), incluso en memoria anónima.
+// Todos los shards se toman a la vez para que el checkpoint sea coherente
+int checkpoint_sistema() {
+    if (fd_shards[0] < 0 && wal.fd < 0) {
+        return -1; // La memoria anónima no se puede sincronizar con disco
+    }
+    
+    tomar_tablas(1);
+    int resultado = escribir_checkpoint();
+    soltar_tablas();
+    
+    return resultado;
+}
+
+// Escribir el checkpoint (requiere lock_tabla de todos los shards en
+// escritura y modo persistente o WAL). Devuelve 0 o -1 si falla
+int escribir_checkpoint() {
+    int resultado = 0;
+    for (int k = 0; k < num_shards && resultado == 0; k++) {
+        if (fd_shards[k] >= 0) {
+            resultado = msync(shards[k], tam_sistema, MS_SYNC);
+        }
+    }
+    if (resultado == 0 && log_durable != NULL) {
+        resultado = msync(log_durable, tam_log_durable, MS_SYNC);
+    }
+    if (resultado == 0 && wal.fd >= 0) {
+        resultado = guardar_imagen_base();
+    }
+    for (int k = 0; k < num_shards && resultado == 0; k++) {
+        shards[k]->cabecera.checkpoints++;
+        shards[k]->cabecera.ultimo_checkpoint = time(NULL);
+        if (fd_shards[k] >= 0) {
+            resultado = msync(shards[k], sizeof(Cabecera), MS_SYNC);
+        }
+    }
+    
+    return resultado;
+}
+
+// Función para el hilo de checkpoints automáticos
+void *hilo_checkpoint(void *arg) {
+    struct timespec ts = {1, 0}; // 1 segundo
+    sistema = principal;
+    int transcurridos = 0;
+    
+    while (continuar) {
+        nanosleep(&ts, NULL);
+        
+        if (++transcurridos >= intervalo_checkpoint) {
+            if (checkpoint_sistema() < 0) {
+                perror("Error en el checkpoint");
+            }
+            transcurridos = 0;
+        }
+    }
+    
+    return NULL;
+}
+
+// Finalizar el sistema de archivos y liberar recursos
+void finalizar_sistema() {
+    // Bloquear semáforo
+    sem_wait(sem_archivos);
+    
+    // Marcar este nodo como inactivo y adelantar la expiración de sus
+    // leases para que otro nodo los libere ya
+    principal->nodos_activos[id_nodo] = 0;
+    principal->pid_nodos[id_nodo] = 0;
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        expirar_leases_nodo(id_nodo);
+        cancelar_esperas_nodo(id_nodo);
+    }
+    sistema = principal;
+    
+    // Contar los nodos restantes antes de liberar la memoria compartida
+    int nodos_restantes = 0;
+    for (int i = 0; i < MAX_NODOS; i++) {
+        if (principal->nodos_activos[i]) {
+            nodos_restantes++;
+        }
+    }
+    
+    // El último nodo deja el segmento persistente sincronizado y marcado
+    // como cerrado limpiamente (con WAL, además, una imagen base al día)
+    if (nodos_restantes == 0 && checkpoint_sistema() == 0 && fd_shards[0] >= 0) {
+        principal->cabecera.apagado_limpio = 1;
+        msync(principal, sizeof(Cabecera), MS_SYNC);
+    }
+    
+    // Desbloquear semáforo
+    sem_post(sem_archivos);
+    
+    cerrar_wal();
+    
+    // Liberar recursos
+    desproyectar_shards();
+    if (log_durable != NULL) {
+        munmap(log_durable, tam_log_durable);
+    }
+    sem_close(sem_archivos);
+    
+    // Intentar eliminar el semáforo si es el último nodo
+    if (nodos_restantes == 0) {
+        sem_unlink(NOMBRE_SEM_ARCHIVOS);
+    }
+}
+
+// Escribir n bytes en un descriptor que no es un socket (archivos del WAL)
+int escribir_todo(int fd, const char *datos, size_t n) {
+    while (n > 0) {
+        ssize_t escritos = write(fd, datos, n);
+        if (escritos < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        datos += escritos;
+        n -= escritos;
+    }
+    
+    return 0;
+}
+
+// Ruta de la imagen base del WAL: <wal>.base
+void ruta_imagen_base(char *ruta, size_t tam) {
+    snprintf(ruta, tam, "%s%s", ruta_wal, SUFIJO_IMAGEN_BASE);
+}
+
+// Guardar la imagen base y vaciar el WAL (requiere lock_tabla de todos los
+// shards en escritura). Los registros aún sin escribir tienen un LSN no
+// mayor que el del checkpoint, porque se anotaron con sus locks tomados:
+// la imagen ya los incluye y, si llegan al WAL vaciado, la recuperación
+// los descarta. La imagen guarda
+// los segmentos de todos los shards uno tras otro y se escribe en un
+// temporal y se renombra, así que una caída a mitad deja la anterior, y el
+// WAL sólo se vacía cuando la nueva ya está en disco
+int guardar_imagen_base() {
+    char ruta[PATH_MAX], temporal[PATH_MAX];
+    ruta_imagen_base(ruta, sizeof(ruta));
+    snprintf(temporal, sizeof(temporal), "%s%s.tmp", ruta_wal, SUFIJO_IMAGEN_BASE);
+    
+    uint64_t lsn = atomic_load(&principal->ultimo_lsn);
+    for (int k = 0; k < num_shards; k++) {
+        shards[k]->cabecera.lsn_checkpoint = lsn;
+    }
+    
+    int fd = open(temporal, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int resultado = 0;
+    for (int k = 0; k < num_shards && resultado == 0; k++) {
+        resultado = escribir_todo(fd, (const char *)shards[k], tam_sistema);
+    }
+    if (resultado == 0) {
+        resultado = fdatasync(fd);
+    }
+    close(fd);
+    if (resultado == 0) {
+        resultado = sustituir_archivo(temporal, ruta);
+    }
+    
+    if (resultado == 0) {
+        resultado = ftruncate(wal.fd, 0);
+    }
+    
+    return resultado;
+}
+
+// Renombrar un temporal ya sincronizado sobre ruta. El renombrado sólo es
+// duradero cuando lo está el directorio. Devuelve 0 o -1 si falla
+int sustituir_archivo(const char *temporal, const char *ruta) {
+    if (rename(temporal, ruta) < 0) {
+        return -1;
+    }
+    
+    char directorio[PATH_MAX];
+    snprintf(directorio, sizeof(directorio), "%s", ruta);
+    char *barra = strrchr(directorio, '/');
+    if (barra == NULL) {
+        strcpy(directorio, ".");
+    } else if (barra == directorio) {
+        barra[1] = '\0';
+    } else {
+        *barra = '\0';
+    }
+    
+    int fd_dir = open(directorio, O_RDONLY | O_DIRECTORY);
+    if (fd_dir >= 0) {
+        fsync(fd_dir);
+        close(fd_dir);
+    }
+    
+    return 0;
+}
+
+// Exportar todos los archivos a una instantánea en ruta. Los contenidos se
+// copian tal como están guardados (sin descomprimir) y los compartidos, una
+// sola vez por shard. La instantánea se arma en memoria con todas las tablas
+// en escritura y se escribe después, fuera de los locks, con una sola
+// escritura secuencial en un temporal que se renombra.
+// Devuelve el número de archivos exportados o -1 si falla
+int exportar_instantanea(const char *ruta) {
+    tomar_tablas(1);
+    
+    // Primera pasada: medir. Con todas las tablas en escritura nadie cambia
+    // los contenidos, así que no hace falta lock_datos
+    uint32_t num_archivos = 0;
+    uint64_t tam_contenidos = 0;
+    uint64_t desplazamientos[TAM_CONTENIDOS];
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        memset(desplazamientos, 0xff, sizeof(desplazamientos));
+        for (int i = 0; i < MAX_ARCHIVOS; i++) {
+            Archivo *archivo = &sistema->archivos[i];
+            if (!archivo->en_uso) {
+                continue;
+            }
+            num_archivos++;
+            int c = celda_contenido(archivo);
+            if (c >= 0 && desplazamientos[c] == UINT64_MAX) {
+                desplazamientos[c] = tam_contenidos;
+                tam_contenidos += (archivo->tamanio_comprimido > 0)
+                                  ? archivo->tamanio_comprimido : archivo->tamanio;
+            }
+        }
+    }
+    
+    size_t tam_entradas = (size_t)num_archivos * sizeof(EntradaInstantanea);
+    size_t tam_total = sizeof(CabeceraInstantanea) + tam_entradas + tam_contenidos;
+    char *imagen = malloc(tam_total);
+    if (imagen == NULL) {
+        soltar_tablas();
+        return -1;
+    }
+    
+    // Segunda pasada: copiar metadatos y contenidos en el mismo orden, así
+    // que cada contenido cae en el desplazamiento medido
+    CabeceraInstantanea *cabecera = (CabeceraInstantanea *)imagen;
+    EntradaInstantanea *entradas = (EntradaInstantanea *)(cabecera + 1);
+    char *contenidos = (char *)(entradas + num_archivos);
+    uint32_t n = 0;
+    uint64_t colocados = 0;
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        memset(desplazamientos, 0xff, sizeof(desplazamientos));
+        for (int i = 0; i < MAX_ARCHIVOS; i++) {
+            Archivo *archivo = &sistema->archivos[i];
+            if (!archivo->en_uso) {
+                continue;
+            }
+            int guardados = (archivo->tamanio_comprimido > 0)
+                            ? archivo->tamanio_comprimido : archivo->tamanio;
+            int c = celda_contenido(archivo);
+            if (c >= 0 && desplazamientos[c] == UINT64_MAX) {
+                desplazamientos[c] = colocados;
+                memcpy(contenidos + colocados, direccion_bloque(archivo->datos.inicio), guardados);
+                colocados += guardados;
+            }
+            
+            EntradaInstantanea *entrada = &entradas[n++];
+            memset(entrada, 0, sizeof(*entrada));
+            memcpy(entrada->nombre, archivo->nombre, MAX_NOMBRE);
+            entrada->propietario = archivo->propietario;
+            entrada->ultima_modificacion = archivo->ultima_modificacion;
+            entrada->crc = archivo->crc;
+            entrada->tamanio = archivo->tamanio;
+            entrada->tamanio_comprimido = archivo->tamanio_comprimido;
+            entrada->desplazamiento = (c >= 0) ? desplazamientos[c] : 0;
+        }
+    }
+    
+    soltar_tablas();
+    
+    memset(cabecera, 0, sizeof(*cabecera));
+    cabecera->magia = MAGIA_INSTANTANEA;
+    cabecera->version = VERSION_INSTANTANEA;
+    cabecera->tam_entrada = sizeof(EntradaInstantanea);
+    cabecera->num_archivos = num_archivos;
+    cabecera->tam_contenidos = tam_contenidos;
+    cabecera->crc = crc32c(0, entradas, tam_entradas + tam_contenidos);
+    
+    char temporal[PATH_MAX];
+    snprintf(temporal, sizeof(temporal), "%s.tmp", ruta);
+    int fd = open(temporal, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int resultado = (fd >= 0) ? escribir_todo(fd, imagen, tam_total) : -1;
+    if (resultado == 0) {
+        resultado = fdatasync(fd);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (resultado == 0) {
+        resultado = sustituir_archivo(temporal, ruta);
+    } else if (fd >= 0) {
+        unlink(temporal);
+    }
+    free(imagen);
+    
+    return (resultado == 0) ? (int)num_archivos : -1;
+}
+
+// Crear en el shard actual un archivo de una instantánea con su contenido ya
+// guardado (requiere lock_tabla en escritura). Devuelve su posición, -1 si
+// ya existe, -2 si el sistema está lleno, -3 si no hay espacio o -4 si la
+// ruta no es válida
+int aplicar_importacion(const EntradaInstantanea *entrada, const char *guardado) {
+    int idx = aplicar_crear(entrada->nombre, "", 0, entrada->propietario);
+    if (idx < 0) {
+        return idx;
+    }
+    
+    Archivo *archivo = &sistema->archivos[idx];
+    int guardados = (entrada->tamanio_comprimido > 0) ? entrada->tamanio_comprimido
+                                                      : entrada->tamanio;
+    iniciar_cambio(idx);
+    int resultado = guardar_contenido(archivo, guardado, guardados, entrada->tamanio,
+                                      entrada->tamanio_comprimido, entrada->crc);
+    archivo->ultima_modificacion = entrada->ultima_modificacion;
+    publicar_cambio(idx);
+    
+    if (resultado < 0) {
+        aplicar_eliminacion(buscar_en_indice(entrada->nombre), entrada->propietario);
+        return -3;
+    }
+    return idx;
+}
+
+// Cargar una instantánea exportada. El archivo se proyecta con mmap y los
+// contenidos se copian directamente desde la proyección a su extensión, sin
+// descomprimirlos ni volver a comprimirlos. Los archivos que ya existen se
+// omiten. En modo persistente o con WAL se hace un checkpoint antes de
+// soltar las tablas, porque lo importado no pasa por el WAL.
+// Devuelve el número de archivos importados o -1 si la instantánea no es válida
+long importar_instantanea(const char *ruta) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        perror("Error al abrir la instantánea");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CabeceraInstantanea)) {
+        printf("Error: %s no es una instantánea\n", ruta);
+        close(fd);
+        return -1;
+    }
+    
+    size_t tam = st.st_size;
+    const char *imagen = mmap(NULL, tam, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (imagen == MAP_FAILED) {
+        perror("Error al proyectar la instantánea");
+        return -1;
+    }
+    madvise((void *)imagen, tam, MADV_SEQUENTIAL);
+    
+    // Validar la cabecera, los tamaños y la CRC antes de tocar nada
+    const CabeceraInstantanea *cabecera = (const CabeceraInstantanea *)imagen;
+    const EntradaInstantanea *entradas = (const EntradaInstantanea *)(cabecera + 1);
+    size_t disponibles = tam - sizeof(CabeceraInstantanea);
+    if (cabecera->magia != MAGIA_INSTANTANEA || cabecera->version != VERSION_INSTANTANEA ||
+        cabecera->tam_entrada != sizeof(EntradaInstantanea) ||
+        cabecera->num_archivos > disponibles / sizeof(EntradaInstantanea) ||
+        cabecera->tam_contenidos !=
+            disponibles - (size_t)cabecera->num_archivos * sizeof(EntradaInstantanea) ||
+        crc32c(0, entradas, disponibles) != cabecera->crc) {
+        printf("Error: La instantánea %s no es válida o está dañada\n", ruta);
+        munmap((void *)imagen, tam);
+        return -1;
+    }
+    const char *contenidos = (const char *)(entradas + cabecera->num_archivos);
+    
+    struct timespec inicio, fin;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    
+    // Anotar qué archivos se importan para registrarlos en el log después,
+    // fuera de los locks
+    char *importados = calloc(cabecera->num_archivos ? cabecera->num_archivos : 1, 1);
+    if (importados == NULL) {
+        munmap((void *)imagen, tam);
+        return -1;
+    }
+    
+    long correctos = 0, omitidos = 0;
+    tomar_tablas(1);
+    for (uint32_t j = 0; j < cabecera->num_archivos; j++) {
+        const EntradaInstantanea *entrada = &entradas[j];
+        int guardados = (entrada->tamanio_comprimido > 0) ? entrada->tamanio_comprimido
+                                                          : entrada->tamanio;
+        if (memchr(entrada->nombre, '\0', MAX_NOMBRE) == NULL || entrada->tamanio < 0 ||
+            entrada->tamanio_comprimido < 0 ||
+            entrada->desplazamiento + (uint64_t)guardados > cabecera->tam_contenidos ||
+            entrada->propietario < 0 || entrada->propietario >= MAX_NODOS) {
+            omitidos++;
+            continue;
+        }
+        
+        usar_shard(entrada->nombre);
+        const char *guardado = contenidos + entrada->desplazamiento;
+        if (aplicar_importacion(entrada, guardado) < 0) {
+            omitidos++;
+            continue;
+        }
+        importados[j] = 1;
+        correctos++;
+        
+        // Replicar con las tablas tomadas, como cualquier operación (ver
+        // anotar_operacion). Los pares reciben el contenido sin
+        // comprimir, como en crear
+        if (!replicacion.activa) {
+            continue;
+        }
+        if (entrada->tamanio_comprimido == 0) {
+            replicar_operacion(OP_CREAR, entrada->nombre, guardado, entrada->tamanio, -1);
+            continue;
+        }
+        char *contenido = malloc(entrada->tamanio);
+        if (contenido != NULL &&
+            descomprimir_lz(guardado, entrada->tamanio_comprimido, contenido,
+                            entrada->tamanio) == entrada->tamanio) {
+            replicar_operacion(OP_CREAR, entrada->nombre, contenido, entrada->tamanio, -1);
+        }
+        free(contenido);
+    }
+    if (correctos > 0 && (fd_shards[0] >= 0 || wal.fd >= 0) && escribir_checkpoint() < 0) {
+        printf("Advertencia: No se pudo hacer el checkpoint tras la importación\n");
+    }
+    soltar_tablas();
+    
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    
+    // Registrar fuera de los locks
+    for (uint32_t j = 0; j < cabecera->num_archivos; j++) {
+        if (importados[j]) {
+            registrar_log(OP_CREAR, entradas[j].nombre);
+        }
+    }
+    
+    double segundos = (fin.tv_sec - inicio.tv_sec) + (fin.tv_nsec - inicio.tv_nsec) / 1e9;
+    printf("[Nodo %d] Instantánea %s importada: %ld archivos (%ld omitidos) en %.3f ms\n",
+           id_nodo, ruta, correctos, omitidos, segundos * 1000);
+    
+    free(importados);
+    munmap((void *)imagen, tam);
+    return correctos;
+}
+
+// Comparar dos registros del WAL por LSN (qsort)
+int comparar_lsn(const void *a, const void *b) {
+    const CabeceraWal *ra = *(const CabeceraWal * const *)a;
+    const CabeceraWal *rb = *(const CabeceraWal * const *)b;
+    
+    if (ra->registro.secuencia != rb->registro.secuencia) {
+        return (ra->registro.secuencia < rb->registro.secuencia) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Recuperar el sistema tras una caída (requiere sem_archivos y que no quede
+// ningún nodo vivo): se carga la imagen base y se reaplican, en orden de LSN,
+// los registros íntegros del WAL posteriores a ella. Cada proceso añade sus
+// registros al final del archivo, así que pueden no estar ordenados. Un
+// registro roto (una escritura interrumpida por una caída o un error) se
+// salta buscando byte a byte el siguiente registro íntegro: los de otros
+// procesos escritos detrás siguen valiendo. Devuelve los registros reaplicados, 0 si no hay imagen base
+// o -1 si la imagen no es válida
+int recuperar_wal() {
+    char ruta[PATH_MAX];
+    ruta_imagen_base(ruta, sizeof(ruta));
+    
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        return 0; // Nunca hubo checkpoint: no hay nada que recuperar
+    }
+    
+    // Validar la cabecera de cada shard de la imagen antes de cargarla
+    // sobre los segmentos
+    Cabecera cabecera;
+    for (int k = 0; k < num_shards; k++) {
+        if (pread(fd, &cabecera, sizeof(cabecera), (off_t)k * tam_sistema) !=
+                (ssize_t)sizeof(cabecera) ||
+            cabecera.magia != MAGIA_SISTEMA || cabecera.version != VERSION_SISTEMA ||
+            cabecera.tam_metadatos != sizeof(SistemaArchivos) || cabecera.tam_total != tam_sistema ||
+            cabecera.num_shards != num_shards || cabecera.shard != k) {
+            printf("Error: La imagen base %s no es compatible con el segmento\n", ruta);
+            close(fd);
+            return -1;
+        }
+    }
+    
+    size_t cargados = 0, total = (size_t)num_shards * tam_sistema;
+    while (cargados < total) {
+        size_t dentro = cargados % tam_sistema;
+        ssize_t leidos = pread(fd, (char *)shards[cargados / tam_sistema] + dentro,
+                               tam_sistema - dentro, cargados);
+        if (leidos <= 0) {
+            if (leidos < 0 && errno == EINTR) {
+                continue;
+            }
+            printf("Error: La imagen base %s está incompleta\n", ruta);
+            close(fd);
+            return -1;
+        }
+        cargados += leidos;
+    }
+    close(fd);
+    
+    // Los nodos de la imagen ya no existen
+    memset(principal->nodos_activos, 0, sizeof(principal->nodos_activos));
+    memset(principal->pid_nodos, 0, sizeof(principal->pid_nodos));
+    liberar_estado_huerfano();
+    
+    // Leer el WAL completo
+    char *contenido = NULL;
+    size_t tam = 0;
+    fd = open(ruta_wal, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            contenido = malloc(st.st_size);
+            while (contenido != NULL && tam < (size_t)st.st_size) {
+                ssize_t leidos = read(fd, contenido + tam, st.st_size - tam);
+                if (leidos <= 0) {
+                    if (leidos < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                tam += leidos;
+            }
+        }
+        close(fd);
+    }
+    
+    // Localizar los registros válidos posteriores a la imagen
+    CabeceraWal **registros = NULL;
+    size_t num_registros = 0, capacidad = 0, desplazamiento = 0, descartados = 0;
+    uint64_t ultimo_lsn = cabecera.lsn_checkpoint;
+    while (desplazamiento + sizeof(CabeceraWal) <= tam) {
+        CabeceraWal *registro = (CabeceraWal *)(contenido + desplazamiento);
+        size_t disponible = tam - desplazamiento - sizeof(CabeceraWal);
+        int integro = registro->registro.longitud_nombre > 0 &&
+                      registro->registro.longitud_nombre < MAX_NOMBRE &&
+                      registro->registro.longitud_nombre <= disponible &&
+                      registro->registro.longitud_datos <=
+                          disponible - registro->registro.longitud_nombre;
+        
+        const char *nombre = (const char *)(registro + 1);
+        if (integro) {
+            uint32_t crc = crc32c(0, nombre, registro->registro.longitud_nombre);
+            crc = crc32c(crc, nombre + registro->registro.longitud_nombre,
+                         registro->registro.longitud_datos);
+            crc = crc32c(crc, &registro->registro, sizeof(CabeceraRegistro));
+            integro = (crc == registro->crc);
+        }
+        if (!integro) {
+            desplazamiento++;
+            descartados++;
+            continue;
+        }
+        
+        if (registro->registro.secuencia > cabecera.lsn_checkpoint) {
+            if (num_registros == capacidad) {
+                capacidad = (capacidad > 0) ? capacidad * 2 : 256;
+                CabeceraWal **ampliado = realloc(registros, capacidad * sizeof(CabeceraWal *));
+                if (ampliado == NULL) {
+                    break;
+                }
+                registros = ampliado;
+            }
+            registros[num_registros++] = registro;
+            if (registro->registro.secuencia > ultimo_lsn) {
+                ultimo_lsn = registro->registro.secuencia;
+            }
+        }
+        desplazamiento += sizeof(CabeceraWal) + registro->registro.longitud_nombre +
+                          registro->registro.longitud_datos;
+    }
+    
+    // Reaplicar en orden de LSN con el nodo que hizo cada operación. Aquí
+    // wal.activo aún es 0, así que no se vuelven a anotar
+    qsort(registros, num_registros, sizeof(CabeceraWal *), comparar_lsn);
+    
+    int rechazados = 0;
+    for (size_t k = 0; k < num_registros; k++) {
+        CabeceraRegistro *registro = &registros[k]->registro;
+        const char *nombre = (const char *)(registros[k] + 1);
+        ComandoLote comando = {
+            .tipo = registro->tipo,
+            .longitud = registro->longitud_datos,
+            .desplazamiento = registro->desplazamiento
+        };
+        memcpy(comando.nombre, nombre, registro->longitud_nombre);
+        comando.nombre[registro->longitud_nombre] = '\0';
+        
+        // Los datos deben terminar en nulo (destino de OP_RENOMBRAR y OP_COPIAR)
+        comando.datos = malloc(registro->longitud_datos + 1);
+        if (comando.datos == NULL) {
+            rechazados++;
+            continue;
+        }
+        memcpy(comando.datos, nombre + registro->longitud_nombre, registro->longitud_datos);
+        comando.datos[registro->longitud_datos] = '\0';
+        
+        aplicar_lote(&comando, 1, registro->nodo < MAX_NODOS ? registro->nodo : 0);
+        if (comando.resultado < 0) {
+            rechazados++;
+        }
+        free(comando.datos);
+    }
+    
+    atomic_store(&principal->ultimo_lsn, ultimo_lsn);
+    
+    printf("[WAL] Recuperado el checkpoint del LSN %llu y %zu registros posteriores "
+           "(%d rechazados, %zu bytes descartados)\n",
+           (unsigned long long)cabecera.lsn_checkpoint, num_registros, rechazados,
+           descartados + (tam - desplazamiento));
+    
+    free(registros);
+    free(contenido);
+    return (int)num_registros;
+}
+
+// Abrir el WAL de este proceso (requiere sem_archivos). El primer nodo vivo
+// hace un checkpoint inmediato: la imagen base refleja el segmento actual
+// (recuperado o cerrado limpiamente) y el WAL empieza vacío
+void abrir_wal(int primero) {
+    wal.fd = open(ruta_wal, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal.fd < 0) {
+        perror("Error al abrir el WAL");
+        sem_post(sem_archivos);
+        exit(EXIT_FAILURE);
+    }
+    
+    char ruta[PATH_MAX];
+    ruta_imagen_base(ruta, sizeof(ruta));
+    if ((primero || access(ruta, F_OK) < 0) && checkpoint_sistema() < 0) {
+        perror("Error al guardar la imagen base del WAL");
+        sem_post(sem_archivos);
+        exit(EXIT_FAILURE);
+    }
+    
+    wal.activo = 1;
+    pthread_create(&wal.hilo, NULL, hilo_wal, NULL);
+}
+
+// Detener el hilo del WAL tras escribir lo pendiente y cerrar el archivo
+void cerrar_wal() {
+    if (!wal.activo) {
+        return;
+    }
+    
+    pthread_mutex_lock(&wal.mutex);
+    wal.activo = 0;
+    pthread_cond_signal(&wal.hay_registros);
+    pthread_mutex_unlock(&wal.mutex);
+    
+    pthread_join(wal.hilo, NULL);
+    close(wal.fd);
+    wal.fd = -1;
+    free(wal.pendiente);
+    wal.pendiente = NULL;
+    wal.tam_pendiente = wal.capacidad_pendiente = 0;
+}
+
+// Anotar una operación ya aplicada (con sus locks todavía tomados, para que
+// el orden de los LSN respete el de las operaciones sobre cada archivo).
+// Devuelve el LSN asignado, o 0 sin WAL. El registro sólo está en memoria
+// hasta que el hilo del WAL lo escribe: ver esperar_wal
+uint64_t registrar_wal(int tipo, int nodo, const char *nombre, const char *datos, int longitud,
+                       int desplazamiento) {
+    if (!wal.activo) {
+        return 0;
+    }
+    
+    CabeceraWal cabecera;
+    memset(&cabecera, 0, sizeof(cabecera)); // El relleno también entra en la CRC
+    cabecera.registro.tipo = tipo;
+    cabecera.registro.nodo = nodo;
+    cabecera.registro.desplazamiento = desplazamiento;
+    cabecera.registro.longitud_nombre = strlen(nombre);
+    cabecera.registro.longitud_datos = longitud;
+    
+    // La CRC del nombre y los datos se calcula fuera del mutex
+    uint32_t crc = crc32c(0, nombre, cabecera.registro.longitud_nombre);
+    crc = crc32c(crc, datos, longitud);
+    
+    pthread_mutex_lock(&wal.mutex);
+    
+    // El primer registro de un grupo publica antes de tomar su LSN una cota
+    // inferior de éste, para que los demás nodos lo esperen (ver esperar_wal)
+    if (wal.tam_pendiente == 0) {
+        wal.primero_pendiente = atomic_load(&principal->ultimo_lsn) + 1;
+        if (atomic_load(&principal->wal_pendiente[id_nodo]) == 0) {
+            atomic_store(&principal->wal_pendiente[id_nodo], wal.primero_pendiente);
+        }
+    }
+    
+    // El LSN se asigna con el mutex tomado: los registros de este proceso
+    // quedan en el buffer en orden de LSN
+    cabecera.registro.secuencia = atomic_fetch_add(&principal->ultimo_lsn, 1) + 1;
+    cabecera.crc = crc32c(crc, &cabecera.registro, sizeof(CabeceraRegistro));
+    
+    if (anadir_bytes(&wal.pendiente, &wal.tam_pendiente, &wal.capacidad_pendiente,
+                     &cabecera, sizeof(cabecera)) < 0 ||
+        anadir_bytes(&wal.pendiente, &wal.tam_pendiente, &wal.capacidad_pendiente,
+                     nombre, cabecera.registro.longitud_nombre) < 0 ||
+        anadir_bytes(&wal.pendiente, &wal.tam_pendiente, &wal.capacidad_pendiente,
+                     datos, longitud) < 0) {
+        fallo_wal("sin memoria para el registro");
+    }
+    wal.ultimo_pendiente = cabecera.registro.secuencia;
+    wal.registros++;
+    
+    pthread_cond_signal(&wal.hay_registros);
+    pthread_mutex_unlock(&wal.mutex);
+    
+    return cabecera.registro.secuencia;
+}
+
+// Esperar a que el registro con el LSN indicado (de este proceso) esté en
+// disco, y también los de LSN menor de los demás nodos: uno de ellos puede
+// ser una operación de la que depende ésta (se aplicó antes y soltó sus
+// locks sin esperar a su registro), y una caída no debe conservar ésta sin
+// aquélla. Los nodos caídos no se esperan: sus registros ya no llegarán
+void esperar_wal(uint64_t lsn) {
+    if (lsn == 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&wal.mutex);
+    while (wal.durable < lsn) {
+        pthread_cond_wait(&wal.hay_durables, &wal.mutex);
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    
+    struct timespec pausa = {0, 100000}; // 100 us: un fdatasync ajeno en curso
+    for (int n = 0; n < MAX_NODOS; n++) {
+        while (n != id_nodo && !nodo_caido(n) &&
+               !(kill(principal->pid_nodos[n], 0) < 0 && errno == ESRCH)) {
+            uint64_t pendiente = atomic_load(&principal->wal_pendiente[n]);
+            if (pendiente == 0 || pendiente > lsn) {
+                break;
+            }
+            nanosleep(&pausa, NULL);
+        }
+    }
+}
+
+// Detener el nodo ante un error del WAL sin dar por duradero nada más: sus
+// operaciones pendientes no se confirman y, como en una caída, la
+// recuperación salta el registro que quedara a medias (ver recuperar_wal)
+void fallo_wal(const char *causa) {
+    fprintf(stderr, "Error fatal en el WAL (%s): el nodo %d se detiene\n", causa, id_nodo);
+    _exit(EXIT_FAILURE);
+}
+
+// Anotar una operación de este nodo en el WAL y encolarla para los pares.
+// Se llama con los locks de la operación tomados: así el LSN y la
+// numeración de la replicación siguen el orden en que se aplicaron las
+// operaciones (ver resincronizar_par). Devuelve el LSN, que se espera con
+// esperar_wal después de soltar los locks: mientras el hilo del WAL
+// sincroniza, otras operaciones pueden aplicarse y unirse a su grupo
+uint64_t anotar_operacion(int tipo, const char *nombre, const char *datos, int longitud,
+                          int desplazamiento) {
+    uint64_t lsn = registrar_wal(tipo, id_nodo, nombre, datos, longitud, desplazamiento);
+    replicar_operacion(tipo, nombre, datos, longitud, desplazamiento);
+    return lsn;
+}
+
+// Función para el hilo del WAL (group commit): escribe de una vez todos los
+// registros acumulados y los hace duraderos con un único fdatasync. Los que
+// llegan mientras tanto forman el grupo siguiente
+void *hilo_wal(void *arg) {
+    char *grupo = NULL;
+    size_t capacidad_grupo = 0;
+    
+    pthread_mutex_lock(&wal.mutex);
+    
+    while (1) {
+        while (wal.activo && wal.tam_pendiente == 0) {
+            pthread_cond_wait(&wal.hay_registros, &wal.mutex);
+        }
+        if (wal.tam_pendiente == 0) {
+            break; // Detenido y sin nada pendiente
+        }
+        
+        // Intercambiar los buffers para escribir sin el mutex
+        char *datos = wal.pendiente;
+        size_t tam = wal.tam_pendiente, capacidad = wal.capacidad_pendiente;
+        uint64_t lsn = wal.ultimo_pendiente;
+        wal.pendiente = grupo;
+        wal.capacidad_pendiente = capacidad_grupo;
+        wal.tam_pendiente = 0;
+        
+        pthread_mutex_unlock(&wal.mutex);
+        
+        // Si falla, nada de este grupo puede darse por duradero
+        if (escribir_todo(wal.fd, datos, tam) < 0 || fdatasync(wal.fd) < 0) {
+            fallo_wal(strerror(errno));
+        }
+        grupo = datos;
+        capacidad_grupo = capacidad;
+        
+        pthread_mutex_lock(&wal.mutex);
+        
+        wal.durable = lsn;
+        wal.sincronizaciones++;
+        wal.bytes += tam;
+        atomic_store(&principal->wal_pendiente[id_nodo],
+                     (wal.tam_pendiente > 0) ? wal.primero_pendiente : 0);
+        pthread_cond_broadcast(&wal.hay_durables);
+    }
+    
+    pthread_mutex_unlock(&wal.mutex);
+    free(grupo);
+    return NULL;
+}
+
+// Mostrar la actividad del WAL de este proceso
+void mostrar_wal() {
+    pthread_mutex_lock(&wal.mutex);
+    
+    printf("--- WAL (Nodo %d) ---\n", id_nodo);
+    printf("Archivo: %s (checkpoint en el LSN %llu, último LSN %llu)\n", ruta_wal,
+           (unsigned long long)principal->cabecera.lsn_checkpoint,
+           (unsigned long long)atomic_load(&principal->ultimo_lsn));
+    printf("Registros: %llu en %llu fdatasync (%.1f por sincronización), %llu bytes\n",
+           (unsigned long long)wal.registros, (unsigned long long)wal.sincronizaciones,
+           wal.sincronizaciones > 0 ? (double)wal.registros / wal.sincronizaciones : 0.0,
+           (unsigned long long)wal.bytes);
+    
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+// Función hash FNV-1a sobre el nombre del archivo
+unsigned int hash_nombre(const char *nombre) {
+    unsigned int hash = 2166136261u;
+    
+    while (*nombre) {
+        hash ^= (unsigned char)*nombre++;
+        hash *= 16777619u;
+    }
+    
+    return hash;
+}
+
+// Buscar un nombre en el índice hash (requiere lock_tabla)
+// Devuelve la celda del índice que apunta al archivo o -1 si no existe
+int buscar_en_indice(const char *nombre) {
+    unsigned int pos = hash_nombre(nombre) & (TAM_INDICE - 1);
+    
+    // Sondeo lineal hasta encontrar el nombre o una celda vacía
+    for (int i = 0; i < TAM_INDICE; i++) {
+        int entrada = sistema->indice[pos];
+        
+        if (entrada == INDICE_VACIO) {
+            return -1;
+        }
+        
+        if (entrada != INDICE_BORRADO &&
+            strcmp(sistema->archivos[entrada - 1].nombre, nombre) == 0) {
+            return pos;
+        }
+        
+        pos = (pos + 1) & (TAM_INDICE - 1);
+    }
+    
+    return -1;
+}
+
+// Buscar un archivo por nombre (requiere lock_tabla)
+// Devuelve su posición en sistema->archivos o -1 si no existe
+int buscar_archivo(const char *nombre) {
+    int pos = buscar_en_indice(nombre);
+    return (pos >= 0) ? sistema->indice[pos] - 1 : -1;
+}
+
+// Añadir al índice el archivo de la posición idx (requiere lock_tabla en escritura)
+void indexar_archivo(int idx) {
+    unsigned int pos = hash_nombre(sistema->archivos[idx].nombre) & (TAM_INDICE - 1);
+    
+    // Reutilizar la primera celda vacía o borrada
+    while (sistema->indice[pos] != INDICE_VACIO &&
+           sistema->indice[pos] != INDICE_BORRADO) {
+        pos = (pos + 1) & (TAM_INDICE - 1);
+    }
+    
+    if (sistema->indice[pos] == INDICE_BORRADO) {
+        sistema->num_borrados--;
+    }
+    sistema->indice[pos] = idx + 1;
+}
+
+// Reconstruir el índice completo a partir del array de archivos (requiere lock_tabla en escritura)
+void reconstruir_indice() {
+    memset(sistema->indice, 0, sizeof(sistema->indice));
+    sistema->num_borrados = 0;
+    
+    for (int i = 0; i < sistema->max_posicion; i++) {
+        if (sistema->archivos[i].en_uso) {
+            indexar_archivo(i);
+        }
+    }
+}
+
+// Obtener una posición libre en la tabla (requiere lock_tabla en escritura)
+// Devuelve la posición o -1 si la tabla está llena
+int reservar_posicion() {
+    int idx = sistema->primera_libre;
+    
+    if (idx >= 0) {
+        sistema->primera_libre = sistema->archivos[idx].siguiente_libre;
+    } else if (sistema->max_posicion < MAX_ARCHIVOS) {
+        idx = sistema->max_posicion++;
+    }
+    
+    return idx;
+}
+
+// Devolver una posición a la lista de libres (requiere lock_tabla en escritura)
+void liberar_posicion(int idx) {
+    sistema->archivos[idx].en_uso = 0;
+    sistema->archivos[idx].generacion++;
+    sistema->archivos[idx].siguiente_libre = sistema->primera_libre;
+    sistema->primera_libre = idx;
+}
+
+// Compactación periódica (requiere lock_tabla en escritura): limpia las
+// celdas borradas del índice, recorta max_posicion y rehace la lista de
+// libres en orden ascendente para que la tabla se rellene desde el principio.
+// Los archivos no se mueven, así que sus posiciones siguen siendo válidas
+void compactar_tabla() {
+    while (sistema->max_posicion > 0 &&
+           !sistema->archivos[sistema->max_posicion - 1].en_uso) {
+        sistema->max_posicion--;
+    }
+    
+    sistema->primera_libre = -1;
+    for (int i = sistema->max_posicion - 1; i >= 0; i--) {
+        if (!sistema->archivos[i].en_uso) {
+            sistema->archivos[i].siguiente_libre = sistema->primera_libre;
+            sistema->primera_libre = i;
+        }
+    }
+    
+    reconstruir_indice();
+}
+
+// Dejar el trie con sólo la raíz y el resto de nodos en la lista de libres
+void inicializar_directorio() {
+    NodoDirectorio *raiz = &sistema->directorio[RAIZ_DIRECTORIO];
+    
+    memset(raiz, 0, sizeof(NodoDirectorio));
+    raiz->padre = -1;
+    raiz->primer_hijo = -1;
+    raiz->siguiente_hermano = -1;
+    
+    sistema->primer_nodo_libre = -1;
+    for (int n = MAX_NODOS_DIRECTORIO - 1; n > RAIZ_DIRECTORIO; n--) {
+        sistema->directorio[n].siguiente_hermano = sistema->primer_nodo_libre;
+        sistema->primer_nodo_libre = n;
+    }
+}
+
+// Obtener un nodo libre del trie (requiere lock_tabla en escritura)
+// Devuelve el nodo o -1 si no quedan
+int reservar_nodo_directorio() {
+    int n = sistema->primer_nodo_libre;
+    
+    if (n >= 0) {
+        sistema->primer_nodo_libre = sistema->directorio[n].siguiente_hermano;
+        sistema->directorio[n].primer_hijo = -1;
+        sistema->directorio[n].siguiente_hermano = -1;
+        sistema->directorio[n].archivo = 0;
+    }
+    
+    return n;
+}
+
+// Desenganchar un nodo sin hijos de su padre y devolverlo a la lista de
+// libres (requiere lock_tabla en escritura)
+void quitar_nodo_directorio(int n) {
+    int *enlace = &sistema->directorio[sistema->directorio[n].padre].primer_hijo;
+    
+    while (*enlace != n) {
+        enlace = &sistema->directorio[*enlace].siguiente_hermano;
+    }
+    *enlace = sistema->directorio[n].siguiente_hermano;
+    
+    sistema->directorio[n].siguiente_hermano = sistema->primer_nodo_libre;
+    sistema->primer_nodo_libre = n;
+}
+
+// Quitar los directorios vacíos desde n hacia la raíz (requiere lock_tabla
+// en escritura)
+void podar_directorios(int n) {
+    while (n != RAIZ_DIRECTORIO && sistema->directorio[n].archivo == 0 &&
+           sistema->directorio[n].primer_hijo < 0) {
+        int padre = sistema->directorio[n].padre;
+        quitar_nodo_directorio(n);
+        n = padre;
+    }
+}
+
+// Comprobar que una ruta tiene componentes no vacíos separados por '/' y
+// cabe en un nombre de archivo. Devuelve 1 si es válida
+int validar_ruta(const char *ruta) {
+    size_t longitud = strlen(ruta);
+    
+    return longitud > 0 && longitud < MAX_NOMBRE && ruta[0] != '/' &&
+           ruta[longitud - 1] != '/' && strstr(ruta, "//") == NULL;
+}
+
+// Buscar entre los hijos de un nodo el componente dado (requiere lock_tabla)
+// Devuelve el nodo o -1
+int buscar_hijo(int padre, const char *componente, int longitud) {
+    for (int n = sistema->directorio[padre].primer_hijo; n >= 0;
+         n = sistema->directorio[n].siguiente_hermano) {
+        if (strncmp(sistema->directorio[n].componente, componente, longitud) == 0 &&
+            sistema->directorio[n].componente[longitud] == '\0') {
+            return n;
+        }
+    }
+    
+    return -1;
+}
+
+// Nodo del trie de una ruta ("" es la raíz) o -1 si no existe (requiere lock_tabla)
+int buscar_ruta(const char *ruta) {
+    int n = RAIZ_DIRECTORIO;
+    
+    while (*ruta != '\0' && n >= 0) {
+        int longitud = strcspn(ruta, "/");
+        n = buscar_hijo(n, ruta, longitud);
+        ruta += longitud;
+        if (*ruta == '/') {
+            ruta++;
+        }
+    }
+    
+    return n;
+}
+
+// Recorrer (y crear si falta) la cadena de directorios de los primeros
+// 'longitud' caracteres de una ruta válida (requiere lock_tabla en escritura).
+// Devuelve el último directorio, -1 si un componente es un archivo o -2 si
+// no quedan nodos (en ambos casos sin dejar directorios nuevos vacíos)
+int crear_directorios(const char *ruta, int longitud) {
+    int n = RAIZ_DIRECTORIO;
+    const char *fin = ruta + longitud;
+    
+    while (ruta < fin) {
+        int largo = strcspn(ruta, "/");
+        if (ruta + largo > fin) {
+            largo = fin - ruta;
+        }
+        
+        int hijo = buscar_hijo(n, ruta, largo);
+        if (hijo >= 0 && sistema->directorio[hijo].archivo != 0) {
+            podar_directorios(n);
+            return -1; // Un archivo no puede tener hijos
+        }
+        if (hijo < 0) {
+            hijo = reservar_nodo_directorio();
+            if (hijo < 0) {
+                podar_directorios(n);
+                return -2;
+            }
+            memcpy(sistema->directorio[hijo].componente, ruta, largo);
+            sistema->directorio[hijo].componente[largo] = '\0';
+            sistema->directorio[hijo].padre = n;
+            sistema->directorio[hijo].siguiente_hermano = sistema->directorio[n].primer_hijo;
+            sistema->directorio[n].primer_hijo = hijo;
+        }
+        
+        n = hijo;
+        ruta += largo;
+        if (ruta < fin && *ruta == '/') {
+            ruta++;
+        }
+    }
+    
+    return n;
+}
+
+// Añadir al trie la hoja del archivo idx en la ruta dada (requiere
+// lock_tabla en escritura). Devuelve la hoja, -1 si la ruta no es válida o
+// choca con un archivo o directorio existente, o -2 si no quedan nodos
+int insertar_ruta(const char *ruta, int idx) {
+    if (!validar_ruta(ruta)) {
+        return -1;
+    }
+    
+    const char *ultimo = strrchr(ruta, '/');
+    ultimo = (ultimo != NULL) ? ultimo + 1 : ruta;
+    
+    int padre = crear_directorios(ruta, (ultimo > ruta) ? ultimo - ruta - 1 : 0);
+    if (padre < 0) {
+        return padre;
+    }
+    if (buscar_hijo(padre, ultimo, strlen(ultimo)) >= 0) {
+        podar_directorios(padre);
+        return -1; // Ya existe un directorio con ese nombre
+    }
+    
+    int hoja = reservar_nodo_directorio();
+    if (hoja < 0) {
+        podar_directorios(padre);
+        return -2;
+    }
+    strcpy(sistema->directorio[hoja].componente, ultimo);
+    sistema->directorio[hoja].padre = padre;
+    sistema->directorio[hoja].archivo = idx + 1;
+    sistema->directorio[hoja].siguiente_hermano = sistema->directorio[padre].primer_hijo;
+    sistema->directorio[padre].primer_hijo = hoja;
+    
+    return hoja;
+}
+
+// Guardar en 'archivos' las posiciones de los archivos del subárbol de n
+// (requiere lock_tabla). Devuelve cuántos hay; el coste es el del subárbol
+int recolectar_subarbol(int n, int *archivos, int max) {
+    if (sistema->directorio[n].archivo != 0) {
+        if (max > 0) {
+            archivos[0] = sistema->directorio[n].archivo - 1;
+        }
+        return 1;
+    }
+    
+    int total = 0;
+    for (int hijo = sistema->directorio[n].primer_hijo; hijo >= 0;
+         hijo = sistema->directorio[hijo].siguiente_hermano) {
+        total += recolectar_subarbol(hijo, archivos + total, max - total);
+    }
+    return total;
+}
+
+// Renombrar un archivo o un directorio completo (requiere lock_tabla en
+// escritura). Sólo se tocan el nodo movido y los archivos que cuelgan de
+// él: sus nombres se reescriben y se vuelven a indexar, el resto de la
+// tabla no se recorre. Con el destino en otro shard se necesita también su
+// tabla en escritura (ver mover_entre_shards). Devuelve el número de archivos
+// renombrados, -1 si el origen no existe, -2 si un archivo lo tiene
+// bloqueado otro nodo, -3 si el nodo no es propietario de todos, -4 si el
+// destino no es válido, ya existe o está dentro del origen, -5 si no quedan
+// nodos en el trie o -6 si es un directorio que cambiaría de shard
+int aplicar_renombrado(const char *origen, const char *destino, int nodo) {
+    if (indice_shard(origen) != indice_shard(destino)) {
+        return mover_entre_shards(origen, destino, nodo);
+    }
+    usar_shard(origen);
+    
+    int n = buscar_ruta(origen);
+    if (n <= RAIZ_DIRECTORIO) {
+        return -1;
+    }
+    
+    size_t largo_origen = strlen(origen), largo_destino = strlen(destino);
+    if (!validar_ruta(destino) || buscar_ruta(destino) >= 0 ||
+        (strncmp(destino, origen, largo_origen) == 0 && destino[largo_origen] == '/')) {
+        return -4;
+    }
+    
+    // Comprobar todos los archivos afectados antes de cambiar nada
+    int afectados[MAX_ARCHIVOS];
+    int num_afectados = recolectar_subarbol(n, afectados, MAX_ARCHIVOS);
+    for (int k = 0; k < num_afectados; k++) {
+        Archivo *archivo = &sistema->archivos[afectados[k]];
+        
+        if (archivo->bloqueado && archivo->nodo_bloqueo != nodo) {
+            return -2;
+        }
+        if (archivo->propietario != nodo) {
+            return -3;
+        }
+        if (strlen(archivo->nombre) - largo_origen + largo_destino >= MAX_NOMBRE) {
+            return -4; // La nueva ruta no cabe en el nombre
+        }
+    }
+    
+    // Mover el nodo bajo su nuevo padre
+    const char *ultimo = strrchr(destino, '/');
+    ultimo = (ultimo != NULL) ? ultimo + 1 : destino;
+    int padre = crear_directorios(destino, (ultimo > destino) ? ultimo - destino - 1 : 0);
+    if (padre == -1) {
+        return -4;
+    }
+    if (padre < 0) {
+        return -5;
+    }
+    
+    int padre_anterior = sistema->directorio[n].padre;
+    int *enlace = &sistema->directorio[padre_anterior].primer_hijo;
+    while (*enlace != n) {
+        enlace = &sistema->directorio[*enlace].siguiente_hermano;
+    }
+    *enlace = sistema->directorio[n].siguiente_hermano;
+    
+    strcpy(sistema->directorio[n].componente, ultimo);
+    sistema->directorio[n].padre = padre;
+    sistema->directorio[n].siguiente_hermano = sistema->directorio[padre].primer_hijo;
+    sistema->directorio[padre].primer_hijo = n;
+    podar_directorios(padre_anterior);
+    
+    // Reescribir el prefijo de cada archivo afectado y reindexarlo
+    for (int k = 0; k < num_afectados; k++) {
+        int idx = afectados[k];
+        Archivo *archivo = &sistema->archivos[idx];
+        char nuevo[MAX_NOMBRE];
+        
+        snprintf(nuevo, sizeof(nuevo), "%s%s", destino, archivo->nombre + largo_origen);
+        
+        int pos = buscar_en_indice(archivo->nombre);
+        sistema->indice[pos] = INDICE_BORRADO;
+        sistema->num_borrados++;
+        
+        iniciar_cambio(idx);
+        strcpy(archivo->nombre, nuevo);
+        publicar_cambio(idx);
+        
+        indexar_archivo(idx);
+        avisar_esperas(idx); // Quien espere por el nombre anterior deja de esperar
+    }
+    
+    if (sistema->num_borrados > UMBRAL_COMPACTACION) {
+        compactar_tabla();
+    }
+    return num_afectados;
+}
+
+// Renombrar un archivo a un nombre de otro shard (requiere lock_tabla en
+// escritura de los dos): se crea en el shard de destino con el mismo
+// contenido y bloqueo y se elimina del de origen. Los directorios no se
+// mueven entre shards, porque habría que copiar su subárbol entero.
+// Devuelve 1 o los errores de aplicar_renombrado
+int mover_entre_shards(const char *origen, const char *destino, int nodo) {
+    usar_shard(origen);
+    int n = buscar_ruta(origen);
+    if (n <= RAIZ_DIRECTORIO) {
+        return -1;
+    }
+    if (sistema->directorio[n].archivo == 0) {
+        return -6;
+    }
+    
+    int i = sistema->directorio[n].archivo - 1;
+    Archivo *archivo = &sistema->archivos[i];
+    if (archivo->bloqueado && archivo->nodo_bloqueo != nodo) {
+        return -2;
+    }
+    if (archivo->propietario != nodo) {
+        return -3;
+    }
+    
+    int longitud = archivo->tamanio;
+    int bloqueado = archivo->bloqueado;
+    int64_t expiracion = archivo->expiracion_lease;
+    char *contenido = malloc(longitud + 1);
+    if (contenido == NULL || leer_contenido(archivo, contenido) < 0) {
+        free(contenido);
+        return -5;
+    }
+    
+    usar_shard(destino);
+    int idx = aplicar_crear(destino, contenido, longitud, nodo);
+    free(contenido);
+    if (idx < 0) {
+        return (idx == -1 || idx == -4) ? -4 : -5;
+    }
+    if (bloqueado) {
+        Archivo *movido = &sistema->archivos[idx];
+        iniciar_cambio(idx);
+        movido->bloqueado = 1;
+        movido->nodo_bloqueo = nodo;
+        publicar_cambio(idx);
+        movido->expiracion_lease = expiracion;
+        programar_lease(idx, expiracion);
+    }
+    
+    usar_shard(origen);
+    aplicar_eliminacion(buscar_en_indice(origen), nodo);
+    return 1;
+}
+
+// Dirección en la memoria compartida del primer byte de un bloque de datos.
+// Se guardan desplazamientos y no punteros porque cada proceso puede
+// proyectar el segmento en una dirección distinta
+char *direccion_bloque(int bloque) {
+    return (char *)sistema + sistema->desplazamiento_datos + (size_t)bloque * TAM_BLOQUE;
+}
+
+// Reservar n bloques contiguos con primer ajuste (requiere lock_datos)
+// Devuelve el primer bloque de la extensión o -1 si no hay hueco suficiente
+int reservar_bloques(int n) {
+    if (n == 0) {
+        return 0;
+    }
+    
+    for (int i = 0; i < sistema->num_libres; i++) {
+        Extension *hueco = &sistema->libres[i];
+        
+        if (hueco->num_bloques >= n) {
+            int inicio = hueco->inicio;
+            hueco->inicio += n;
+            hueco->num_bloques -= n;
+            
+            // Si el hueco se agota, quitarlo de la lista
+            if (hueco->num_bloques == 0) {
+                memmove(&sistema->libres[i], &sistema->libres[i + 1],
+                        (sistema->num_libres - i - 1) * sizeof(Extension));
+                sistema->num_libres--;
+            }
+            return inicio;
+        }
+    }
+    
+    return -1;
+}
+
+// Devolver n bloques a la lista de huecos fusionando con los vecinos (requiere lock_datos)
+void liberar_bloques(int inicio, int n) {
+    if (n == 0) {
+        return;
+    }
+    
+    // Buscar la posición que mantiene la lista ordenada
+    int i = 0;
+    while (i < sistema->num_libres && sistema->libres[i].inicio < inicio) {
+        i++;
+    }
+    
+    Extension *anterior = (i > 0) ? &sistema->libres[i - 1] : NULL;
+    Extension *siguiente = (i < sistema->num_libres) ? &sistema->libres[i] : NULL;
+    int fusion_anterior = anterior && anterior->inicio + anterior->num_bloques == inicio;
+    int fusion_siguiente = siguiente && inicio + n == siguiente->inicio;
+    
+    if (fusion_anterior && fusion_siguiente) {
+        // El hueco une a sus dos vecinos
+        anterior->num_bloques += n + siguiente->num_bloques;
+        memmove(&sistema->libres[i], &sistema->libres[i + 1],
+                (sistema->num_libres - i - 1) * sizeof(Extension));
+        sistema->num_libres--;
+    } else if (fusion_anterior) {
+        anterior->num_bloques += n;
+    } else if (fusion_siguiente) {
+        siguiente->inicio = inicio;
+        siguiente->num_bloques += n;
+    } else {
+        memmove(&sistema->libres[i + 1], &sistema->libres[i],
+                (sistema->num_libres - i) * sizeof(Extension));
+        sistema->libres[i].inicio = inicio;
+        sistema->libres[i].num_bloques = n;
+        sistema->num_libres++;
+    }
+}
+
+// Celda inicial de un contenido en la tabla de deduplicación
+int hash_contenido(uint32_t crc, int tamanio) {
+    return (crc ^ (uint32_t)tamanio * 0x9E3779B1u) & (TAM_CONTENIDOS - 1);
+}
+
+// Buscar un contenido idéntico ya guardado de la misma forma (comprimido o
+// no) (requiere lock_datos). La CRC y los tamaños descartan casi todos los
+// candidatos sin comparar bytes. Devuelve su celda o -1
+int buscar_contenido(uint32_t crc, int tamanio, int tamanio_comprimido, const char *guardado) {
+    int guardados = (tamanio_comprimido > 0) ? tamanio_comprimido : tamanio;
+    
+    for (int c = hash_contenido(crc, tamanio); sistema->contenidos[c].referencias > 0;
+         c = (c + 1) & (TAM_CONTENIDOS - 1)) {
+        ContenidoCompartido *contenido = &sistema->contenidos[c];
+        if (contenido->crc == crc && contenido->tamanio == tamanio &&
+            contenido->tamanio_comprimido == tamanio_comprimido &&
+            memcmp(direccion_bloque(contenido->datos.inicio), guardado, guardados) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// Celda del contenido de un archivo (requiere lock_datos). Devuelve -1 si
+// su extensión no está en la tabla (archivo vacío o modificándose)
+int celda_contenido(const Archivo *archivo) {
+    if (archivo->tamanio == 0) {
+        return -1;
+    }
+    
+    for (int c = hash_contenido(archivo->crc, archivo->tamanio);
+         sistema->contenidos[c].referencias > 0; c = (c + 1) & (TAM_CONTENIDOS - 1)) {
+        if (sistema->contenidos[c].datos.inicio == archivo->datos.inicio &&
+            sistema->contenidos[c].datos.num_bloques > 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+// Añadir a la tabla el contenido de un archivo con una referencia (requiere lock_datos)
+void insertar_contenido(const Archivo *archivo) {
+    int c = hash_contenido(archivo->crc, archivo->tamanio);
+    while (sistema->contenidos[c].referencias > 0) {
+        c = (c + 1) & (TAM_CONTENIDOS - 1);
+    }
+    
+    sistema->contenidos[c].crc = archivo->crc;
+    sistema->contenidos[c].tamanio = archivo->tamanio;
+    sistema->contenidos[c].tamanio_comprimido = archivo->tamanio_comprimido;
+    sistema->contenidos[c].datos = archivo->datos;
+    sistema->contenidos[c].referencias = 1;
+}
+
+// Quitar una celda de la tabla (requiere lock_datos). Los contenidos que la
+// siguen en su cadena de sondeo se desplazan hacia atrás, así que la tabla
+// nunca acumula celdas borradas
+void quitar_contenido(int c) {
+    int hueco = c;
+    
+    sistema->contenidos[hueco].referencias = 0;
+    for (int k = (hueco + 1) & (TAM_CONTENIDOS - 1); sistema->contenidos[k].referencias > 0;
+         k = (k + 1) & (TAM_CONTENIDOS - 1)) {
+        int inicial = hash_contenido(sistema->contenidos[k].crc, sistema->contenidos[k].tamanio);
+        
+        // Se mueve si su celda inicial no está entre el hueco y ella
+        if (((k - inicial) & (TAM_CONTENIDOS - 1)) >= ((k - hueco) & (TAM_CONTENIDOS - 1))) {
+            sistema->contenidos[hueco] = sistema->contenidos[k];
+            sistema->contenidos[k].referencias = 0;
+            hueco = k;
+        }
+    }
+}
+
+// Soltar la referencia de un archivo a su contenido (requiere lock_datos):
+// los bloques se liberan cuando nadie más los usa. El archivo queda sin extensión
+void soltar_contenido(Archivo *archivo) {
+    int c = celda_contenido(archivo);
+    
+    if (c < 0) {
+        liberar_bloques(archivo->datos.inicio, archivo->datos.num_bloques);
+    } else if (--sistema->contenidos[c].referencias == 0) {
+        quitar_contenido(c);
+        liberar_bloques(archivo->datos.inicio, archivo->datos.num_bloques);
+    }
+    
+    archivo->datos.inicio = 0;
+    archivo->datos.num_bloques = 0;
+}
+
+// Preparar un archivo para modificar su contenido en el sitio: lo saca de
+// la tabla y, si otros archivos lo comparten, le da una copia propia
+// (copia al escribir). Devuelve 0 o -1 si no hay espacio para la copia
+int privatizar_contenido(Archivo *archivo) {
+    tomar_mutex(&sistema->lock_datos);
+    
+    int c = celda_contenido(archivo);
+    if (c < 0 || sistema->contenidos[c].referencias == 1) {
+        if (c >= 0) {
+            quitar_contenido(c); // Sólo lo usa este archivo: basta con sacarlo
+        }
+        soltar_mutex(&sistema->lock_datos);
+        return 0;
+    }
+    
+    // La copia sólo necesita los bloques del contenido, aunque la extensión
+    // compartida sea mayor
+    int necesarios = BLOQUES_PARA(archivo->tamanio);
+    int inicio = reservar_bloques(necesarios);
+    soltar_mutex(&sistema->lock_datos);
+    if (inicio < 0) {
+        return -1;
+    }
+    
+    // Copiar sin lock_datos: la referencia del archivo mantiene viva la
+    // extensión compartida, que nadie modifica en el sitio
+    memcpy(direccion_bloque(inicio), direccion_bloque(archivo->datos.inicio), archivo->tamanio);
+    
+    tomar_mutex(&sistema->lock_datos);
+    soltar_contenido(archivo);
+    soltar_mutex(&sistema->lock_datos);
+    
+    archivo->datos.inicio = inicio;
+    archivo->datos.num_bloques = necesarios;
+    return 0;
+}
+
+// Volver a registrar el contenido de un archivo tras modificarlo en el
+// sitio. Si ya existe otro igual, se comparte y se liberan sus bloques
+void registrar_contenido(Archivo *archivo) {
+    if (archivo->tamanio == 0) {
+        return;
+    }
+    
+    tomar_mutex(&sistema->lock_datos);
+    
+    int c = buscar_contenido(archivo->crc, archivo->tamanio, 0,
+                             direccion_bloque(archivo->datos.inicio));
+    if (c >= 0) {
+        sistema->contenidos[c].referencias++;
+        liberar_bloques(archivo->datos.inicio, archivo->datos.num_bloques);
+        archivo->datos = sistema->contenidos[c].datos;
+    } else {
+        insertar_contenido(archivo);
+    }
+    
+    soltar_mutex(&sistema->lock_datos);
+}
+
+// Comprimir un contenido si supera el umbral y así ocupa menos bloques.
+// Devuelve un buffer propio con el resultado (y su tamaño) o NULL si el
+// contenido se guarda tal cual
+char *comprimir_contenido(const char *contenido, int longitud, int *tamanio_comprimido) {
+    if (umbral_compresion <= 0 || longitud < umbral_compresion) {
+        return NULL;
+    }
+    
+    char *comprimido = malloc(cota_comprimido(longitud));
+    if (comprimido == NULL) {
+        return NULL;
+    }
+    
+    int64_t inicio = ahora_ns();
+    int tamanio = comprimir_lz(contenido, longitud, comprimido);
+    if (BLOQUES_PARA(tamanio) >= BLOQUES_PARA(longitud)) {
+        free(comprimido); // No ahorra ningún bloque
+        comprimido = NULL;
+    }
+    
+    ContadoresCompresion *contadores = &principal->estadisticas[id_nodo].compresion;
+    atomic_fetch_add_explicit(&contadores->compresiones, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->bytes_originales, longitud, memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->bytes_guardados, comprimido ? tamanio : longitud,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->compresion_ns, ahora_ns() - inicio,
+                              memory_order_relaxed);
+    
+    *tamanio_comprimido = tamanio;
+    return comprimido;
+}
+
+// Espacio máximo que puede ocupar n bytes comprimidos (datos incompresibles)
+int cota_comprimido(int n) {
+    return n + n / 255 + 16;
+}
+
+// Escribir el resto de una longitud de 15 o más en bytes de 255 (formato LZ4)
+unsigned char *escribir_longitud_lz(unsigned char *salida, int resto) {
+    while (resto >= 255) {
+        *salida++ = 255;
+        resto -= 255;
+    }
+    *salida++ = resto;
+    return salida;
+}
+
+// Escribir una secuencia LZ4: un token con las longitudes de los literales y
+// de la coincidencia (4 bits cada una), los literales, la distancia hacia
+// atrás (2 bytes) y la coincidencia. largo 0: secuencia final sin coincidencia
+unsigned char *escribir_secuencia_lz(unsigned char *salida, const unsigned char *literales,
+                                     int num_literales, int distancia, int largo) {
+    unsigned char *token = salida++;
+    
+    *token = (num_literales < 15 ? num_literales : 15) << 4;
+    if (num_literales >= 15) {
+        salida = escribir_longitud_lz(salida, num_literales - 15);
+    }
+    memcpy(salida, literales, num_literales);
+    salida += num_literales;
+    
+    if (largo > 0) {
+        *salida++ = distancia & 0xFF;
+        *salida++ = distancia >> 8;
+        largo -= MIN_COINCIDENCIA_LZ;
+        *token |= (largo < 15) ? largo : 15;
+        if (largo >= 15) {
+            salida = escribir_longitud_lz(salida, largo - 15);
+        }
+    }
+    return salida;
+}
+
+// Comprimir n bytes en formato de bloque LZ4 con una tabla hash de las
+// posiciones de cada secuencia de 4 bytes (una pasada, sin búsqueda
+// exhaustiva: prima la velocidad). destino debe tener cota_comprimido(n)
+// bytes. Devuelve el tamaño comprimido
+int comprimir_lz(const char *origen, int n, char *destino) {
+    const unsigned char *entrada = (const unsigned char *)origen;
+    unsigned char *salida = (unsigned char *)destino;
+    int tabla[1 << BITS_HASH_LZ]; // Última posición + 1 de cada hash (0: ninguna)
+    int ancla = 0; // Primer byte aún sin emitir
+    
+    memset(tabla, 0, sizeof(tabla));
+    
+    // Como en LZ4, los últimos bytes siempre van como literales
+    for (int i = 0; i < n - MARGEN_FINAL_LZ; ) {
+        uint32_t secuencia;
+        memcpy(&secuencia, entrada + i, sizeof(secuencia));
+        uint32_t h = (secuencia * 2654435761u) >> (32 - BITS_HASH_LZ);
+        int candidato = tabla[h] - 1;
+        tabla[h] = i + 1;
+        
+        if (candidato < 0 || i - candidato > DISTANCIA_MAXIMA_LZ ||
+            memcmp(entrada + candidato, entrada + i, MIN_COINCIDENCIA_LZ) != 0) {
+            i++;
+            continue;
+        }
+        
+        // Alargar la coincidencia todo lo posible
+        int largo = MIN_COINCIDENCIA_LZ;
+        while (i + largo < n - FINAL_LITERALES_LZ &&
+               entrada[candidato + largo] == entrada[i + largo]) {
+            largo++;
+        }
+        
+        salida = escribir_secuencia_lz(salida, entrada + ancla, i - ancla, i - candidato, largo);
+        i += largo;
+        ancla = i;
+    }
+    
+    salida = escribir_secuencia_lz(salida, entrada + ancla, n - ancla, 0, 0);
+    return salida - (unsigned char *)destino;
+}
+
+// Leer el resto de una longitud de 15 o más. Devuelve -1 si se acaban los datos
+int leer_longitud_lz(const unsigned char **entrada, const unsigned char *fin) {
+    int total = 0, byte;
+    
+    do {
+        if (*entrada >= fin || total > INT_MAX / 2) {
+            return -1;
+        }
+        byte = *(*entrada)++;
+        total += byte;
+    } while (byte == 255);
+    return total;
+}
+
+// Descomprimir un bloque LZ4 en destino, comprobando todos los límites: un
+// bloque dañado nunca escribe fuera de destino. Devuelve los bytes
+// producidos o -1 si los datos no son válidos
+int descomprimir_lz(const char *origen, int n, char *destino, int capacidad) {
+    const unsigned char *entrada = (const unsigned char *)origen, *fin = entrada + n;
+    unsigned char *salida = (unsigned char *)destino;
+    unsigned char *limite = salida + capacidad;
+    
+    while (entrada < fin) {
+        int token = *entrada++;
+        
+        int num_literales = token >> 4;
+        if (num_literales == 15) {
+            int resto = leer_longitud_lz(&entrada, fin);
+            if (resto < 0) {
+                return -1;
+            }
+            num_literales += resto;
+        }
+        if (num_literales > fin - entrada || num_literales > limite - salida) {
+            return -1;
+        }
+        memcpy(salida, entrada, num_literales);
+        entrada += num_literales;
+        salida += num_literales;
+        
+        if (entrada == fin) {
+            break; // Secuencia final: sólo literales
+        }
+        
+        if (fin - entrada < 2) {
+            return -1;
+        }
+        int distancia = entrada[0] | entrada[1] << 8;
+        entrada += 2;
+        int largo = token & 15;
+        if (largo == 15) {
+            int resto = leer_longitud_lz(&entrada, fin);
+            if (resto < 0) {
+                return -1;
+            }
+            largo += resto;
+        }
+        largo += MIN_COINCIDENCIA_LZ;
+        if (distancia == 0 || distancia > salida - (unsigned char *)destino ||
+            largo > limite - salida) {
+            return -1;
+        }
+        
+        // Byte a byte: la coincidencia puede solaparse con lo que se copia
+        const unsigned char *copia = salida - distancia;
+        for (int k = 0; k < largo; k++) {
+            salida[k] = copia[k];
+        }
+        salida += largo;
+    }
+    
+    return salida - (unsigned char *)destino;
+}
+
+// Copiar el contenido completo de un archivo en destino (tamanio bytes),
+// descomprimiéndolo si hace falta (requiere el archivo en lectura).
+// Devuelve 0 o -1 si el contenido comprimido está dañado
+int leer_contenido(const Archivo *archivo, char *destino) {
+    const char *guardado = direccion_bloque(archivo->datos.inicio);
+    
+    if (archivo->tamanio_comprimido == 0) {
+        memcpy(destino, guardado, archivo->tamanio);
+        return 0;
+    }
+    
+    int64_t inicio = ahora_ns();
+    int producidos = descomprimir_lz(guardado, archivo->tamanio_comprimido, destino,
+                                     archivo->tamanio);
+    
+    ContadoresCompresion *contadores = &principal->estadisticas[id_nodo].compresion;
+    atomic_fetch_add_explicit(&contadores->descompresiones, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->bytes_descomprimidos, archivo->tamanio,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->descompresion_ns, ahora_ns() - inicio,
+                              memory_order_relaxed);
+    
+    return (producidos == archivo->tamanio) ? 0 : -1;
+}
+
+// Sobrescribir longitud bytes desde desplazamiento en un archivo comprimido
+// (requiere el archivo en exclusiva). No se puede modificar en el sitio: se
+// descomprime, se cambia la copia y se vuelve a guardar entera.
+// Devuelve 0 o -1 si falta memoria o espacio
+int modificar_comprimido(Archivo *archivo, int desplazamiento, const char *datos, int longitud) {
+    int total = (desplazamiento + longitud > archivo->tamanio)
+                ? desplazamiento + longitud : archivo->tamanio;
+    char *contenido = malloc(total);
+    if (contenido == NULL || leer_contenido(archivo, contenido) < 0) {
+        free(contenido);
+        return -1;
+    }
+    
+    memcpy(contenido + desplazamiento, datos, longitud);
+    int resultado = asignar_contenido(archivo, contenido, total, crc32c(0, contenido, total));
+    free(contenido);
+    return resultado;
+}
+
+// Sustituir el contenido de un archivo (requiere el archivo en exclusiva).
+// crc es la CRC32C del contenido. Por encima del umbral de compresión se
+// guarda comprimido. Devuelve 0 o -1 si no hay espacio
+int asignar_contenido(Archivo *archivo, const char *contenido, int longitud, uint32_t crc) {
+    // Comprimir antes de tomar lock_datos
+    int tamanio_comprimido = 0;
+    char *comprimido = comprimir_contenido(contenido, longitud, &tamanio_comprimido);
+    int resultado;
+    if (comprimido != NULL) {
+        resultado = guardar_contenido(archivo, comprimido, tamanio_comprimido, longitud,
+                                      tamanio_comprimido, crc);
+    } else {
+        resultado = guardar_contenido(archivo, contenido, longitud, longitud, 0, crc);
+    }
+    
+    free(comprimido);
+    return resultado;
+}
+
+// Sustituir el contenido de un archivo por 'guardados' bytes ya en su forma
+// guardada (comprimida si tamanio_comprimido > 0) de un contenido de
+// longitud bytes y CRC crc (requiere el archivo en exclusiva). Si otro
+// archivo ya guarda el mismo contenido, sólo se suma una referencia; si no,
+// el archivo reutiliza su extensión cuando es sólo suya o recibe una nueva.
+// Devuelve 0 o -1 si no hay espacio
+int guardar_contenido(Archivo *archivo, const char *guardado, int guardados, int longitud,
+                      int tamanio_comprimido, uint32_t crc) {
+    int necesarios = BLOQUES_PARA(guardados);
+    
+    tomar_mutex(&sistema->lock_datos);
+    
+    // Contenido repetido: compartir la extensión existente sin copiar nada
+    int c = (longitud > 0) ? buscar_contenido(crc, longitud, tamanio_comprimido, guardado) : -1;
+    if (c >= 0) {
+        // Tomar la extensión antes de soltar la antigua: si ésta se queda sin
+        // referencias, quitar su celda puede desplazar la de c
+        Extension compartida = sistema->contenidos[c].datos;
+        sistema->contenidos[c].referencias++;
+        soltar_contenido(archivo);
+        archivo->datos = compartida;
+        soltar_mutex(&sistema->lock_datos);
+        
+        archivo->tamanio = longitud;
+        archivo->tamanio_comprimido = tamanio_comprimido;
+        archivo->crc = crc;
+        return 0;
+    }
+    
+    c = celda_contenido(archivo);
+    if ((c >= 0 && sistema->contenidos[c].referencias > 1) ||
+        necesarios > archivo->datos.num_bloques) {
+        // Reservar la nueva extensión antes de soltar la antigua para no
+        // perder el contenido si no hay espacio. Una extensión compartida
+        // nunca se modifica en el sitio
+        int inicio = reservar_bloques(necesarios);
+        if (inicio < 0) {
+            soltar_mutex(&sistema->lock_datos);
+            return -1;
+        }
+        soltar_contenido(archivo);
+        
+        archivo->datos.inicio = inicio;
+        archivo->datos.num_bloques = necesarios;
+    } else {
+        if (c >= 0) {
+            quitar_contenido(c); // Sólo lo usa este archivo
+        }
+        
+        // Devolver los bloques sobrantes del final
+        liberar_bloques(archivo->datos.inicio + necesarios,
+                        archivo->datos.num_bloques - necesarios);
+        archivo->datos.num_bloques = necesarios;
+    }
+    
+    soltar_mutex(&sistema->lock_datos);
+    
+    memcpy(direccion_bloque(archivo->datos.inicio), guardado, guardados);
+    archivo->tamanio = longitud;
+    archivo->tamanio_comprimido = tamanio_comprimido;
+    archivo->crc = crc;
+    
+    // Publicar el contenido para que otros archivos puedan compartirlo
+    if (longitud > 0) {
+        tomar_mutex(&sistema->lock_datos);
+        insertar_contenido(archivo);
+        soltar_mutex(&sistema->lock_datos);
+    }
+    return 0;
+}
+
+// Hacer que la extensión de un archivo tenga al menos `necesarios` bloques
+// conservando su contenido (requiere el archivo en exclusiva).
+// Devuelve 0 o -1 si no hay espacio
+int ampliar_extension(Archivo *archivo, int necesarios) {
+    Extension *ext = &archivo->datos;
+    
+    if (necesarios <= ext->num_bloques) {
+        return 0;
+    }
+    
+    tomar_mutex(&sistema->lock_datos);
+    
+    // Si el hueco contiguo basta, crecer en el sitio sin copiar nada
+    int extra = necesarios - ext->num_bloques;
+    for (int i = 0; i < sistema->num_libres; i++) {
+        Extension *hueco = &sistema->libres[i];
+        
+        if (hueco->inicio == ext->inicio + ext->num_bloques && hueco->num_bloques >= extra) {
+            hueco->inicio += extra;
+            hueco->num_bloques -= extra;
+            if (hueco->num_bloques == 0) {
+                memmove(&sistema->libres[i], &sistema->libres[i + 1],
+                        (sistema->num_libres - i - 1) * sizeof(Extension));
+                sistema->num_libres--;
+            }
+            ext->num_bloques = necesarios;
+            soltar_mutex(&sistema->lock_datos);
+            return 0;
+        }
+    }
+    
+    // Si no, mover el contenido a una extensión nueva. Se pide el doble para
+    // que una serie de ampliaciones no copie el archivo en cada una
+    int bloques = (2 * ext->num_bloques > necesarios) ? 2 * ext->num_bloques : necesarios;
+    int inicio = reservar_bloques(bloques);
+    if (inicio < 0) {
+        bloques = necesarios;
+        inicio = reservar_bloques(bloques);
+    }
+    soltar_mutex(&sistema->lock_datos);
+    
+    if (inicio < 0) {
+        return -1;
+    }
+    
+    memcpy(direccion_bloque(inicio), direccion_bloque(ext->inicio), archivo->tamanio);
+    
+    tomar_mutex(&sistema->lock_datos);
+    liberar_bloques(ext->inicio, ext->num_bloques);
+    soltar_mutex(&sistema->lock_datos);
+    
+    ext->inicio = inicio;
+    ext->num_bloques = bloques;
+    return 0;
+}
+
+// CRC32C byte a byte con tabla (válida en cualquier procesador)
+uint32_t crc32c_tabla(uint32_t crc, const void *datos, size_t n) {
+    const unsigned char *p = datos;
+    
+    crc = ~crc;
+    while (n--) {
+        crc = tabla_crc32c[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// CRC32C con la instrucción crc32 de SSE4.2, 8 bytes por instrucción
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void *datos, size_t n) {
+    const unsigned char *p = datos;
+    uint64_t c = ~crc;
+    
+    while (n >= 8) {
+        uint64_t palabra;
+        memcpy(&palabra, p, 8);
+        c = _mm_crc32_u64(c, palabra);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return ~(uint32_t)c;
+}
+#endif
+
+// Preparar las tablas y elegir la implementación de crc32c según el procesador
+void inicializar_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 1) ? (crc >> 1) ^ POLINOMIO_CRC32C : crc >> 1;
+        }
+        tabla_crc32c[i] = crc;
+    }
+    
+    // potencias_crc32c[k] = x^(2^k): x^1 es el bit 30 en representación reflejada
+    uint32_t p = 1u << 30;
+    for (int k = 0; k < 32; k++) {
+        potencias_crc32c[k] = p;
+        p = multiplicar_crc32c(p, p);
+    }
+    
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32c_sse42;
+    }
+#endif
+}
+
+// Producto de dos polinomios módulo el de CRC32C (representación reflejada)
+uint32_t multiplicar_crc32c(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, producto = 0;
+    
+    while (m != 0 && a != 0) {
+        if (a & m) {
+            producto ^= b;
+            a ^= m;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ POLINOMIO_CRC32C : b >> 1;
+    }
+    return producto;
+}
+
+// CRC sin inversiones de un mensaje seguido de 'bytes' ceros, en
+// O(log bytes) en lugar de recorrerlos
+uint32_t desplazar_crc32c(uint32_t crc, size_t bytes) {
+    for (int k = 3; bytes != 0; k++, bytes >>= 1) {
+        if (bytes & 1) {
+            crc = multiplicar_crc32c(potencias_crc32c[k & 31], crc);
+        }
+    }
+    return crc;
+}
+
+// Corregir la CRC de un contenido cuando sus bytes 'antes' pasan a ser
+// 'despues' (n bytes seguidos de 'cola' bytes sin cambios hasta el final).
+// La CRC es lineal: basta la CRC de la diferencia desplazada hasta el final,
+// así que sólo se leen los bytes modificados
+uint32_t sustituir_crc32c(uint32_t crc, const char *antes, const char *despues,
+                          size_t n, size_t cola) {
+    if (n == 0) {
+        return crc;
+    }
+    
+    // Con crc inicial ~0 las inversiones de crc32c se anulan
+    uint32_t diferencia = ~crc32c(~0u, antes, n) ^ ~crc32c(~0u, despues, n);
+    return crc ^ desplazar_crc32c(diferencia, cola);
+}
+
+// Instante actual en nanosegundos del reloj monotónico
+int64_t ahora_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Subir un máximo compartido si valor lo supera
+void actualizar_maximo(_Atomic uint64_t *maximo, uint64_t valor) {
+    uint64_t actual = atomic_load_explicit(maximo, memory_order_relaxed);
+    while (valor > actual &&
+           !atomic_compare_exchange_weak_explicit(maximo, &actual, valor,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+// Decidir si este hilo mide la siguiente adquisición u operación
+int toca_muestra() {
+    return (++contador_muestreo & (MUESTREO_ESTADISTICAS - 1)) == 0;
+}
+
+// Anotar una adquisición en la fila de este nodo. espera es el tiempo
+// bloqueado (ns) o -1 si el primer intento tuvo éxito
+void contar_adquisicion(int clase, int64_t espera) {
+    ContadoresLock *contadores = &principal->estadisticas[id_nodo].locks[clase];
+    
+    atomic_fetch_add_explicit(&contadores->adquisiciones, 1, memory_order_relaxed);
+    if (espera >= 0) {
+        atomic_fetch_add_explicit(&contadores->contendidas, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&contadores->espera_ns, espera, memory_order_relaxed);
+        actualizar_maximo(&contadores->max_espera_ns, espera);
+        espera_hilo += espera;
+    }
+}
+
+// Anotar el tiempo de retención de una adquisición muestreada
+// (adquirido: instante de la adquisición, 0 si no se muestreó)
+void contar_retencion(int clase, int64_t adquirido) {
+    if (adquirido == 0) {
+        return;
+    }
+    
+    ContadoresLock *contadores = &principal->estadisticas[id_nodo].locks[clase];
+    int64_t retencion = ahora_ns() - adquirido;
+    atomic_fetch_add_explicit(&contadores->muestras, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->retencion_ns, retencion, memory_order_relaxed);
+    actualizar_maximo(&contadores->max_retencion_ns, retencion);
+}
+
+// Adquisición que este hilo guarda para un rwlock de cualquier shard
+AdquisicionLock *adquisicion_rwlock(pthread_rwlock_t *lock) {
+    int k = shard_de(lock);
+    if (lock == &shards[k]->lock_tabla) {
+        return &adquisicion_tabla[k];
+    }
+    return &adquisicion_archivos[k][lock - shards[k]->locks_archivos];
+}
+
+// Tomar un rwlock del segmento contando la espera si está ocupado
+void tomar_rwlock(pthread_rwlock_t *lock, int escritura) {
+    int64_t espera = -1;
+    int intento = escritura ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock);
+    if (intento != 0) {
+        int64_t inicio = ahora_ns();
+        if (escritura) {
+            pthread_rwlock_wrlock(lock);
+        } else {
+            pthread_rwlock_rdlock(lock);
+        }
+        espera = ahora_ns() - inicio;
+    }
+    
+    AdquisicionLock *adquisicion = adquisicion_rwlock(lock);
+    int tabla = (lock == &shards[shard_de(lock)]->lock_tabla);
+    adquisicion->clase = (tabla ? LOCK_TABLA_LECTURA : LOCK_ARCHIVO_LECTURA) + escritura;
+    adquisicion->instante = toca_muestra() ? ahora_ns() : 0;
+    contar_adquisicion(adquisicion->clase, espera);
+}
+
+// Tomar un rwlock del segmento en lectura
+void tomar_lectura(pthread_rwlock_t *lock) {
+    tomar_rwlock(lock, 0);
+}
+
+// Tomar un rwlock del segmento en escritura
+void tomar_escritura(pthread_rwlock_t *lock) {
+    tomar_rwlock(lock, 1);
+}
+
+// Soltar un rwlock del segmento tomado con tomar_lectura o tomar_escritura
+void soltar_rwlock(pthread_rwlock_t *lock) {
+    AdquisicionLock *adquisicion = adquisicion_rwlock(lock);
+    contar_retencion(adquisicion->clase, adquisicion->instante);
+    pthread_rwlock_unlock(lock);
+}
+
+// Tomar un mutex del segmento (lock_datos o lock_leases) contando la espera
+void tomar_mutex(pthread_mutex_t *mutex) {
+    int64_t espera = -1;
+    int estado = pthread_mutex_trylock(mutex);
+    if (estado == EBUSY) {
+        int64_t inicio = ahora_ns();
+        estado = pthread_mutex_lock(mutex);
+        espera = ahora_ns() - inicio;
+    }
+    if (estado == EOWNERDEAD) {
+        reparar_mutex(mutex);
+    }
+    
+    int k = shard_de(mutex);
+    int datos = (mutex == &shards[k]->lock_datos);
+    AdquisicionLock *adquisicion = datos ? &adquisicion_datos[k] : &adquisicion_leases[k];
+    adquisicion->clase = datos ? LOCK_DATOS : LOCK_LEASES;
+    adquisicion->instante = toca_muestra() ? ahora_ns() : 0;
+    contar_adquisicion(adquisicion->clase, espera);
+}
+
+// Soltar un mutex tomado con tomar_mutex
+void soltar_mutex(pthread_mutex_t *mutex) {
+    int k = shard_de(mutex);
+    AdquisicionLock *adquisicion = (mutex == &shards[k]->lock_datos) ? &adquisicion_datos[k]
+                                                                     : &adquisicion_leases[k];
+    contar_retencion(adquisicion->clase, adquisicion->instante);
+    pthread_mutex_unlock(mutex);
+}
+
+// Tomar un mutex del segmento sin instrumentar (colas de espera y el hilo
+// de sincronización), reparándolo si su dueño murió con él tomado
+void tomar_mutex_compartido(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        reparar_mutex(mutex);
+    }
+}
+
+// Los mutex del segmento son robustos: si un proceso muere con uno tomado,
+// el siguiente que lo pide lo recibe con EOWNERDEAD en vez de quedarse
+// bloqueado para siempre junto con todos los demás nodos. Lo protegido
+// puede haber quedado a medio cambiar, así que antes de marcarlo como
+// consistente se deja en un estado válido:
+// - el montículo de leases se rehace con los archivos bloqueados;
+// - de la lista de huecos se descartan las entradas que se solapan o se
+//   salen de la región: a lo sumo se pierden bloques hasta el próximo
+//   arranque en frío;
+// - en una cola se olvidan las cancelaciones de tickets ya pasados y se
+//   saltan las del principio. Un ticket a medio repartir es del nodo caído
+//   (ver bloquear_archivo_espera), y reclamar_turnos lo salta
+void reparar_mutex(pthread_mutex_t *mutex) {
+    SistemaArchivos *actual = sistema;
+    sistema = shards[shard_de(mutex)];
+    
+    if (mutex == &sistema->lock_leases) {
+        rehacer_leases();
+    } else if (mutex == &sistema->lock_datos) {
+        sanear_libres();
+    } else {
+        sanear_cola((ColaEspera *)mutex); // El mutex es el primer campo de la cola
+    }
+    pthread_mutex_consistent(mutex);
+    
+    sistema = actual;
+    if (!modo_silencioso) {
+        printf("[Nodo %d] Un nodo murió con un mutex compartido tomado: estado reparado\n", id_nodo);
+    }
+}
+
+// Rehacer el montículo de leases del shard actual a partir de los archivos
+// bloqueados (requiere lock_leases). Se leen sin sus locks: un lease de más
+// no importa, porque expirar_lease vuelve a comprobarlo todo
+void rehacer_leases() {
+    memset(sistema->pos_heap, 0, sizeof(sistema->pos_heap));
+    sistema->num_leases = 0;
+    for (int i = 0; i < sistema->max_posicion; i++) {
+        if (sistema->archivos[i].en_uso && sistema->archivos[i].bloqueado) {
+            int k = sistema->num_leases++;
+            sistema->heap_leases[k].expiracion = sistema->archivos[i].expiracion_lease;
+            sistema->heap_leases[k].posicion = i;
+            sistema->pos_heap[i] = k + 1;
+        }
+    }
+    for (int k = sistema->num_leases / 2 - 1; k >= 0; k--) {
+        bajar_lease(k);
+    }
+    avisar_futex(&sistema->avisos_leases);
+}
+
+// Dejar la lista de huecos del shard actual ordenada y sin solapes
+// descartando las entradas que no lo cumplen (requiere lock_datos)
+void sanear_libres() {
+    int num = sistema->num_libres;
+    if (num < 0 || num > MAX_EXTENSIONES_LIBRES) {
+        num = (num < 0) ? 0 : MAX_EXTENSIONES_LIBRES;
+    }
+    
+    int validas = 0, fin = 0;
+    for (int i = 0; i < num; i++) {
+        Extension hueco = sistema->libres[i];
+        if (hueco.num_bloques > 0 && hueco.inicio >= fin &&
+            hueco.inicio + hueco.num_bloques <= sistema->num_bloques) {
+            sistema->libres[validas++] = hueco;
+            fin = hueco.inicio + hueco.num_bloques;
+        }
+    }
+    sistema->num_libres = validas;
+}
+
+// Dejar una cola con sólo cancelaciones de tickets pendientes y un primero
+// sin cancelar (requiere el mutex de la cola)
+void sanear_cola(ColaEspera *cola) {
+    if (cola->siguiente - cola->turno > MAX_ESPERAS_ARCHIVO) {
+        cola->siguiente = cola->turno; // Irreparable: se vacía
+    }
+    for (uint32_t ticket = cola->siguiente; ticket != cola->turno + MAX_ESPERAS_ARCHIVO; ticket++) {
+        cola->cancelados &= ~(1ULL << (ticket % MAX_ESPERAS_ARCHIVO));
+    }
+    if (cola->turno != cola->siguiente &&
+        (cola->cancelados >> (cola->turno % MAX_ESPERAS_ARCHIVO)) & 1) {
+        cola->cancelados &= ~(1ULL << (cola->turno % MAX_ESPERAS_ARCHIVO));
+        avanzar_turno(cola);
+    }
+}
+
+// Empezar a medir una operación pública de este hilo. Devuelve su instante
+// de inicio, o 0 si no se muestrea (sólo se contará)
+int64_t iniciar_medida() {
+    if (!toca_muestra()) {
+        return 0;
+    }
+    espera_inicio_operacion = espera_hilo;
+    return ahora_ns();
+}
+
+// Terminar la medida de una operación empezada con iniciar_medida
+void terminar_medida(int tipo, int64_t inicio) {
+    ContadoresOperacion *contadores = &principal->estadisticas[id_nodo].operaciones[tipo];
+    
+    atomic_fetch_add_explicit(&contadores->operaciones, 1, memory_order_relaxed);
+    if (inicio == 0) {
+        return;
+    }
+    
+    int64_t duracion = ahora_ns() - inicio;
+    atomic_fetch_add_explicit(&contadores->muestras, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->tiempo_ns, duracion, memory_order_relaxed);
+    atomic_fetch_add_explicit(&contadores->espera_ns, espera_hilo - espera_inicio_operacion,
+                              memory_order_relaxed);
+    actualizar_maximo(&contadores->max_ns, duracion);
+}
+
+// Mostrar los contadores de locks y operaciones de un nodo o, con nodo < 0,
+// la suma de todos. Se leen sin bloquear a nadie: cada contador es coherente
+// aunque el conjunto pueda mezclar operaciones en curso
+void mostrar_estadisticas(int nodo) {
+    if (nodo < 0) {
+        printf("--- ESTADÍSTICAS DE LOCKS (todos los nodos) ---\n");
+    } else {
+        printf("--- ESTADÍSTICAS DE LOCKS (Nodo %d) ---\n", nodo);
+    }
+    printf("%-18s %-11s %-11s %-7s %-11s %-12s %-11s %-12s\n", "Lock", "Adquis.", "Contend.",
+           "%", "Esp.tot ms", "Esp.máx us", "Ret.med us", "Ret.máx us");
+    
+    for (int c = 0; c < NUM_CLASES_LOCK; c++) {
+        uint64_t adquisiciones = 0, contendidas = 0, espera = 0, max_espera = 0;
+        uint64_t muestras = 0, retencion = 0, max_retencion = 0;
+        for (int n = 0; n < MAX_NODOS; n++) {
+            if (nodo >= 0 && n != nodo) {
+                continue;
+            }
+            ContadoresLock *contadores = &principal->estadisticas[n].locks[c];
+            adquisiciones += contadores->adquisiciones;
+            contendidas += contadores->contendidas;
+            espera += contadores->espera_ns;
+            muestras += contadores->muestras;
+            retencion += contadores->retencion_ns;
+            if (contadores->max_espera_ns > max_espera) {
+                max_espera = contadores->max_espera_ns;
+            }
+            if (contadores->max_retencion_ns > max_retencion) {
+                max_retencion = contadores->max_retencion_ns;
+            }
+        }
+        
+        if (adquisiciones == 0) {
+            continue;
+        }
+        printf("%-18s %-11llu %-11llu %-7.2f %-11.3f %-11.1f %-11.2f %-11.1f\n",
+               nombres_locks[c], (unsigned long long)adquisiciones,
+               (unsigned long long)contendidas, 100.0 * contendidas / adquisiciones,
+               espera / 1e6, max_espera / 1e3,
+               muestras > 0 ? retencion / 1e3 / muestras : 0.0, max_retencion / 1e3);
+    }
+    
+    // Los encabezados con tilde ocupan un byte más de lo que muestran
+    printf("%-19s %-11s %-11s %-11s %-12s %-11s\n", "Operación", "Total", "Medidas",
+           "Media us", "Máx us", "% espera");
+    for (int t = 0; t < NUM_TIPOS_OPERACION; t++) {
+        uint64_t operaciones = 0, muestras = 0, tiempo = 0, max_tiempo = 0, espera = 0;
+        for (int n = 0; n < MAX_NODOS; n++) {
+            if (nodo >= 0 && n != nodo) {
+                continue;
+            }
+            ContadoresOperacion *contadores = &principal->estadisticas[n].operaciones[t];
+            operaciones += contadores->operaciones;
+            muestras += contadores->muestras;
+            tiempo += contadores->tiempo_ns;
+            espera += contadores->espera_ns;
+            if (contadores->max_ns > max_tiempo) {
+                max_tiempo = contadores->max_ns;
+            }
+        }
+        
+        if (operaciones == 0) {
+            continue;
+        }
+        printf("%-18s %-11llu %-11llu %-11.2f %-11.1f %-11.2f\n", nombres_estadisticas[t],
+               (unsigned long long)operaciones, (unsigned long long)muestras,
+               muestras > 0 ? tiempo / 1e3 / muestras : 0.0, max_tiempo / 1e3,
+               tiempo > 0 ? 100.0 * espera / tiempo : 0.0);
+    }
+    
+    // Compresión: ratio sobre todo lo que superó el umbral y coste de CPU
+    uint64_t compresiones = 0, originales = 0, guardados = 0, compresion = 0;
+    uint64_t descompresiones = 0, descomprimidos = 0, descompresion = 0;
+    for (int n = 0; n < MAX_NODOS; n++) {
+        if (nodo >= 0 && n != nodo) {
+            continue;
+        }
+        ContadoresCompresion *contadores = &principal->estadisticas[n].compresion;
+        compresiones += contadores->compresiones;
+        originales += contadores->bytes_originales;
+        guardados += contadores->bytes_guardados;
+        compresion += contadores->compresion_ns;
+        descompresiones += contadores->descompresiones;
+        descomprimidos += contadores->bytes_descomprimidos;
+        descompresion += contadores->descompresion_ns;
+    }
+    if (compresiones > 0) {
+        printf("Compresión: %llu contenidos, %llu -> %llu bytes (ratio %.2f), "
+               "%.3f ms de CPU (%.1f MB/s)\n", (unsigned long long)compresiones,
+               (unsigned long long)originales, (unsigned long long)guardados,
+               guardados > 0 ? (double)originales / guardados : 0.0, compresion / 1e6,
+               compresion > 0 ? originales * 1e3 / compresion : 0.0);
+    }
+    if (descompresiones > 0) {
+        printf("Descompresión: %llu lecturas, %llu bytes, %.3f ms de CPU (%.1f MB/s)\n",
+               (unsigned long long)descompresiones, (unsigned long long)descomprimidos,
+               descompresion / 1e6,
+               descompresion > 0 ? descomprimidos * 1e3 / descompresion : 0.0);
+    }
+}
+
+// Mostrar cuánto ahorran la deduplicación y la compresión: bytes de todos
+// los archivos con contenido frente a los bytes realmente guardados
+void mostrar_deduplicacion(void) {
+    long archivos = 0, distintos = 0, logicos = 0, guardados = 0, bloques = 0;
+    
+    // Cada shard deduplica por separado
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        tomar_mutex(&sistema->lock_datos);
+        for (int c = 0; c < TAM_CONTENIDOS; c++) {
+            ContenidoCompartido *contenido = &sistema->contenidos[c];
+            
+            if (contenido->referencias > 0) {
+                archivos += contenido->referencias;
+                distintos++;
+                logicos += (long)contenido->tamanio * contenido->referencias;
+                guardados += (contenido->tamanio_comprimido > 0) ? contenido->tamanio_comprimido
+                                                                 : contenido->tamanio;
+                bloques += contenido->datos.num_bloques;
+            }
+        }
+        soltar_mutex(&sistema->lock_datos);
+    }
+    
+    printf("--- DEDUPLICACIÓN ---\n");
+    printf("Archivos con contenido: %ld, contenidos distintos: %ld\n", archivos, distintos);
+    printf("Bytes lógicos: %ld, guardados: %ld (%ld bloques), ahorro: %.1f %%\n",
+           logicos, guardados, bloques, logicos > 0 ? 100.0 * (logicos - guardados) / logicos : 0.0);
+}
+
+// Volcar las estadísticas de todos los nodos en formato tabulado (una línea
+// por nodo y lock, operación o sentido de la compresión, tiempos en ns)
+// para procesarlas con otras herramientas. Devuelve 0 o -1 si no se pudo escribir
+int volcar_estadisticas(const char *ruta) {
+    FILE *salida = (strcmp(ruta, "-") == 0) ? stdout : fopen(ruta, "w");
+    if (salida == NULL) {
+        return -1;
+    }
+    
+    fprintf(salida, "tipo\tnodo\tnombre\ttotal\tcontendidas\tespera_ns\tmax_espera_ns\t"
+                    "muestras\ttiempo_ns\tmax_tiempo_ns\tbytes_entrada\tbytes_salida\n");
+    for (int n = 0; n < MAX_NODOS; n++) {
+        for (int c = 0; c < NUM_CLASES_LOCK; c++) {
+            ContadoresLock *contadores = &principal->estadisticas[n].locks[c];
+            fprintf(salida, "lock\t%d\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t-\t-\n",
+                    n, nombres_locks[c],
+                    (unsigned long long)contadores->adquisiciones,
+                    (unsigned long long)contadores->contendidas,
+                    (unsigned long long)contadores->espera_ns,
+                    (unsigned long long)contadores->max_espera_ns,
+                    (unsigned long long)contadores->muestras,
+                    (unsigned long long)contadores->retencion_ns,
+                    (unsigned long long)contadores->max_retencion_ns);
+        }
+        for (int t = 0; t < NUM_TIPOS_OPERACION; t++) {
+            ContadoresOperacion *contadores = &principal->estadisticas[n].operaciones[t];
+            fprintf(salida, "operacion\t%d\t%s\t%llu\t-\t%llu\t-\t%llu\t%llu\t%llu\t-\t-\n",
+                    n, nombres_estadisticas[t],
+                    (unsigned long long)contadores->operaciones,
+                    (unsigned long long)contadores->espera_ns,
+                    (unsigned long long)contadores->muestras,
+                    (unsigned long long)contadores->tiempo_ns,
+                    (unsigned long long)contadores->max_ns);
+        }
+        
+        ContadoresCompresion *compresion = &principal->estadisticas[n].compresion;
+        fprintf(salida, "compresion\t%d\tcomprimir\t%llu\t-\t-\t-\t-\t%llu\t-\t%llu\t%llu\n",
+                n, (unsigned long long)compresion->compresiones,
+                (unsigned long long)compresion->compresion_ns,
+                (unsigned long long)compresion->bytes_originales,
+                (unsigned long long)compresion->bytes_guardados);
+        fprintf(salida, "compresion\t%d\tdescomprimir\t%llu\t-\t-\t-\t-\t%llu\t-\t-\t%llu\n",
+                n, (unsigned long long)compresion->descompresiones,
+                (unsigned long long)compresion->descompresion_ns,
+                (unsigned long long)compresion->bytes_descomprimidos);
+    }
+    
+    int resultado = 0;
+    if (salida != stdout) {
+        resultado = fclose(salida);
+    } else {
+        fflush(salida);
+    }
+    return resultado == 0 ? 0 : -1;
+}
+
+// Poner a cero los contadores de este nodo
+void reiniciar_estadisticas() {
+    EstadisticasNodo *fila = &principal->estadisticas[id_nodo];
+    
+    for (int c = 0; c < NUM_CLASES_LOCK; c++) {
+        ContadoresLock *contadores = &fila->locks[c];
+        contadores->adquisiciones = 0;
+        contadores->contendidas = 0;
+        contadores->espera_ns = 0;
+        contadores->max_espera_ns = 0;
+        contadores->muestras = 0;
+        contadores->retencion_ns = 0;
+        contadores->max_retencion_ns = 0;
+    }
+    for (int t = 0; t < NUM_TIPOS_OPERACION; t++) {
+        ContadoresOperacion *contadores = &fila->operaciones[t];
+        contadores->operaciones = 0;
+        contadores->muestras = 0;
+        contadores->tiempo_ns = 0;
+        contadores->max_ns = 0;
+        contadores->espera_ns = 0;
+    }
+    memset(&fila->compresion, 0, sizeof(fila->compresion));
+}
+
+// Instante actual en milisegundos del reloj monotónico
+int64_t ahora_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Latido del nodo: anota su última actividad sin tomar ningún lock
+void latir() {
+    atomic_store_explicit(&principal->latido_nodos[id_nodo], ahora_ms(), memory_order_relaxed);
+}
+
+// Intercambiar dos entradas del montículo manteniendo pos_heap (requiere lock_leases)
+void intercambiar_leases(int a, int b) {
+    EntradaLease tmp = sistema->heap_leases[a];
+    sistema->heap_leases[a] = sistema->heap_leases[b];
+    sistema->heap_leases[b] = tmp;
+    sistema->pos_heap[sistema->heap_leases[a].posicion] = a + 1;
+    sistema->pos_heap[sistema->heap_leases[b].posicion] = b + 1;
+}
+
+// Subir una entrada hasta su sitio en el montículo (requiere lock_leases)
+void subir_lease(int k) {
+    while (k > 0 && sistema->heap_leases[(k - 1) / 2].expiracion > sistema->heap_leases[k].expiracion) {
+        intercambiar_leases(k, (k - 1) / 2);
+        k = (k - 1) / 2;
+    }
+}
+
+// Bajar una entrada hasta su sitio en el montículo (requiere lock_leases)
+void bajar_lease(int k) {
+    for (;;) {
+        int menor = k;
+        int izq = 2 * k + 1, der = 2 * k + 2;
+        
+        if (izq < sistema->num_leases &&
+            sistema->heap_leases[izq].expiracion < sistema->heap_leases[menor].expiracion) {
+            menor = izq;
+        }
+        if (der < sistema->num_leases &&
+            sistema->heap_leases[der].expiracion < sistema->heap_leases[menor].expiracion) {
+            menor = der;
+        }
+        if (menor == k) {
+            return;
+        }
+        intercambiar_leases(k, menor);
+        k = menor;
+    }
+}
+
+// Programar (o reprogramar) la expiración del lease de un archivo
+void programar_lease(int posicion, int64_t expiracion) {
+    tomar_mutex(&sistema->lock_leases);
+    
+    int k = sistema->pos_heap[posicion] - 1;
+    if (k < 0) {
+        k = sistema->num_leases++;
+        sistema->heap_leases[k].posicion = posicion;
+        sistema->pos_heap[posicion] = k + 1;
+    }
+    sistema->heap_leases[k].expiracion = expiracion;
+    subir_lease(k);
+    bajar_lease(sistema->pos_heap[posicion] - 1);
+    
+    // Si es la nueva expiración más próxima, los hilos deben recalcular su espera
+    if (sistema->pos_heap[posicion] == 1) {
+        avisar_futex(&sistema->avisos_leases);
+    }
+    
+    soltar_mutex(&sistema->lock_leases);
+}
+
+// Quitar del montículo el lease de un archivo, si lo tiene
+void cancelar_lease(int posicion) {
+    tomar_mutex(&sistema->lock_leases);
+    
+    int k = sistema->pos_heap[posicion] - 1;
+    if (k >= 0) {
+        int ultima = --sistema->num_leases;
+        if (k != ultima) {
+            intercambiar_leases(k, ultima);
+        }
+        sistema->pos_heap[posicion] = 0;
+        if (k != ultima) {
+            subir_lease(k);
+            bajar_lease(k);
+        }
+    }
+    
+    soltar_mutex(&sistema->lock_leases);
+}
+
+// Hacer que los leases de un nodo que se desconecta expiren inmediatamente
+void expirar_leases_nodo(int nodo) {
+    tomar_mutex(&sistema->lock_leases);
+    
+    // nodo_bloqueo se lee sin el lock del archivo: si cambia entretanto,
+    // expirar_lease vuelve a comprobarlo todo antes de liberar nada
+    int cambios = 0;
+    for (int k = 0; k < sistema->num_leases; k++) {
+        if (sistema->archivos[sistema->heap_leases[k].posicion].nodo_bloqueo == nodo) {
+            sistema->heap_leases[k].expiracion = 0;
+            cambios++;
+        }
+    }
+    
+    if (cambios > 0) {
+        for (int k = sistema->num_leases / 2 - 1; k >= 0; k--) {
+            bajar_lease(k);
+        }
+        avisar_futex(&sistema->avisos_leases);
+    }
+    
+    soltar_mutex(&sistema->lock_leases);
+}
+
+// Resolver un lease vencido que ya se sacó del montículo. Si el nodo sigue
+// activo y ha latido durante el lease, éste se renueva desde su último
+// latido; si no, el bloqueo se libera
+void expirar_lease(int posicion) {
+    tomar_lectura(&sistema->lock_tabla);
+    tomar_escritura(&sistema->locks_archivos[posicion]);
+    
+    Archivo *archivo = &sistema->archivos[posicion];
+    int64_t ahora = ahora_ms();
+    
+    if (archivo->en_uso && archivo->bloqueado) {
+        int nodo = archivo->nodo_bloqueo;
+        int64_t latido = atomic_load_explicit(&principal->latido_nodos[nodo], memory_order_relaxed);
+        int activo = principal->nodos_activos[nodo];
+        
+        if (activo && archivo->expiracion_lease > ahora) {
+            // Se renovó mientras tanto
+            programar_lease(posicion, archivo->expiracion_lease);
+        } else if (activo && latido + duracion_lease > archivo->expiracion_lease) {
+            archivo->expiracion_lease = latido + duracion_lease;
+            programar_lease(posicion, archivo->expiracion_lease);
+        } else {
+            printf("[Sincronización] Liberando bloqueo del archivo %s (lease del nodo %d expirado)\n",
+                   archivo->nombre, nodo);
+            iniciar_cambio(posicion);
+            archivo->bloqueado = 0;
+            archivo->nodo_bloqueo = -1;
+            publicar_cambio(posicion);
+            avisar_esperas(posicion);
+        }
+    }
+    
+    soltar_rwlock(&sistema->locks_archivos[posicion]);
+    soltar_rwlock(&sistema->lock_tabla);
+}
+
+// Despertar a los hilos de sincronización de todos los shards (por
+// ejemplo, para terminar)
+void despertar_sincronizacion() {
+    for (int k = 0; k < num_shards; k++) {
+        tomar_mutex(&shards[k]->lock_leases);
+        avisar_futex(&shards[k]->avisos_leases);
+        soltar_mutex(&shards[k]->lock_leases);
+    }
+}
+
+// Función para el hilo de sincronización del shard arg: duerme hasta la
+// próxima expiración de un lease, o indefinidamente si no hay ninguno. Usa
+// lock_leases sin instrumentar: sus esperas de avisos no son retención
+void *hilo_sincronizacion(void *arg) {
+    sistema = shards[(intptr_t)arg];
+    tomar_mutex_compartido(&sistema->lock_leases);
+    
+    while (continuar) {
+        if (sistema->num_leases == 0) {
+            esperar_futex(&sistema->avisos_leases, &sistema->lock_leases, -1);
+            continue;
+        }
+        
+        EntradaLease primera = sistema->heap_leases[0];
+        int64_t restante = primera.expiracion - ahora_ms();
+        if (restante > 0) {
+            esperar_futex(&sistema->avisos_leases, &sistema->lock_leases, restante);
+            continue;
+        }
+        
+        // Sacar el lease vencido y resolverlo fuera de lock_leases para
+        // respetar el orden tabla -> archivo -> leases
+        int ultima = --sistema->num_leases;
+        if (ultima > 0) {
+            intercambiar_leases(0, ultima);
+        }
+        sistema->pos_heap[primera.posicion] = 0;
+        bajar_lease(0);
+        
+        pthread_mutex_unlock(&sistema->lock_leases);
+        expirar_lease(primera.posicion);
+        tomar_mutex_compartido(&sistema->lock_leases);
+    }
+    
+    pthread_mutex_unlock(&sistema->lock_leases);
+    return NULL;
+}
+
+// Hilo de latido: mantiene vivos los leases de este nodo aunque la interfaz
+// esté inactiva (un nodo que sigue en marcha no pierde sus bloqueos; uno que
+// termina o se cuelga deja de latir). Late varias veces por lease y al
+// menos cada segundo, para terminar pronto al salir
+void *hilo_latido(void *arg) {
+    int64_t intervalo = (duracion_lease / 4 < 1000) ? duracion_lease / 4 : 1000;
+    struct timespec ts = {intervalo / 1000, (intervalo % 1000) * 1000000};
+    
+    while (continuar) {
+        latir();
+        nanosleep(&ts, NULL);
+    }
+    
+    return NULL;
+}
+
+// Función para el hilo de monitoreo
+void *hilo_monitor(void *arg) {
+    struct timespec ts = {2, 0}; // 2 segundos
+    sistema = principal;
+    
+    while (continuar) {
+        // Pequeña pausa
+        nanosleep(&ts, NULL);
+        
+        // Mostrar estado actual del sistema (sin bloquear a los escritores:
+        // se copia el estado y se formatea fuera de cualquier sección crítica)
+        printf("\n=== ESTADO DEL SISTEMA (Nodo %d) ===\n", id_nodo);
+        mostrar_estado_nodos();
+        mostrar_archivos();
+    }
+    
+    return NULL;
+}
+
+// Crear un archivo (requiere lock_tabla en escritura)
+// Devuelve su posición o -1 si ya existe, -2 si la tabla (o el árbol de
+// directorios) está llena, -3 si no hay espacio en la región de datos o -4
+// si la ruta no es válida o choca con un directorio o archivo existente
+int aplicar_crear(const char *nombre, const char *contenido, int longitud, int nodo) {
+    // Verificar si el archivo ya existe
+    if (buscar_archivo(nombre) >= 0) {
+        return -1; // El archivo ya existe
+    }
+    
+    // Obtener una posición libre
+    int idx = reservar_posicion();
+    if (idx < 0) {
+        return -2; // Sistema lleno
+    }
+    
+    // Colocarlo en el árbol de directorios
+    int hoja = insertar_ruta(nombre, idx);
+    if (hoja < 0) {
+        liberar_posicion(idx);
+        return (hoja == -1) ? -4 : -2; // Ruta no válida o trie lleno
+    }
+    
+    // Crear el nuevo archivo conservando la generación de la posición
+    iniciar_cambio(idx);
+    unsigned int generacion = sistema->archivos[idx].generacion;
+    memset(&sistema->archivos[idx], 0, sizeof(Archivo));
+    sistema->archivos[idx].generacion = generacion;
+    sistema->archivos[idx].nodo_directorio = hoja;
+    if (asignar_contenido(&sistema->archivos[idx], contenido, longitud,
+                          crc32c(0, contenido, longitud)) < 0) {
+        int padre = sistema->directorio[hoja].padre;
+        quitar_nodo_directorio(hoja);
+        podar_directorios(padre);
+        liberar_posicion(idx);
+        publicar_cambio(idx);
+        return -3; // Sin espacio en la región de datos
+    }
+    strncpy(sistema->archivos[idx].nombre, nombre, MAX_NOMBRE - 1);
+    sistema->archivos[idx].propietario = nodo;
+    sistema->archivos[idx].ultima_modificacion = time(NULL);
+    sistema->archivos[idx].bloqueado = 0;
+    sistema->archivos[idx].nodo_bloqueo = -1;
+    sistema->archivos[idx].en_uso = 1;
+    publicar_cambio(idx);
+    
+    // Incrementar contador de archivos y añadirlo al índice
+    sistema->num_archivos++;
+    indexar_archivo(idx);
+    
+    return idx;
+}
+
+// Sustituir el contenido del archivo de la posición i (requiere el archivo
+// en exclusiva). Devuelve el nuevo tamaño, -2 si otro nodo lo tiene
+// bloqueado o -3 si no hay espacio
+int aplicar_escritura(int i, const char *contenido, int longitud, int nodo) {
+    Archivo *archivo = &sistema->archivos[i];
+    
+    // Verificar si el archivo está bloqueado
+    if (archivo->bloqueado && archivo->nodo_bloqueo != nodo) {
+        return -2; // Archivo bloqueado por otro nodo
+    }
+    
+    // Un contenido idéntico no se copia ni cambia la fecha: la CRC descarta
+    // casi todos los casos distintos sin leer el contenido actual
+    uint32_t crc = crc32c(0, contenido, longitud);
+    if (longitud == archivo->tamanio && crc == archivo->crc && archivo->tamanio_comprimido == 0 &&
+        memcmp(direccion_bloque(archivo->datos.inicio), contenido, longitud) == 0) {
+        return archivo->tamanio;
+    }
+    
+    // Actualizar el contenido del archivo
+    iniciar_cambio(i);
+    int resultado = -3; // Sin espacio en la región de datos
+    if (asignar_contenido(archivo, contenido, longitud, crc) == 0) {
+        archivo->ultima_modificacion = time(NULL);
+        resultado = archivo->tamanio;
+    }
+    publicar_cambio(i);
+    return resultado;
+}
+
+// Añadir datos al final del archivo de la posición i (requiere el archivo
+// en exclusiva). Mismos resultados que aplicar_escritura
+int aplicar_anexo(int i, const char *texto, int longitud, int nodo) {
+    Archivo *archivo = &sistema->archivos[i];
+    
+    // Verificar si el archivo está bloqueado
+    if (archivo->bloqueado && archivo->nodo_bloqueo != nodo) {
+        return -2; // Archivo bloqueado por otro nodo
+    }
+    
+    // Un contenido comprimido se reconstruye entero
+    if (archivo->tamanio_comprimido > 0) {
+        iniciar_cambio(i);
+        int resultado = -3; // Sin memoria o sin espacio en la región de datos
+        if (modificar_comprimido(archivo, archivo->tamanio, texto, longitud) == 0) {
+            archivo->ultima_modificacion = time(NULL);
+            resultado = archivo->tamanio;
+        }
+        publicar_cambio(i);
+        return resultado;
+    }
+    
+    // Hacer sitio y copiar sólo el texto nuevo, en una copia propia si el
+    // contenido estaba compartido. Si no hay sitio para la copia, el archivo
+    // sigue en la extensión compartida y la tabla no se toca
+    iniciar_cambio(i);
+    if (privatizar_contenido(archivo) < 0) {
+        publicar_cambio(i);
+        return -3; // Sin espacio en la región de datos
+    }
+    int resultado = -3; // Sin espacio en la región de datos
+    if (ampliar_extension(archivo, BLOQUES_PARA(archivo->tamanio + longitud)) == 0) {
+        memcpy(direccion_bloque(archivo->datos.inicio) + archivo->tamanio, texto, longitud);
+        archivo->tamanio += longitud;
+        archivo->crc = crc32c(archivo->crc, texto, longitud);
+        archivo->ultima_modificacion = time(NULL);
+        resultado = archivo->tamanio;
+    }
+    registrar_contenido(archivo);
+    publicar_cambio(i);
+    return resultado;
+}
+
+// Sobrescribir longitud bytes desde desplazamiento, al estilo de pwrite
+// (requiere el archivo en exclusiva). Sólo se copian y se leen los bytes
+// afectados; si la escritura pasa del final, el archivo crece. Mismos
+// resultados que aplicar_escritura, o -4 si desplazamiento está fuera del archivo
+int aplicar_escritura_parcial(int i, int desplazamiento, const char *datos, int longitud, int nodo) {
+    Archivo *archivo = &sistema->archivos[i];
+    
+    // Verificar si el archivo está bloqueado
+    if (archivo->bloqueado && archivo->nodo_bloqueo != nodo) {
+        return -2; // Archivo bloqueado por otro nodo
+    }
+    
+    if (desplazamiento < 0 || desplazamiento > archivo->tamanio) {
+        return -4; // Dejaría un hueco sin definir
+    }
+    
+    // Bytes que sustituyen contenido existente; el resto amplía el archivo
+    int solapados = archivo->tamanio - desplazamiento;
+    if (solapados > longitud) {
+        solapados = longitud;
+    }
+    
+    if (archivo->tamanio_comprimido > 0) {
+        // No se puede modificar en el sitio: se reconstruye entero
+        iniciar_cambio(i);
+        int resultado = -3; // Sin memoria o sin espacio en la región de datos
+        if (modificar_comprimido(archivo, desplazamiento, datos, longitud) == 0) {
+            archivo->ultima_modificacion = time(NULL);
+            resultado = archivo->tamanio;
+        }
+        publicar_cambio(i);
+        return resultado;
+    }
+    
+    if (solapados == longitud &&
+        memcmp(direccion_bloque(archivo->datos.inicio) + desplazamiento, datos, longitud) == 0) {
+        return archivo->tamanio; // Sin cambios
+    }
+    
+    iniciar_cambio(i);
+    if (privatizar_contenido(archivo) < 0) {
+        publicar_cambio(i);
+        return -3; // Sin espacio para la copia propia: nada cambia
+    }
+    int resultado = -3; // Sin espacio en la región de datos
+    if (ampliar_extension(archivo, BLOQUES_PARA(desplazamiento + longitud)) == 0) {
+        char *destino = direccion_bloque(archivo->datos.inicio) + desplazamiento;
+        
+        archivo->crc = sustituir_crc32c(archivo->crc, destino, datos, solapados,
+                                        archivo->tamanio - desplazamiento - solapados);
+        memcpy(destino, datos, longitud);
+        if (longitud > solapados) {
+            archivo->crc = crc32c(archivo->crc, datos + solapados, longitud - solapados);
+            archivo->tamanio = desplazamiento + longitud;
+        }
+        archivo->ultima_modificacion = time(NULL);
+        resultado = archivo->tamanio;
+    }
+    registrar_contenido(archivo);
+    publicar_cambio(i);
+    return resultado;
+}
+
+// Eliminar el archivo al que apunta la celda pos del índice (requiere
+// lock_tabla en escritura). Devuelve 0, -2 si otro nodo lo tiene bloqueado
+// o -3 si el nodo no es el propietario
+int aplicar_eliminacion(int pos, int nodo) {
+    int i = sistema->indice[pos] - 1;
+    
+    // Verificar si el archivo está bloqueado
+    if (sistema->archivos[i].bloqueado && 
+        sistema->archivos[i].nodo_bloqueo != nodo) {
+        return -2; // Archivo bloqueado por otro nodo
+    }
+    
+    // Verificar si somos propietarios
+    if (sistema->archivos[i].propietario != nodo) {
+        return -3; // No es el propietario
+    }
+    
+    // Soltar su contenido: los bloques vuelven a la región de datos si
+    // ningún otro archivo lo comparte
+    tomar_mutex(&sistema->lock_datos);
+    soltar_contenido(&sistema->archivos[i]);
+    soltar_mutex(&sistema->lock_datos);
+    
+    if (sistema->archivos[i].bloqueado) {
+        cancelar_lease(i);
+    }
+    
+    // Quitarlo del árbol de directorios
+    int hoja = sistema->archivos[i].nodo_directorio;
+    int padre = sistema->directorio[hoja].padre;
+    quitar_nodo_directorio(hoja);
+    podar_directorios(padre);
+    
+    // Marcar la celda como borrada y liberar la posición: O(1), sin
+    // mover ningún otro archivo
+    sistema->indice[pos] = INDICE_BORRADO;
+    sistema->num_borrados++;
+    iniciar_cambio(i);
+    liberar_posicion(i);
+    publicar_cambio(i);
+    sistema->num_archivos--;
+    avisar_esperas(i);
+    
+    if (sistema->num_borrados > UMBRAL_COMPACTACION) {
+        compactar_tabla();
+    }
+    return 0;
+}
+
+// Función para crear un nuevo archivo
+int crear_archivo(const char *nombre, const char *contenido) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    // Crear modifica la tabla y el índice: acceso exclusivo
+    tomar_escritura(&sistema->lock_tabla);
+    int resultado = aplicar_crear(nombre, contenido, strlen(contenido), id_nodo);
+    uint64_t lsn = 0;
+    if (resultado >= 0) {
+        lsn = anotar_operacion(OP_CREAR, nombre, contenido, strlen(contenido), -1);
+    }
+    soltar_rwlock(&sistema->lock_tabla);
+    esperar_wal(lsn);
+    
+    if (resultado < 0) {
+        terminar_medida(OP_CREAR, medida);
+        return resultado;
+    }
+    
+    // Registrar operación en el log
+    registrar_log(OP_CREAR, nombre);
+    
+    if (!modo_silencioso) {
+        printf("[Nodo %d] Archivo %s creado correctamente\n", id_nodo, nombre);
+    }
+    terminar_medida(OP_CREAR, medida);
+    return 0; // Éxito
+}
+
+// Función para leer un archivo
+// Copia como mucho tam_buffer - 1 bytes y devuelve el tamaño completo
+int leer_archivo(const char *nombre, char *buffer, int tam_buffer) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int resultado = -1;
+    
+    // La tabla en lectura impide que el archivo desaparezca mientras se lee
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        // Los lectores del mismo archivo pueden ejecutarse a la vez
+        tomar_lectura(&sistema->locks_archivos[i]);
+        
+        // Copiar el contenido al buffer
+        resultado = sistema->archivos[i].tamanio;
+        int copiar = (resultado < tam_buffer - 1) ? resultado : tam_buffer - 1;
+        if (sistema->archivos[i].tamanio_comprimido == 0) {
+            memcpy(buffer, direccion_bloque(sistema->archivos[i].datos.inicio), copiar);
+        } else {
+            // Descomprimido entero aparte: el buffer puede quedarse corto
+            char *contenido = malloc(resultado);
+            if (contenido == NULL || leer_contenido(&sistema->archivos[i], contenido) < 0) {
+                resultado = -2;
+                copiar = 0;
+            } else {
+                memcpy(buffer, contenido, copiar);
+            }
+            free(contenido);
+        }
+        buffer[copiar] = '\0';
+        
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    
+    if (resultado >= 0) {
+        // Registrar operación en el log
+        registrar_log(OP_LEER, nombre);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] Archivo %s leído correctamente (%d bytes)\n", 
+                   id_nodo, nombre, resultado);
+        }
+    }
+    
+    terminar_medida(OP_LEER, medida);
+    return resultado;
+}
+
+// Abrir una vista del contenido de un archivo sin copiarlo: apunta a la
+// región de datos compartida. Puntero, longitud y versión se toman a la vez
+// con los locks, que se sueltan antes de volver: la vista no hace esperar a
+// nadie mientras se envía. Su extensión queda retenida con una referencia
+// en la tabla de contenidos hasta cerrar_vista, así que no se libera y
+// quien escriba en el archivo recibe una copia (copia al escribir): los
+// datos de la vista son siempre los de su versión, y vista_vigente dice si
+// siguen siendo los actuales. Un contenido comprimido, o uno que no está en
+// la tabla, no puede verse en el sitio: la vista tiene su propia copia.
+// Devuelve 0, -1 si el archivo no existe o -2 si no se pudo copiar o descomprimir
+int abrir_vista(const char *nombre, VistaArchivo *vista) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i < 0) {
+        soltar_rwlock(&sistema->lock_tabla);
+        terminar_medida(OP_LEER, medida);
+        return -1;
+    }
+    
+    tomar_lectura(&sistema->locks_archivos[i]);
+    Archivo *archivo = &sistema->archivos[i];
+    vista->copia = NULL;
+    vista->datos = "";
+    vista->longitud = archivo->tamanio;
+    vista->version = atomic_load_explicit(&sistema->secuencia_archivos[i], memory_order_acquire);
+    vista->posicion = i;
+    vista->shard = shard_de(sistema);
+    vista->fijada.inicio = 0;
+    vista->fijada.num_bloques = 0;
+    vista->crc = archivo->crc;
+    
+    int resultado = 0;
+    if (archivo->tamanio_comprimido > 0) {
+        vista->copia = malloc(archivo->tamanio);
+        if (vista->copia == NULL || leer_contenido(archivo, vista->copia) < 0) {
+            resultado = -2;
+        }
+    } else if (archivo->tamanio > 0) {
+        tomar_mutex(&sistema->lock_datos);
+        int c = celda_contenido(archivo);
+        if (c >= 0) {
+            sistema->contenidos[c].referencias++;
+            vista->fijada = archivo->datos;
+        }
+        soltar_mutex(&sistema->lock_datos);
+        
+        if (c < 0) {
+            vista->copia = malloc(archivo->tamanio);
+            if (vista->copia == NULL) {
+                resultado = -2;
+            } else {
+                memcpy(vista->copia, direccion_bloque(archivo->datos.inicio), archivo->tamanio);
+            }
+        }
+    }
+    
+    soltar_rwlock(&sistema->locks_archivos[i]);
+    soltar_rwlock(&sistema->lock_tabla);
+    
+    if (resultado < 0) {
+        free(vista->copia);
+        vista->copia = NULL;
+        terminar_medida(OP_LEER, medida);
+        return resultado;
+    }
+    if (vista->copia != NULL) {
+        vista->datos = vista->copia;
+    } else if (vista->fijada.num_bloques > 0) {
+        vista->datos = direccion_bloque(vista->fijada.inicio);
+    }
+    
+    registrar_log(OP_LEER, nombre);
+    terminar_medida(OP_LEER, medida);
+    return 0;
+}
+
+// Soltar la vista y la referencia a su extensión: si el archivo cambió o
+// se eliminó entretanto, es la vista quien libera los bloques
+void cerrar_vista(VistaArchivo *vista) {
+    if (vista->fijada.num_bloques > 0) {
+        SistemaArchivos *anterior = sistema;
+        sistema = shards[vista->shard];
+        
+        Archivo retenido = {0};
+        retenido.crc = vista->crc;
+        retenido.tamanio = vista->longitud;
+        retenido.datos = vista->fijada;
+        tomar_mutex(&sistema->lock_datos);
+        soltar_contenido(&retenido);
+        soltar_mutex(&sistema->lock_datos);
+        
+        sistema = anterior;
+        vista->fijada.num_bloques = 0;
+    }
+    free(vista->copia);
+    vista->copia = NULL;
+    vista->datos = NULL;
+}
+
+// Comprobar, también después de cerrar_vista, si el archivo sigue como
+// estaba al abrir la vista (una copia hecha desde ella sigue al día).
+// Cualquier cambio de metadatos cuenta como cambio
+int vista_vigente(const VistaArchivo *vista) {
+    return atomic_load_explicit(&shards[vista->shard]->secuencia_archivos[vista->posicion],
+                                memory_order_acquire) == vista->version;
+}
+
+// Escribir una cabecera y el contenido de una vista abierta en un
+// descriptor (salida estándar, socket...) con writev, directamente desde la
+// memoria compartida. Devuelve 0 o -1 si falla la escritura
+int enviar_vista(int fd, const VistaArchivo *vista, const char *cabecera) {
+    struct iovec partes[3] = {
+        {(void *)cabecera, strlen(cabecera)},
+        {(void *)vista->datos, vista->longitud},
+        {"\n", 1}
+    };
+    struct iovec *pendientes = partes;
+    int num_pendientes = 3;
+    
+    // writev puede escribir sólo una parte (p. ej. en un socket o una tubería)
+    while (num_pendientes > 0) {
+        ssize_t escritos = writev(fd, pendientes, num_pendientes);
+        if (escritos < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        
+        while (num_pendientes > 0 && (size_t)escritos >= pendientes->iov_len) {
+            escritos -= pendientes->iov_len;
+            pendientes++;
+            num_pendientes--;
+        }
+        if (num_pendientes > 0) {
+            pendientes->iov_base = (char *)pendientes->iov_base + escritos;
+            pendientes->iov_len -= escritos;
+        }
+    }
+    
+    return 0;
+}
+
+// Función para escribir en un archivo
+int escribir_archivo(const char *nombre, const char *nuevo_contenido) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int resultado = -1;
+    uint64_t lsn = 0;
+    
+    // Bloquear la tabla en lectura y sólo este archivo en escritura
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        tomar_escritura(&sistema->locks_archivos[i]);
+        resultado = aplicar_escritura(i, nuevo_contenido, strlen(nuevo_contenido), id_nodo);
+        if (resultado >= 0) {
+            lsn = anotar_operacion(OP_ESCRIBIR, nombre, nuevo_contenido, strlen(nuevo_contenido), -1);
+        }
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    esperar_wal(lsn);
+    
+    if (resultado >= 0) {
+        // Registrar operación en el log
+        registrar_log(OP_ESCRIBIR, nombre);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] Archivo %s modificado correctamente (%d bytes)\n", 
+                   id_nodo, nombre, resultado);
+        }
+    }
+    
+    terminar_medida(OP_ESCRIBIR, medida);
+    return resultado;
+}
+
+// Función para añadir texto al final de un archivo
+int anexar_archivo(const char *nombre, const char *texto) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int resultado = -1;
+    uint64_t lsn = 0;
+    
+    // Bloquear la tabla en lectura y sólo este archivo en escritura
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        tomar_escritura(&sistema->locks_archivos[i]);
+        resultado = aplicar_anexo(i, texto, strlen(texto), id_nodo);
+        if (resultado >= 0) {
+            lsn = anotar_operacion(OP_ANEXAR, nombre, texto, strlen(texto), -1);
+        }
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    esperar_wal(lsn);
+    
+    if (resultado >= 0) {
+        // Registrar operación en el log
+        registrar_log(OP_ANEXAR, nombre);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] Archivo %s ampliado correctamente (%d bytes)\n", 
+                   id_nodo, nombre, resultado);
+        }
+    }
+    
+    terminar_medida(OP_ANEXAR, medida);
+    return resultado;
+}
+
+// Función para sobrescribir parte de un archivo
+int escribir_parcial_archivo(const char *nombre, int desplazamiento, const char *texto) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int resultado = -1;
+    uint64_t lsn = 0;
+    
+    // Bloquear la tabla en lectura y sólo este archivo en escritura
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        tomar_escritura(&sistema->locks_archivos[i]);
+        resultado = aplicar_escritura_parcial(i, desplazamiento, texto, strlen(texto), id_nodo);
+        if (resultado >= 0) {
+            lsn = anotar_operacion(OP_ESCRIBIR, nombre, texto, strlen(texto), desplazamiento);
+        }
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    esperar_wal(lsn);
+    
+    if (resultado >= 0) {
+        // Registrar operación en el log
+        registrar_log(OP_ESCRIBIR, nombre);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] Archivo %s modificado desde el byte %d (%d bytes)\n", 
+                   id_nodo, nombre, desplazamiento, resultado);
+        }
+    }
+    
+    terminar_medida(OP_ESCRIBIR, medida);
+    return resultado;
+}
+
+// Función para comprobar el contenido de un archivo contra su CRC32C.
+// Se calcula sobre la región de datos, sin copiar el contenido salvo que
+// haya que descomprimirlo.
+// Devuelve 1 si coincide, 0 si no o -1 si el archivo no existe
+int verificar_archivo(const char *nombre) {
+    usar_shard(nombre);
+    int resultado = -1;
+    uint32_t esperada = 0, calculada = 0;
+    
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        tomar_lectura(&sistema->locks_archivos[i]);
+        
+        esperada = sistema->archivos[i].crc;
+        if (sistema->archivos[i].tamanio_comprimido == 0) {
+            calculada = crc32c(0, direccion_bloque(sistema->archivos[i].datos.inicio),
+                               sistema->archivos[i].tamanio);
+        } else {
+            char *contenido = malloc(sistema->archivos[i].tamanio);
+            if (contenido != NULL && leer_contenido(&sistema->archivos[i], contenido) == 0) {
+                calculada = crc32c(0, contenido, sistema->archivos[i].tamanio);
+            } else {
+                calculada = ~esperada; // Sin memoria o comprimido dañado
+            }
+            free(contenido);
+        }
+        resultado = (calculada == esperada);
+        
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    
+    if (resultado == 1) {
+        printf("[Nodo %d] Archivo %s íntegro (CRC32C %08x)\n", id_nodo, nombre, calculada);
+    } else if (resultado == 0) {
+        printf("[Nodo %d] Archivo %s dañado: CRC32C %08x, esperada %08x\n",
+               id_nodo, nombre, calculada, esperada);
     }
     
     return resultado;
@@ -302,242 +4615,2793 @@ int escribir_archivo(const char *nombre, const char *nuevo_contenido) {
 
 // Función para eliminar un archivo
 int eliminar_archivo(const char *nombre) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int resultado = -1;
+    uint64_t lsn = 0;
+    
+    // Eliminar modifica el índice: acceso exclusivo a la tabla.
+    // Como todo acceso a un archivo mantiene la tabla en lectura, aquí
+    // nadie puede estar usando el archivo
+    tomar_escritura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int pos = buscar_en_indice(nombre);
+    if (pos >= 0) {
+        resultado = aplicar_eliminacion(pos, id_nodo);
+    }
+    if (resultado == 0) {
+        lsn = anotar_operacion(OP_ELIMINAR, nombre, "", 0, -1);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    esperar_wal(lsn);
+    
+    if (resultado == 0) {
+        // Registrar operación en el log
+        registrar_log(OP_ELIMINAR, nombre);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] Archivo %s eliminado correctamente\n", id_nodo, nombre);
+        }
+    }
+    
+    terminar_medida(OP_ELIMINAR, medida);
+    return resultado;
+}
+
+// Tomar en escritura lock_tabla de los shards de dos nombres (una sola vez
+// si coinciden), en orden de shard
+void tomar_tablas_par(const char *a, const char *b) {
+    int primero = indice_shard(a), segundo = indice_shard(b);
+    if (primero > segundo) {
+        int tmp = primero;
+        primero = segundo;
+        segundo = tmp;
+    }
+    
+    tomar_escritura(&shards[primero]->lock_tabla);
+    if (segundo != primero) {
+        tomar_escritura(&shards[segundo]->lock_tabla);
+    }
+}
+
+// Soltar las tablas tomadas con tomar_tablas_par
+void soltar_tablas_par(const char *a, const char *b) {
+    if (indice_shard(b) != indice_shard(a)) {
+        soltar_rwlock(&shards[indice_shard(b)]->lock_tabla);
+    }
+    soltar_rwlock(&shards[indice_shard(a)]->lock_tabla);
+}
+
+// Función para renombrar un archivo o un directorio con todo su contenido
+int renombrar(const char *origen, const char *destino) {
+    int64_t medida = iniciar_medida();
+    
+    // Cambia nombres y el índice: acceso exclusivo a la tabla (de los dos
+    // shards si el destino está en otro)
+    tomar_tablas_par(origen, destino);
+    int resultado = aplicar_renombrado(origen, destino, id_nodo);
+    uint64_t lsn = 0;
+    if (resultado >= 0) {
+        lsn = anotar_operacion(OP_RENOMBRAR, origen, destino, strlen(destino), -1);
+    }
+    soltar_tablas_par(origen, destino);
+    esperar_wal(lsn);
+    
+    if (resultado >= 0) {
+        // Registrar operación en el log
+        registrar_log(OP_RENOMBRAR, origen);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] %s renombrado a %s (%d archivos)\n",
+                   id_nodo, origen, destino, resultado);
+        }
+    }
+    
+    terminar_medida(OP_RENOMBRAR, medida);
+    return resultado;
+}
+
+// Copiar un archivo (requiere lock_tabla en escritura de los shards de
+// origen y destino). En el mismo shard la copia comparte el contenido del
+// origen, así que cuesta lo mismo sea cual sea su tamaño: los bloques sólo
+// se duplican cuando uno de los dos se modifica en el sitio. Devuelve el
+// tamaño copiado, los errores de aplicar_crear para el destino o -5 si el
+// origen no existe
+int aplicar_copia(const char *origen, const char *destino, int nodo) {
+    usar_shard(origen);
+    int i = buscar_archivo(origen);
+    if (i < 0) {
+        return -5;
+    }
+    
+    if (indice_shard(destino) != indice_shard(origen)) {
+        // Cada shard deduplica por separado: entre shards se copian los bytes
+        int longitud = sistema->archivos[i].tamanio;
+        char *contenido = malloc(longitud + 1);
+        if (contenido == NULL || leer_contenido(&sistema->archivos[i], contenido) < 0) {
+            free(contenido);
+            return -3;
+        }
+        
+        usar_shard(destino);
+        int idx = aplicar_crear(destino, contenido, longitud, nodo);
+        free(contenido);
+        return (idx < 0) ? idx : longitud;
+    }
+    
+    int idx = aplicar_crear(destino, "", 0, nodo);
+    if (idx < 0) {
+        return idx;
+    }
+    
+    Archivo *original = &sistema->archivos[i];
+    Archivo *copia = &sistema->archivos[idx];
+    
+    iniciar_cambio(idx);
+    tomar_mutex(&sistema->lock_datos);
+    int c = celda_contenido(original);
+    if (c >= 0) {
+        sistema->contenidos[c].referencias++;
+        copia->datos = original->datos;
+        copia->tamanio = original->tamanio;
+        copia->tamanio_comprimido = original->tamanio_comprimido;
+        copia->crc = original->crc;
+    }
+    soltar_mutex(&sistema->lock_datos);
+    publicar_cambio(idx);
+    
+    return copia->tamanio;
+}
+
+// Función para copiar un archivo sin duplicar su contenido
+int copiar_archivo(const char *origen, const char *destino) {
+    int64_t medida = iniciar_medida();
+    
+    // Crea un archivo: acceso exclusivo a la tabla (de los dos shards si el
+    // destino está en otro)
+    tomar_tablas_par(origen, destino);
+    int resultado = aplicar_copia(origen, destino, id_nodo);
+    uint64_t lsn = 0;
+    if (resultado >= 0) {
+        lsn = anotar_operacion(OP_COPIAR, origen, destino, strlen(destino), -1);
+    }
+    soltar_tablas_par(origen, destino);
+    esperar_wal(lsn);
+    
+    if (resultado >= 0) {
+        // Registrar operación en el log
+        registrar_log(OP_COPIAR, destino);
+        if (!modo_silencioso) {
+            printf("[Nodo %d] %s copiado a %s (%d bytes compartidos)\n",
+                   id_nodo, origen, destino, resultado);
+        }
+    }
+    
+    terminar_medida(OP_COPIAR, medida);
+    return resultado;
+}
+
+// Empezar una transacción vacía
+void tx_inicio(Transaccion *tx) {
+    tx->num_escrituras = 0;
+}
+
+// Preparar la escritura del contenido completo de un archivo dentro de una
+// transacción. No toca la memoria compartida: todo se aplica en
+// tx_confirmar. Una segunda escritura del mismo archivo sustituye a la
+// primera. Devuelve 0 o -1 si el nombre no cabe, la transacción está llena
+// o falta memoria
+int tx_escribir(Transaccion *tx, const char *nombre, const char *contenido, int longitud) {
+    if (strlen(nombre) >= MAX_NOMBRE) {
+        return -1;
+    }
+    
+    char *copia = malloc(longitud + 1);
+    if (copia == NULL) {
+        return -1;
+    }
+    memcpy(copia, contenido, longitud);
+    copia[longitud] = '\0';
+    
+    int k = 0;
+    while (k < tx->num_escrituras && strcmp(tx->escrituras[k].nombre, nombre) != 0) {
+        k++;
+    }
+    if (k == tx->num_escrituras) {
+        if (k == MAX_ESCRITURAS_TX) {
+            free(copia);
+            return -1;
+        }
+        strcpy(tx->escrituras[k].nombre, nombre);
+        tx->num_escrituras++;
+    } else {
+        free(tx->escrituras[k].datos);
+    }
+    
+    tx->escrituras[k].datos = copia;
+    tx->escrituras[k].longitud = longitud;
+    return 0;
+}
+
+// Descartar una transacción sin aplicar nada
+void tx_abortar(Transaccion *tx) {
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        free(tx->escrituras[k].datos);
+    }
+    tx->num_escrituras = 0;
+}
+
+// Serializar las escrituras de una transacción para el WAL y la
+// replicación: un registro por archivo con el formato de los lotes
+// binarios (CabeceraLote, nombre y contenido). Devuelve un buffer propio o NULL
+char *codificar_transaccion(const Transaccion *tx, int *longitud) {
+    size_t total = 0;
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        total += sizeof(CabeceraLote) + strlen(tx->escrituras[k].nombre) +
+                 tx->escrituras[k].longitud;
+    }
+    if (total > INT_MAX) {
+        return NULL;
+    }
+    
+    char *datos = malloc(total + 1);
+    if (datos == NULL) {
+        return NULL;
+    }
+    
+    char *p = datos;
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        const EscrituraTx *escritura = &tx->escrituras[k];
+        CabeceraLote cabecera = {
+            .tipo = OP_ESCRIBIR,
+            .longitud_nombre = strlen(escritura->nombre),
+            .longitud_datos = escritura->longitud
+        };
+        memcpy(p, &cabecera, sizeof(cabecera));
+        p += sizeof(cabecera);
+        memcpy(p, escritura->nombre, cabecera.longitud_nombre);
+        p += cabecera.longitud_nombre;
+        memcpy(p, escritura->datos, escritura->longitud);
+        p += escritura->longitud;
+    }
+    
+    *longitud = total;
+    return datos;
+}
+
+// Reconstruir una transacción serializada (al recuperar el WAL o recibirla
+// de otro nodo). Devuelve 0 o -1 si los datos no son válidos
+int decodificar_transaccion(const char *datos, int longitud, Transaccion *tx) {
+    const char *p = datos, *fin = datos + longitud;
+    
+    tx_inicio(tx);
+    while (p < fin) {
+        CabeceraLote cabecera;
+        if ((size_t)(fin - p) < sizeof(cabecera)) {
+            tx_abortar(tx);
+            return -1;
+        }
+        memcpy(&cabecera, p, sizeof(cabecera));
+        p += sizeof(cabecera);
+        
+        if (cabecera.tipo != OP_ESCRIBIR || cabecera.longitud_nombre >= MAX_NOMBRE ||
+            cabecera.longitud_nombre > (size_t)(fin - p) ||
+            cabecera.longitud_datos > (size_t)(fin - p) - cabecera.longitud_nombre) {
+            tx_abortar(tx);
+            return -1;
+        }
+        
+        char nombre[MAX_NOMBRE];
+        memcpy(nombre, p, cabecera.longitud_nombre);
+        nombre[cabecera.longitud_nombre] = '\0';
+        p += cabecera.longitud_nombre;
+        if (tx_escribir(tx, nombre, p, cabecera.longitud_datos) < 0) {
+            tx_abortar(tx);
+            return -1;
+        }
+        p += cabecera.longitud_datos;
+    }
+    
+    return 0;
+}
+
+// Aplicar todas las escrituras de una transacción o ninguna (requiere
+// lock_tabla de sus shards y todos sus archivos en exclusiva). Antes de escribir se
+// comprueba que todos existen y no los tiene bloqueados otro nodo. Cada
+// archivo retiene una referencia a su contenido anterior, que nunca se
+// modifica en el sitio por estar compartido: si falta espacio a mitad, se
+// restauran los ya escritos sin copiar nada. Devuelve el número de
+// archivos escritos, -1 si alguno no existe, -2 si otro nodo tiene alguno
+// bloqueado o -3 si no hay espacio
+int aplicar_transaccion(Transaccion *tx, int nodo) {
+    int posiciones[MAX_ESCRITURAS_TX];
+    Archivo anteriores[MAX_ESCRITURAS_TX];
+    
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        usar_shard(tx->escrituras[k].nombre);
+        posiciones[k] = buscar_archivo(tx->escrituras[k].nombre);
+        if (posiciones[k] < 0) {
+            return -1;
+        }
+        Archivo *archivo = &sistema->archivos[posiciones[k]];
+        if (archivo->bloqueado && archivo->nodo_bloqueo != nodo) {
+            return -2;
+        }
+    }
+    
+    // Retener los contenidos actuales para poder deshacer (cada uno en la
+    // tabla de contenidos de su shard)
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        usar_shard(tx->escrituras[k].nombre);
+        tomar_mutex(&sistema->lock_datos);
+        anteriores[k] = sistema->archivos[posiciones[k]];
+        int c = celda_contenido(&anteriores[k]);
+        if (c >= 0) {
+            sistema->contenidos[c].referencias++;
+        }
+        soltar_mutex(&sistema->lock_datos);
+    }
+    
+    int escritos = 0;
+    while (escritos < tx->num_escrituras) {
+        EscrituraTx *escritura = &tx->escrituras[escritos];
+        usar_shard(escritura->nombre);
+        if (aplicar_escritura(posiciones[escritos], escritura->datos, escritura->longitud,
+                              nodo) < 0) {
+            break;
+        }
+        escritos++;
+    }
+    
+    // Soltar las referencias retenidas, devolviéndoselas a los archivos ya
+    // escritos si hay que deshacer
+    int deshacer = (escritos < tx->num_escrituras);
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        usar_shard(tx->escrituras[k].nombre);
+        Archivo *archivo = &sistema->archivos[posiciones[k]];
+        
+        if (deshacer && k < escritos) {
+            iniciar_cambio(posiciones[k]);
+            tomar_mutex(&sistema->lock_datos);
+            soltar_contenido(archivo);
+            soltar_mutex(&sistema->lock_datos);
+            archivo->datos = anteriores[k].datos;
+            archivo->tamanio = anteriores[k].tamanio;
+            archivo->tamanio_comprimido = anteriores[k].tamanio_comprimido;
+            archivo->crc = anteriores[k].crc;
+            archivo->ultima_modificacion = anteriores[k].ultima_modificacion;
+            publicar_cambio(posiciones[k]);
+        } else if (anteriores[k].tamanio > 0) {
+            tomar_mutex(&sistema->lock_datos);
+            soltar_contenido(&anteriores[k]);
+            soltar_mutex(&sistema->lock_datos);
+        }
+    }
+    
+    return deshacer ? -3 : escritos;
+}
+
+// Comparar posiciones globales, shard * MAX_ARCHIVOS + posición (qsort)
+int comparar_posiciones(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Confirmar una transacción: todas sus escrituras se aplican a la vez o
+// ninguna. Se toman las tablas de los shards implicados en orden de shard y
+// los archivos en orden creciente de shard y posición, así que dos
+// transacciones con archivos en común nunca se esperan en ciclo, y las de
+// archivos distintos no se esperan. Todo va al WAL y a los demás nodos en
+// un único registro, a nombre del primer archivo. La transacción queda
+// vacía. Devuelve el número de archivos escritos, los errores de
+// aplicar_transaccion o -4 si está vacía
+int tx_confirmar(Transaccion *tx) {
+    if (tx->num_escrituras == 0) {
+        return -4;
+    }
+    
+    int64_t medida = iniciar_medida();
+    
+    int longitud = 0;
+    char *datos = codificar_transaccion(tx, &longitud);
+    if (datos == NULL) {
+        tx_abortar(tx);
+        terminar_medida(OP_TRANSACCION, medida);
+        return -3;
+    }
+    
+    // La tabla en lectura impide que los archivos desaparezcan
+    int implicados[MAX_SHARDS] = {0};
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        implicados[indice_shard(tx->escrituras[k].nombre)] = 1;
+    }
+    for (int k = 0; k < num_shards; k++) {
+        if (implicados[k]) {
+            tomar_lectura(&shards[k]->lock_tabla);
+        }
+    }
+    
+    int posiciones[MAX_ESCRITURAS_TX];
+    int num_posiciones = 0;
+    int resultado = 0;
+    uint64_t lsn = 0;
+    for (int k = 0; k < tx->num_escrituras; k++) {
+        usar_shard(tx->escrituras[k].nombre);
+        int i = buscar_archivo(tx->escrituras[k].nombre);
+        if (i < 0) {
+            resultado = -1; // No existe
+            break;
+        }
+        posiciones[num_posiciones++] = shard_de(sistema) * MAX_ARCHIVOS + i;
+    }
+    
+    if (resultado == 0) {
+        qsort(posiciones, num_posiciones, sizeof(int), comparar_posiciones);
+        for (int k = 0; k < num_posiciones; k++) {
+            tomar_escritura(&shards[posiciones[k] / MAX_ARCHIVOS]->
+                            locks_archivos[posiciones[k] % MAX_ARCHIVOS]);
+        }
+        
+        resultado = aplicar_transaccion(tx, id_nodo);
+        if (resultado >= 0) {
+            lsn = anotar_operacion(OP_TRANSACCION, tx->escrituras[0].nombre, datos, longitud, -1);
+        }
+        
+        for (int k = num_posiciones - 1; k >= 0; k--) {
+            soltar_rwlock(&shards[posiciones[k] / MAX_ARCHIVOS]->
+                          locks_archivos[posiciones[k] % MAX_ARCHIVOS]);
+        }
+    }
+    
+    // Desbloquear las tablas
+    for (int k = num_shards - 1; k >= 0; k--) {
+        if (implicados[k]) {
+            soltar_rwlock(&shards[k]->lock_tabla);
+        }
+    }
+    esperar_wal(lsn);
+    
+    if (resultado >= 0) {
+        // Registrar en el log cada archivo escrito
+        for (int k = 0; k < tx->num_escrituras; k++) {
+            registrar_log(OP_TRANSACCION, tx->escrituras[k].nombre);
+        }
+        if (!modo_silencioso) {
+            printf("[Nodo %d] Transacción confirmada (%d archivos)\n", id_nodo, resultado);
+        }
+    }
+    
+    free(datos);
+    tx_abortar(tx);
+    terminar_medida(OP_TRANSACCION, medida);
+    return resultado;
+}
+
+// Añadir a 'entradas' el subárbol de n en preorden; 'ruta' contiene los
+// 'largo' caracteres de la ruta de n (requiere lock_tabla)
+void recolectar_entradas(int n, char *ruta, int largo, EntradaDirectorio *entradas, int *num) {
+    for (int hijo = sistema->directorio[n].primer_hijo; hijo >= 0;
+         hijo = sistema->directorio[hijo].siguiente_hermano) {
+        NodoDirectorio *nodo = &sistema->directorio[hijo];
+        int nuevo_largo = largo + snprintf(ruta + largo, MAX_NOMBRE - largo, "%s%s",
+                                           largo > 0 ? "/" : "", nodo->componente);
+        
+        EntradaDirectorio *entrada = &entradas[(*num)++];
+        strcpy(entrada->ruta, ruta);
+        entrada->archivo = nodo->archivo;
+        entrada->tamanio = 0;
+        if (nodo->archivo != 0) {
+            tomar_lectura(&sistema->locks_archivos[nodo->archivo - 1]);
+            entrada->tamanio = sistema->archivos[nodo->archivo - 1].tamanio;
+            soltar_rwlock(&sistema->locks_archivos[nodo->archivo - 1]);
+        } else {
+            recolectar_entradas(hijo, ruta, nuevo_largo, entradas, num);
+        }
+        
+        ruta[largo] = '\0';
+    }
+}
+
+// Función para listar un directorio y todo lo que contiene ("" es la raíz).
+// Sólo se recorre el subárbol pedido y se imprime fuera de la sección
+// crítica. Cualquier ruta salvo la raíz está entera en el shard de su
+// primer componente; la raíz reúne las de todos los shards, uno tras otro.
+// Devuelve el número de entradas o -1 si la ruta no existe
+int listar_directorio(const char *ruta) {
+    EntradaDirectorio entradas[MAX_SHARDS * MAX_NODOS_DIRECTORIO];
+    int num = 0, encontrada = 0;
+    char prefijo[MAX_NOMBRE];
+    
+    int primero = 0, ultimo = num_shards - 1;
+    if (ruta[0] != '\0') {
+        primero = ultimo = indice_shard(ruta);
+    }
+    
+    for (int k = primero; k <= ultimo; k++) {
+        sistema = shards[k];
+        tomar_lectura(&sistema->lock_tabla);
+        
+        int n = buscar_ruta(ruta);
+        if (n >= 0 && sistema->directorio[n].archivo == 0) {
+            strncpy(prefijo, ruta, MAX_NOMBRE - 1);
+            prefijo[MAX_NOMBRE - 1] = '\0';
+            recolectar_entradas(n, prefijo, strlen(prefijo), entradas, &num);
+        } else if (n >= 0) {
+            // Un archivo se lista a sí mismo
+            int i = sistema->directorio[n].archivo - 1;
+            strcpy(entradas[0].ruta, sistema->archivos[i].nombre);
+            entradas[0].archivo = i + 1;
+            tomar_lectura(&sistema->locks_archivos[i]);
+            entradas[0].tamanio = sistema->archivos[i].tamanio;
+            soltar_rwlock(&sistema->locks_archivos[i]);
+            num = 1;
+        }
+        encontrada |= (n >= 0);
+        
+        soltar_rwlock(&sistema->lock_tabla);
+    }
+    
+    if (!encontrada) {
+        return -1;
+    }
+    
+    printf("--- DIRECTORIO /%s (%d entradas) ---\n", ruta, num);
+    for (int k = 0; k < num; k++) {
+        if (entradas[k].archivo != 0) {
+            printf("%-40s %d bytes\n", entradas[k].ruta, entradas[k].tamanio);
+        } else {
+            printf("%s/\n", entradas[k].ruta);
+        }
+    }
+    
+    return num;
+}
+
+// Función para bloquear un archivo (antes de modificarlo)
+int bloquear_archivo(const char *nombre) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int resultado = -1;
+    
+    // Bloquear la tabla en lectura y sólo este archivo en escritura
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        tomar_escritura(&sistema->locks_archivos[i]);
+        
+        // Verificar si el archivo ya está bloqueado o si hay nodos
+        // esperándolo, que tienen preferencia
+        tomar_mutex_compartido(&sistema->esperas[i].mutex);
+        reclamar_turnos(&sistema->esperas[i]);
+        int con_esperas = sistema->esperas[i].turno != sistema->esperas[i].siguiente;
+        pthread_mutex_unlock(&sistema->esperas[i].mutex);
+        if (sistema->archivos[i].bloqueado || con_esperas) {
+            soltar_rwlock(&sistema->locks_archivos[i]);
+            soltar_rwlock(&sistema->lock_tabla);
+            terminar_medida(OP_BLOQUEAR, medida);
+            return -2; // Archivo ya bloqueado
+        }
+        
+        // Bloquear el archivo con un lease
+        iniciar_cambio(i);
+        sistema->archivos[i].bloqueado = 1;
+        sistema->archivos[i].nodo_bloqueo = id_nodo;
+        publicar_cambio(i);
+        sistema->archivos[i].expiracion_lease = ahora_ms() + duracion_lease;
+        programar_lease(i, sistema->archivos[i].expiracion_lease);
+        resultado = 0;
+        
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    
+    if (resultado == 0 && !modo_silencioso) {
+        printf("[Nodo %d] Archivo %s bloqueado correctamente\n", id_nodo, nombre);
+    }
+    
+    terminar_medida(OP_BLOQUEAR, medida);
+    return resultado;
+}
+
+// Función para desbloquear un archivo
+int desbloquear_archivo(const char *nombre) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
     int resultado = -1;
     
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+    // Bloquear la tabla en lectura y sólo este archivo en escritura
+    tomar_lectura(&sistema->lock_tabla);
+    
+    // Buscar el archivo
+    int i = buscar_archivo(nombre);
+    if (i >= 0) {
+        tomar_escritura(&sistema->locks_archivos[i]);
+        
+        // Verificar si somos quien tiene el bloqueo
+        if (sistema->archivos[i].bloqueado && 
+            sistema->archivos[i].nodo_bloqueo != id_nodo) {
+            soltar_rwlock(&sistema->locks_archivos[i]);
+            soltar_rwlock(&sistema->lock_tabla);
+            terminar_medida(OP_DESBLOQUEAR, medida);
+            return -2; // No tiene el bloqueo
+        }
+        
+        // Desbloquear el archivo
+        iniciar_cambio(i);
+        sistema->archivos[i].bloqueado = 0;
+        sistema->archivos[i].nodo_bloqueo = -1;
+        publicar_cambio(i);
+        cancelar_lease(i);
+        avisar_esperas(i);
+        resultado = 0;
+        
+        soltar_rwlock(&sistema->locks_archivos[i]);
+    }
+    
+    // Desbloquear la tabla
+    soltar_rwlock(&sistema->lock_tabla);
+    
+    if (resultado == 0 && !modo_silencioso) {
+        printf("[Nodo %d] Archivo %s desbloqueado correctamente\n", id_nodo, nombre);
+    }
+    
+    terminar_medida(OP_DESBLOQUEAR, medida);
+    return resultado;
+}
+
+// Despertar a todos los que esperan en un futex compartido (requiere el
+// mutex que lo protege). Sustituye a pthread_cond_broadcast entre procesos:
+// un proceso que muere dentro de pthread_cond_wait puede dejar colgado para
+// siempre el siguiente broadcast, y un FUTEX_WAKE nunca espera a nadie
+void avisar_futex(_Atomic uint32_t *avisos) {
+    atomic_fetch_add(avisos, 1);
+    syscall(SYS_futex, (uint32_t *)avisos, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Soltar mutex, dormir hasta el siguiente aviso o como mucho espera_ms (sin
+// límite si es negativo) y volver a tomarlo. El contador se lee con el mutex:
+// si llega un aviso antes de dormir, FUTEX_WAIT vuelve en el acto
+void esperar_futex(_Atomic uint32_t *avisos, pthread_mutex_t *mutex, int64_t espera_ms) {
+    uint32_t visto = atomic_load(avisos);
+    struct timespec espera = {espera_ms / 1000, (espera_ms % 1000) * 1000000};
+    
+    pthread_mutex_unlock(mutex);
+    syscall(SYS_futex, (uint32_t *)avisos, FUTEX_WAIT, visto,
+            (espera_ms < 0) ? NULL : &espera, NULL, 0);
+    tomar_mutex_compartido(mutex);
+}
+
+// Pasar el turno de la cola al siguiente ticket no cancelado y despertar a
+// los que esperan para que el nuevo primero lo vea (requiere el mutex de la cola)
+void avanzar_turno(ColaEspera *cola) {
+    // Se avanza antes de borrar la cancelación saltada: si el proceso muere
+    // entre medias, sanear_cola borra la que queda fuera de la cola
+    cola->turno++;
+    while (cola->turno != cola->siguiente &&
+           (cola->cancelados >> (cola->turno % MAX_ESPERAS_ARCHIVO)) & 1) {
+        uint32_t saltado = cola->turno++;
+        cola->cancelados &= ~(1ULL << (saltado % MAX_ESPERAS_ARCHIVO));
+    }
+    avisar_futex(&cola->avisos);
+}
+
+// Abandonar la cola sin haber conseguido el bloqueo (requiere el mutex de la cola)
+void cancelar_turno(ColaEspera *cola, uint32_t ticket) {
+    if (ticket == cola->turno) {
+        avanzar_turno(cola);
+    } else {
+        cola->cancelados |= 1ULL << (ticket % MAX_ESPERAS_ARCHIVO);
+    }
+}
+
+// Un nodo está caído si ya no figura como activo o si ha dejado de latir
+// durante un lease entero, el mismo criterio con el que pierde sus bloqueos
+// (ver expirar_lease). Este nodo nunca lo está
+int nodo_caido(int nodo) {
+    if (nodo == id_nodo) {
+        return 0;
+    }
+    int64_t latido = atomic_load_explicit(&principal->latido_nodos[nodo], memory_order_relaxed);
+    return !principal->nodos_activos[nodo] || ahora_ms() - latido > duracion_lease;
+}
+
+// Saltar los primeros tickets de la cola mientras sean de nodos caídos: un
+// nodo que murió esperando no avanzará nunca su turno (requiere el mutex de
+// la cola)
+void reclamar_turnos(ColaEspera *cola) {
+    while (cola->turno != cola->siguiente &&
+           nodo_caido(cola->nodos[cola->turno % MAX_ESPERAS_ARCHIVO])) {
+        avanzar_turno(cola);
+    }
+}
+
+// Abandonar todos los tickets de un nodo que se desconecta en las colas del
+// shard actual
+void cancelar_esperas_nodo(int nodo) {
+    for (int i = 0; i < MAX_ARCHIVOS; i++) {
+        ColaEspera *cola = &sistema->esperas[i];
+        tomar_mutex_compartido(&cola->mutex);
+        for (uint32_t ticket = cola->turno; ticket != cola->siguiente; ticket++) {
+            if (cola->nodos[ticket % MAX_ESPERAS_ARCHIVO] == nodo &&
+                !((cola->cancelados >> (ticket % MAX_ESPERAS_ARCHIVO)) & 1)) {
+                cancelar_turno(cola, ticket);
+            }
+        }
+        pthread_mutex_unlock(&cola->mutex);
+    }
+}
+
+// Despertar a quienes esperan el bloqueo de la posición i porque se ha
+// liberado o el archivo ha desaparecido o cambiado de nombre (requiere el
+// lock del archivo en escritura o la tabla en escritura)
+void avisar_esperas(int i) {
+    tomar_mutex_compartido(&sistema->esperas[i].mutex);
+    avisar_futex(&sistema->esperas[i].avisos);
+    pthread_mutex_unlock(&sistema->esperas[i].mutex);
+}
+
+// Bloquear un archivo esperando, como mucho espera_ms (< 0: sin límite), a
+// que quede libre. Los nodos que esperan duermen en la condición del archivo
+// sin tener ningún otro lock y lo consiguen en orden de llegada; cada
+// PAUSA_ESPERA_MS despiertan para reclamar los turnos de nodos caídos y
+// para terminar si se pidió salir.
+// Devuelve 0, -1 si el archivo no existe (o desaparece durante la espera),
+// -2 si se agota la espera o ya lo tiene este nodo, -5 si la cola está
+// llena y -6 si se interrumpe la espera
+int bloquear_archivo_espera(const char *nombre, int espera_ms) {
+    usar_shard(nombre);
+    int64_t medida = iniciar_medida();
+    
+    int64_t limite = ahora_ms() + espera_ms;
+    int i = -1, en_cola = 0, resultado;
+    uint32_t ticket = 0;
+    for (;;) {
+        tomar_lectura(&sistema->lock_tabla);
+        
+        // Si el archivo desaparece o cambia de posición se abandona la cola
+        int actual = buscar_archivo(nombre);
+        if (actual < 0 || (en_cola && actual != i)) {
+            if (en_cola) {
+                tomar_mutex_compartido(&sistema->esperas[i].mutex);
+                cancelar_turno(&sistema->esperas[i], ticket);
+                pthread_mutex_unlock(&sistema->esperas[i].mutex);
+            }
+            soltar_rwlock(&sistema->lock_tabla);
+            resultado = -1;
+            break;
+        }
+        i = actual;
+        
+        tomar_escritura(&sistema->locks_archivos[i]);
+        Archivo *archivo = &sistema->archivos[i];
+        ColaEspera *cola = &sistema->esperas[i];
+        tomar_mutex_compartido(&cola->mutex);
+        
+        if (!en_cola) {
+            if (archivo->bloqueado && archivo->nodo_bloqueo == id_nodo) {
+                resultado = -2; // Esperarse a sí mismo no terminaría nunca
+            } else if (cola->siguiente - cola->turno >= MAX_ESPERAS_ARCHIVO) {
+                resultado = -5;
+            } else {
+                // El dueño se anota antes de repartir el ticket: si el
+                // proceso muere entre medias, el ticket no llega a existir
+                cola->nodos[cola->siguiente % MAX_ESPERAS_ARCHIVO] = id_nodo;
+                ticket = cola->siguiente++;
+                en_cola = 1;
+                resultado = 1;
+            }
+            if (resultado < 0) {
+                pthread_mutex_unlock(&cola->mutex);
+                soltar_rwlock(&sistema->locks_archivos[i]);
+                soltar_rwlock(&sistema->lock_tabla);
+                break;
+            }
+        }
+        
+        reclamar_turnos(cola);
+        if (ticket == cola->turno && !archivo->bloqueado) {
+            // Primero de la cola y libre: bloquear con un lease
+            avanzar_turno(cola);
+            pthread_mutex_unlock(&cola->mutex);
+            
+            iniciar_cambio(i);
+            archivo->bloqueado = 1;
+            archivo->nodo_bloqueo = id_nodo;
+            publicar_cambio(i);
+            archivo->expiracion_lease = ahora_ms() + duracion_lease;
+            programar_lease(i, archivo->expiracion_lease);
+            
+            soltar_rwlock(&sistema->locks_archivos[i]);
+            soltar_rwlock(&sistema->lock_tabla);
+            resultado = 0;
+            break;
+        }
+        
+        // Dormir sin la tabla ni el archivo. El mutex de la cola se toma
+        // antes de soltarlos, así que no se pierde el aviso de quien libere
+        // el archivo entre medias
+        soltar_rwlock(&sistema->locks_archivos[i]);
+        soltar_rwlock(&sistema->lock_tabla);
+        
+        int64_t restante = (espera_ms < 0) ? PAUSA_ESPERA_MS : limite - ahora_ms();
+        if (restante > 0) {
+            esperar_futex(&cola->avisos, &cola->mutex, (restante < PAUSA_ESPERA_MS) ? restante : PAUSA_ESPERA_MS);
+        }
+        if ((espera_ms >= 0 && ahora_ms() >= limite) || !continuar) {
+            cancelar_turno(cola, ticket);
+            pthread_mutex_unlock(&cola->mutex);
+            resultado = continuar ? -2 : -6;
+            break;
+        }
+        pthread_mutex_unlock(&cola->mutex);
+    }
+    
+    if (resultado == 0 && !modo_silencioso) {
+        printf("[Nodo %d] Archivo %s bloqueado correctamente\n", id_nodo, nombre);
+    }
+    
+    terminar_medida(OP_BLOQUEAR, medida);
+    return resultado;
+}
+
+// Función para registrar una operación en el log. No toma ningún lock: el
+// fetch-add reparte huecos distintos a escritores concurrentes
+void registrar_log(int tipo_operacion, const char *nombre_archivo) {
+    AnilloLog anillo = anillo_log(0);
+    anotar_log(&anillo, tipo_operacion, nombre_archivo);
+    
+    // Copia en el log durable, con su propio ticket
+    if (log_durable != NULL) {
+        anillo = anillo_log(1);
+        anotar_log(&anillo, tipo_operacion, nombre_archivo);
+    }
+}
+
+// Anillo del log en memoria compartida o del log durable
+AnilloLog anillo_log(int durable) {
+    AnilloLog anillo;
+    
+    if (durable) {
+        anillo.entradas = log_durable->entradas;
+        anillo.capacidad = log_durable->capacidad;
+        anillo.siguiente = &log_durable->siguiente;
+        anillo.indices = &log_durable->indices;
+    } else {
+        anillo.entradas = principal->log;
+        anillo.capacidad = MAX_OPERACIONES;
+        anillo.siguiente = &principal->indice_log;
+        anillo.indices = &principal->indices_log;
+    }
+    return anillo;
+}
+
+// Cubeta del índice por nombre del log. Se calcula sobre el nombre tal como
+// se guarda en la entrada (truncado a MAX_NOMBRE - 1)
+int cubeta_log(const char *nombre) {
+    char guardado[MAX_NOMBRE];
+    
+    strncpy(guardado, nombre, MAX_NOMBRE - 1);
+    guardado[MAX_NOMBRE - 1] = '\0';
+    return hash_nombre(guardado) & (TAM_INDICE_LOG - 1);
+}
+
+// Añadir una entrada a un anillo y enlazarla en las cadenas de su nodo y de
+// su nombre. La cabeza se cambia antes de publicar la entrada: un lector que
+// llega a ella mientras tanto espera a que se publique (ver copiar_entrada_log)
+void anotar_log(const AnilloLog *anillo, int tipo_operacion, const char *nombre_archivo) {
+    uint64_t ticket = atomic_fetch_add_explicit(anillo->siguiente, 1, memory_order_relaxed);
+    uint64_t anterior_nodo = atomic_exchange_explicit(&anillo->indices->ultimo_nodo[id_nodo],
+                                                      ticket + 1, memory_order_acq_rel);
+    uint64_t anterior_nombre = atomic_exchange_explicit(
+        &anillo->indices->ultimo_nombre[cubeta_log(nombre_archivo)], ticket + 1,
+        memory_order_acq_rel);
+    
+    escribir_entrada_log(&anillo->entradas[ticket % anillo->capacidad], ticket, tipo_operacion,
+                         nombre_archivo, anterior_nodo, anterior_nombre);
+}
+
+// Publicar la entrada de un ticket en su hueco del anillo
+void escribir_entrada_log(LogEntry *entrada, uint64_t ticket, int tipo_operacion,
+                          const char *nombre_archivo, uint64_t anterior_nodo,
+                          uint64_t anterior_nombre) {
+    uint64_t completa = 2 * (ticket + 1);
+    int esperas = 0;
+    
+    // Reclamar el hueco pasando la secuencia a impar. Si el escritor de la
+    // vuelta anterior sigue a medias se le espera un poco, pero nunca
+    // indefinidamente: si terminó sin publicar, el hueco se reclama igual
+    uint64_t actual = atomic_load_explicit(&entrada->secuencia, memory_order_relaxed);
+    int64_t inicio_espera = 0;
+    for (;;) {
+        if (actual >= completa) {
+            return; // Una vuelta posterior ya ocupó el hueco: la entrada se pierde
+        }
+        if ((actual & 1) && esperas++ < MAX_ESPERA_LOG) {
+            if (inicio_espera == 0) {
+                inicio_espera = ahora_ns();
+            }
+            sched_yield();
+            actual = atomic_load_explicit(&entrada->secuencia, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&entrada->secuencia, &actual, completa - 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+    }
+    contar_adquisicion(LOCK_LOG, inicio_espera != 0 ? ahora_ns() - inicio_espera : -1);
+    
+    // Rellenar la entrada
+    entrada->timestamp = time(NULL);
+    entrada->nodo = id_nodo;
+    entrada->tipo_operacion = tipo_operacion;
+    strncpy(entrada->nombre_archivo, nombre_archivo, MAX_NOMBRE - 1);
+    entrada->nombre_archivo[MAX_NOMBRE - 1] = '\0';
+    entrada->anterior_nodo = anterior_nodo;
+    entrada->anterior_nombre = anterior_nombre;
+    
+    // Publicar: los lectores sólo aceptan la entrada con esta secuencia. Si
+    // entretanto un escritor de una vuelta posterior se cansó de esperar y
+    // reclamó el hueco, la secuencia ya no es la nuestra: no se hace
+    // retroceder y la entrada se pierde
+    uint64_t propia = completa - 1;
+    atomic_compare_exchange_strong_explicit(&entrada->secuencia, &propia, completa,
+                                            memory_order_release, memory_order_relaxed);
+}
+
+// Copiar la entrada de un ticket sin bloquear a los escritores.
+// Devuelve 1 si la copia es coherente o 0 si el hueco se está reescribiendo
+// o ya pertenece a otro ticket
+int leer_entrada_log(LogEntry *entrada, uint64_t ticket, LogEntry *copia) {
+    uint64_t esperada = 2 * (ticket + 1);
+    
+    if (atomic_load_explicit(&entrada->secuencia, memory_order_acquire) != esperada) {
+        return 0;
+    }
+    
+    copia->timestamp = entrada->timestamp;
+    copia->nodo = entrada->nodo;
+    copia->tipo_operacion = entrada->tipo_operacion;
+    memcpy(copia->nombre_archivo, entrada->nombre_archivo, MAX_NOMBRE);
+    copia->nombre_archivo[MAX_NOMBRE - 1] = '\0';
+    copia->anterior_nodo = entrada->anterior_nodo;
+    copia->anterior_nombre = entrada->anterior_nombre;
+    
+    // Si la secuencia no cambió durante la copia, ningún escritor la tocó
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&entrada->secuencia, memory_order_relaxed) == esperada;
+}
+
+// Copiar la entrada de un ticket de un anillo para una consulta. Si su
+// escritor aún no la ha publicado se le espera un poco, como en
+// escribir_entrada_log. Devuelve 1 si se copió o 0 si ya no está en el
+// anillo (o su escritor terminó sin publicarla)
+int copiar_entrada_log(const AnilloLog *anillo, uint64_t ticket, LogEntry *copia) {
+    LogEntry *entrada = &anillo->entradas[ticket % anillo->capacidad];
+    uint64_t esperada = 2 * (ticket + 1);
+    
+    for (int esperas = 0; esperas < MAX_ESPERA_LOG; esperas++) {
+        if (leer_entrada_log(entrada, ticket, copia)) {
+            return 1;
+        }
+        if (atomic_load_explicit(&entrada->secuencia, memory_order_relaxed) > esperada) {
+            return 0; // Sobrescrita por una vuelta posterior
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+// Comprobar si una entrada cumple todas las condiciones de un filtro
+int cumple_filtro_log(const LogEntry *entrada, const FiltroLog *filtro) {
+    return (filtro->nodo < 0 || entrada->nodo == filtro->nodo) &&
+           (filtro->nombre == NULL || strncmp(entrada->nombre_archivo, filtro->nombre,
+                                              MAX_NOMBRE - 1) == 0) &&
+           (filtro->desde == 0 || entrada->timestamp >= filtro->desde) &&
+           (filtro->hasta == 0 || entrada->timestamp <= filtro->hasta);
+}
+
+// Primer ticket de [inicio, fin) cuya entrada no es anterior a desde menos
+// el margen de desorden, por bisección sobre las marcas de tiempo. Los
+// huecos que no se pueden leer se saltan hacia delante
+uint64_t buscar_instante_log(const AnilloLog *anillo, uint64_t inicio, uint64_t fin, time_t desde) {
+    uint64_t bajo = inicio, alto = fin;
+    
+    while (bajo < alto) {
+        uint64_t medio = bajo + (alto - bajo) / 2;
+        LogEntry entrada;
+        uint64_t ticket = medio;
+        while (ticket < alto && !copiar_entrada_log(anillo, ticket, &entrada)) {
+            ticket++;
+        }
+        
+        if (ticket == alto) {
+            alto = medio; // Nada legible en [medio, alto)
+        } else if (entrada.timestamp + MARGEN_TIEMPO_LOG < desde) {
+            bajo = ticket + 1;
+        } else {
+            alto = medio;
+        }
+    }
+    return bajo;
+}
+
+// Buscar en un anillo las entradas que cumplen un filtro, de la más reciente
+// a la más antigua, sin tomar ningún lock ni bloquear a los escritores.
+// Con nombre o nodo se recorre su cadena, de modo que el coste depende sólo
+// de sus entradas; si no, la ventana de tiempo se localiza por bisección.
+// 'resultados' necesita sitio para la capacidad del anillo.
+// Devuelve el número de entradas encontradas
+int consultar_log(const AnilloLog *anillo, const FiltroLog *filtro, LogEntry *resultados) {
+    uint64_t fin = atomic_load_explicit(anillo->siguiente, memory_order_acquire);
+    uint64_t inicio = (fin > anillo->capacidad) ? fin - anillo->capacidad : 0;
+    int n = 0;
+    
+    if (filtro->nombre != NULL || filtro->nodo >= 0) {
+        uint64_t enlace = (filtro->nombre != NULL)
+            ? atomic_load_explicit(&anillo->indices->ultimo_nombre[cubeta_log(filtro->nombre)],
+                                   memory_order_acquire)
+            : atomic_load_explicit(&anillo->indices->ultimo_nodo[filtro->nodo],
+                                   memory_order_acquire);
+        
+        // Las cadenas van hacia atrás en el tiempo: se cortan al salir del
+        // anillo, al pasar de la ventana o tras una vuelta completa
+        for (uint32_t pasos = 0; enlace > inicio && pasos < anillo->capacidad; pasos++) {
+            LogEntry entrada;
+            if (!copiar_entrada_log(anillo, enlace - 1, &entrada)) {
+                break;
+            }
+            if (filtro->desde != 0 && entrada.timestamp + MARGEN_TIEMPO_LOG < filtro->desde) {
+                break;
+            }
+            if (cumple_filtro_log(&entrada, filtro)) {
+                resultados[n++] = entrada;
+            }
+            enlace = (filtro->nombre != NULL) ? entrada.anterior_nombre : entrada.anterior_nodo;
+        }
+        return n;
+    }
+    
+    // Ventana de tiempo: recorrer hacia delante desde su inicio y dar la
+    // vuelta al resultado
+    uint64_t ticket = (filtro->desde != 0) ? buscar_instante_log(anillo, inicio, fin, filtro->desde)
+                                           : inicio;
+    for (; ticket < fin; ticket++) {
+        LogEntry entrada;
+        if (!copiar_entrada_log(anillo, ticket, &entrada)) {
+            continue;
+        }
+        if (filtro->hasta != 0 && entrada.timestamp > filtro->hasta + MARGEN_TIEMPO_LOG) {
+            break;
+        }
+        if (cumple_filtro_log(&entrada, filtro)) {
+            resultados[n++] = entrada;
+        }
+    }
+    for (int i = 0, j = n - 1; i < j; i++, j--) {
+        LogEntry aux = resultados[i];
+        resultados[i] = resultados[j];
+        resultados[j] = aux;
+    }
+    return n;
+}
+
+// Proyectar el archivo del log durable (se crea si no existe, ver crear_log_durable)
+void abrir_log_durable() {
+    tam_log_durable = sizeof(LogDurable) + (size_t)CAPACIDAD_LOG_DURABLE * sizeof(LogEntry);
+    
+    int fd = open(ruta_log_durable, O_RDWR);
+    if (fd < 0 && errno == ENOENT) {
+        fd = crear_log_durable();
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("Error al abrir el log durable");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if ((size_t)st.st_size != tam_log_durable) {
+        printf("Error: El log durable %s no tiene un formato compatible\n", ruta_log_durable);
+        close(fd);
+        return;
+    }
+    
+    LogDurable *log = mmap(NULL, tam_log_durable, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (log == MAP_FAILED) {
+        perror("Error al proyectar el log durable");
+        return;
+    }
+    
+    if (log->magia != MAGIA_LOG || log->capacidad != CAPACIDAD_LOG_DURABLE) {
+        printf("Error: El log durable %s no tiene un formato compatible\n", ruta_log_durable);
+        munmap(log, tam_log_durable);
+        return;
+    }
+    
+    log_durable = log;
+}
+
+// Crear el log durable ya inicializado: se prepara en un temporal propio y
+// se enlaza con link, que no sustituye a nadie. Si otro nodo lo creó a la
+// vez, gana el primero y los demás abren el suyo; ninguno llega a ver el
+// archivo con su tamaño pero aún sin la magia. Devuelve un descriptor del
+// log o -1 si falla
+int crear_log_durable() {
+    char temporal[PATH_MAX];
+    snprintf(temporal, sizeof(temporal), "%s.%d.tmp", ruta_log_durable, (int)getpid());
+    
+    int fd = open(temporal, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    LogDurable cabecera;
+    memset(&cabecera, 0, sizeof(cabecera));
+    cabecera.magia = MAGIA_LOG;
+    cabecera.capacidad = CAPACIDAD_LOG_DURABLE;
+    if (ftruncate(fd, tam_log_durable) < 0 ||
+        pwrite(fd, &cabecera, sizeof(cabecera), 0) != (ssize_t)sizeof(cabecera)) {
+        close(fd);
+        unlink(temporal);
+        return -1;
+    }
+    
+    if (link(temporal, ruta_log_durable) < 0) {
+        int existe = (errno == EEXIST);
+        close(fd);
+        fd = existe ? open(ruta_log_durable, O_RDWR) : -1;
+    }
+    unlink(temporal);
+    return fd;
+}
+
+// Abrir un cambio de los metadatos de una posición (requiere el archivo en
+// exclusiva o lock_tabla en escritura): la secuencia pasa a impar
+void iniciar_cambio(int posicion) {
+    atomic_fetch_add_explicit(&sistema->secuencia_archivos[posicion], 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+// Cerrar el cambio: la secuencia vuelve a par y publica los metadatos
+void publicar_cambio(int posicion) {
+    atomic_fetch_add_explicit(&sistema->secuencia_archivos[posicion], 1, memory_order_release);
+}
+
+// Copiar los metadatos de los archivos existentes de todos los shards sin
+// tomar ningún lock ('destino' con sitio para MAX_SHARDS * MAX_ARCHIVOS).
+// Cada posición se copia de nuevo si un escritor la cambió a la vez; una
+// posición que no se logra copiar tras MAX_REINTENTOS_INSTANTANEA intentos se
+// omite. Devuelve el número de archivos copiados
+int instantanea_archivos(InfoArchivo *destino) {
+    int n = 0;
+    
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        n += instantanea_shard(destino + n);
+    }
+    
+    return n;
+}
+
+// Copiar los metadatos de los archivos existentes del shard de este hilo
+// (ver instantanea_archivos). Devuelve el número de archivos copiados
+int instantanea_shard(InfoArchivo *destino) {
+    int n = 0;
+    int max_posicion = sistema->max_posicion;
+    
+    for (int i = 0; i < max_posicion && i < MAX_ARCHIVOS; i++) {
+        Archivo *archivo = &sistema->archivos[i];
+        
+        for (int intento = 0; intento < MAX_REINTENTOS_INSTANTANEA; intento++) {
+            unsigned int antes = atomic_load_explicit(&sistema->secuencia_archivos[i],
+                                                      memory_order_acquire);
+            if (antes & 1) {
+                sched_yield(); // Cambio en curso
+                continue;
+            }
+            
+            int en_uso = archivo->en_uso;
+            InfoArchivo copia;
+            memcpy(copia.nombre, archivo->nombre, MAX_NOMBRE);
+            copia.nombre[MAX_NOMBRE - 1] = '\0';
+            copia.tamanio = archivo->tamanio;
+            copia.propietario = archivo->propietario;
+            copia.ultima_modificacion = archivo->ultima_modificacion;
+            copia.bloqueado = archivo->bloqueado;
+            copia.nodo_bloqueo = archivo->nodo_bloqueo;
+            
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&sistema->secuencia_archivos[i], memory_order_relaxed) == antes) {
+                if (en_uso) {
+                    destino[n++] = copia;
+                }
+                break;
+            }
+        }
+    }
+    
+    return n;
+}
+
+// Función para mostrar los archivos existentes
+void mostrar_archivos() {
+    InfoArchivo archivos[MAX_SHARDS * MAX_ARCHIVOS];
+    int n = instantanea_archivos(archivos);
+    
+    printf("--- ARCHIVOS (%d) ---\n", n);
+    printf("%-20s %-10s %-10s %-20s %-10s\n", 
+           "Nombre", "Tamaño", "Propietario", "Última Modificación", "Estado");
+    
+    for (int i = 0; i < n; i++) {
+        // Formatear timestamp
+        struct tm tm_info;
+        char buffer[20];
+        localtime_r(&archivos[i].ultima_modificacion, &tm_info);
+        strftime(buffer, 20, "%Y-%m-%d %H:%M:%S", &tm_info);
+        
+        // Estado de bloqueo
+        char estado[20];
+        if (archivos[i].bloqueado) {
+            sprintf(estado, "Bloq. por %d", archivos[i].nodo_bloqueo);
+        } else {
+            strcpy(estado, "Disponible");
+        }
+        
+        printf("%-20s %-10d %-10d %-20s %-10s\n", 
+               archivos[i].nombre,
+               archivos[i].tamanio,
+               archivos[i].propietario,
+               buffer,
+               estado);
+    }
+}
+
+// Función para mostrar el log de operaciones (sin bloquear a los escritores).
+// Sin filtro se muestra el anillo de la memoria compartida; con filtro se
+// consulta el log durable si está abierto, porque guarda mucha más historia
+void mostrar_log(const FiltroLog *filtro) {
+    FiltroLog todo = {-1, NULL, 0, 0};
+    AnilloLog anillo = anillo_log(filtro != NULL && log_durable != NULL);
+    
+    LogEntry *resultados = malloc((size_t)anillo.capacidad * sizeof(LogEntry));
+    if (resultados == NULL) {
+        perror("Error al reservar memoria para el log");
+        return;
+    }
+    int n = consultar_log(&anillo, filtro != NULL ? filtro : &todo, resultados);
+    
+    printf("--- LOG DE OPERACIONES ---\n");
+    printf("%-20s %-10s %-15s %-20s\n", 
+           "Timestamp", "Nodo", "Operación", "Archivo");
+    for (int i = 0; i < n; i++) {
+        mostrar_entrada_log(&resultados[i]);
+    }
+    if (filtro != NULL) {
+        printf("(%d entradas)\n", n);
+    }
+    
+    free(resultados);
+}
+
+// Mostrar una entrada del log
+void mostrar_entrada_log(const LogEntry *entrada) {
+    // Formatear timestamp
+    struct tm *tm_info = localtime(&entrada->timestamp);
+    char buffer[20];
+    strftime(buffer, 20, "%Y-%m-%d %H:%M:%S", tm_info);
+    
+    // Tipo de operación
+    char operacion[15];
+    switch(entrada->tipo_operacion) {
+        case OP_CREAR:
+            strcpy(operacion, "Crear");
+            break;
+        case OP_LEER:
+            strcpy(operacion, "Leer");
+            break;
+        case OP_ESCRIBIR:
+            strcpy(operacion, "Escribir");
+            break;
+        case OP_ELIMINAR:
+            strcpy(operacion, "Eliminar");
+            break;
+        case OP_ANEXAR:
+            strcpy(operacion, "Anexar");
+            break;
+        case OP_RENOMBRAR:
+            strcpy(operacion, "Renombrar");
+            break;
+        case OP_COPIAR:
+            strcpy(operacion, "Copiar");
+            break;
+        case OP_TRANSACCION:
+            strcpy(operacion, "Transacción");
+            break;
+        default:
+            strcpy(operacion, "Desconocida");
+            break;
+    }
+    
+    printf("%-20s %-10d %-15s %-20s\n", 
+           buffer,
+           entrada->nodo,
+           operacion,
+           entrada->nombre_archivo);
+}
+
+// Interpretar un instante de una consulta del log: segundos desde la época
+// o, con signo negativo, segundos antes de ahora. Devuelve 0 si no es válido
+time_t leer_instante(const char *texto) {
+    char *fin;
+    long long valor = strtoll(texto, &fin, 10);
+    
+    if (*texto == '\0' || *fin != '\0') {
+        return 0;
+    }
+    return (valor < 0) ? time(NULL) + valor : (time_t)valor;
+}
+
+// Función para mostrar el estado de los nodos
+void mostrar_estado_nodos() {
+    // Cada marca es un entero independiente: basta una copia, sin semáforo
+    int activos[MAX_NODOS];
+    memcpy(activos, principal->nodos_activos, sizeof(activos));
+    
+    printf("--- NODOS ACTIVOS ---\n");
+    for (int i = 0; i < MAX_NODOS; i++) {
+        printf("Nodo %d: %s\n", i, activos[i] ? "ACTIVO" : "INACTIVO");
+    }
+}
+
+// Leer el siguiente comando de un lote de texto o binario.
+// Devuelve 1 si se leyó un comando, 0 al final de la entrada o -1 si el
+// comando no es válido (se informa en su resultado)
+int leer_comando_lote(FILE *entrada, int binario, ComandoLote *comando) {
+    memset(comando, 0, sizeof(ComandoLote));
+    comando->desplazamiento = -1;
+    
+    if (binario) {
+        CabeceraLote cabecera;
+        if (fread(&cabecera, sizeof(cabecera), 1, entrada) != 1) {
+            return 0;
+        }
+        if (cabecera.longitud_nombre >= MAX_NOMBRE || cabecera.longitud_datos > INT32_MAX) {
+            return 0; // Flujo corrupto: no se puede seguir leyendo
+        }
+        
+        comando->tipo = cabecera.tipo;
+        comando->longitud = cabecera.longitud_datos;
+        comando->datos = malloc(comando->longitud + 1);
+        if (comando->datos == NULL ||
+            fread(comando->nombre, 1, cabecera.longitud_nombre, entrada) != cabecera.longitud_nombre ||
+            fread(comando->datos, 1, comando->longitud, entrada) != (size_t)comando->longitud) {
+            free(comando->datos);
+            comando->datos = NULL;
+            return 0;
+        }
+        comando->datos[comando->longitud] = '\0';
+        if (cabecera.tipo >= NUM_TIPOS_OPERACION) {
+            comando->resultado = -9; // Los registros internos no pueden venir de un lote
+        }
+    } else {
+        // Formato de texto: los mismos comandos que en modo interactivo,
+        // uno por línea; se ignoran las líneas vacías y las que empiezan por '#'
+        char *linea = NULL;
+        size_t capacidad = 0;
+        ssize_t leidos;
+        
+        do {
+            leidos = getline(&linea, &capacidad, entrada);
+            if (leidos < 0) {
+                free(linea);
+                return 0;
+            }
+            linea[strcspn(linea, "\n")] = '\0';
+        } while (linea[0] == '\0' || linea[0] == '#');
+        
+        char *resto;
+        char *orden = strtok_r(linea, " ", &resto);
+        char *nombre = strtok_r(NULL, " ", &resto);
+        char *texto = strtok_r(NULL, "", &resto);
+        
+        if (orden != NULL && strcmp(orden, "crear") == 0) {
+            comando->tipo = OP_CREAR;
+        } else if (orden != NULL && strcmp(orden, "escribir") == 0) {
+            comando->tipo = OP_ESCRIBIR;
+        } else if (orden != NULL && strcmp(orden, "anexar") == 0) {
+            comando->tipo = OP_ANEXAR;
+        } else if (orden != NULL && strcmp(orden, "sobrescribir") == 0 && texto != NULL) {
+            comando->tipo = OP_ESCRIBIR;
+            comando->desplazamiento = strtol(texto, &texto, 10);
+            texto = (*texto == ' ') ? texto + 1 : NULL;
+        } else if (orden != NULL && strcmp(orden, "eliminar") == 0) {
+            comando->tipo = OP_ELIMINAR;
+            texto = "";
+        } else if (orden != NULL && strcmp(orden, "renombrar") == 0) {
+            comando->tipo = OP_RENOMBRAR; // El texto es el destino
+        } else if (orden != NULL && strcmp(orden, "copiar") == 0) {
+            comando->tipo = OP_COPIAR; // El texto es el destino
+        } else {
+            comando->tipo = -1;
+        }
+        
+        if (nombre != NULL) {
+            strncpy(comando->nombre, nombre, MAX_NOMBRE - 1);
+        }
+        if (comando->tipo < 0 || nombre == NULL || texto == NULL) {
+            comando->resultado = -9;
+            free(linea);
+            return -1;
+        }
+        
+        comando->longitud = strlen(texto);
+        comando->datos = strdup(texto);
+        free(linea);
+    }
+    
+    return 1;
+}
+
+// Anotar lo aplicado de un origen de la replicación (requiere las tablas en
+// exclusiva). Devuelve 0 o -9 si el registro no es válido
+int aplicar_progreso(const char *datos, int longitud, int nodo) {
+    if (longitud != sizeof(ProgresoReplicacion) || nodo < 0 || nodo >= MAX_NODOS) {
+        return -9;
+    }
+    
+    memcpy(&principal->replicado[nodo], datos, sizeof(ProgresoReplicacion));
+    return 0;
+}
+
+// Sustituir los archivos de un origen de la replicación por su imagen
+// (requiere las tablas en exclusiva): se eliminan los suyos que ya no
+// tiene y se crean o sobrescriben los demás. Devuelve el número de
+// archivos de la imagen aplicados o -9 si no es válida
+int aplicar_resincronizacion(const char *datos, int longitud, int nodo) {
+    Transaccion *imagen = malloc(sizeof(Transaccion));
+    if (imagen == NULL || decodificar_transaccion(datos, longitud, imagen) < 0) {
+        free(imagen);
+        return -9;
+    }
+    
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        for (int i = 0; i < sistema->max_posicion; i++) {
+            Archivo *archivo = &sistema->archivos[i];
+            if (!archivo->en_uso || archivo->propietario != nodo) {
+                continue;
+            }
+            
+            int j = 0;
+            while (j < imagen->num_escrituras &&
+                   strcmp(imagen->escrituras[j].nombre, archivo->nombre) != 0) {
+                j++;
+            }
+            int pos = (j == imagen->num_escrituras) ? buscar_en_indice(archivo->nombre) : -1;
+            if (pos >= 0) {
+                aplicar_eliminacion(pos, nodo);
+            }
+        }
+    }
+    
+    int aplicados = 0;
+    for (int j = 0; j < imagen->num_escrituras; j++) {
+        EscrituraTx *escritura = &imagen->escrituras[j];
+        usar_shard(escritura->nombre);
+        
+        int pos = buscar_en_indice(escritura->nombre);
+        int resultado;
+        if (pos < 0) {
+            resultado = aplicar_crear(escritura->nombre, escritura->datos, escritura->longitud, nodo);
+        } else {
+            // Los que no cambiaron se dejan como están
+            Archivo *archivo = &sistema->archivos[sistema->indice[pos] - 1];
+            resultado = (archivo->tamanio == escritura->longitud &&
+                         archivo->crc == crc32c(0, escritura->datos, escritura->longitud))
+                        ? 0 : aplicar_escritura(sistema->indice[pos] - 1, escritura->datos,
+                                                escritura->longitud, nodo);
+        }
+        if (resultado >= 0) {
+            aplicados++;
+        }
+    }
+    
+    tx_abortar(imagen);
+    free(imagen);
+    return aplicados;
+}
+
+// Aplicar un grupo de comandos con una sola adquisición de lock_tabla por
+// shard (los comandos de un grupo pueden caer en cualquiera, y renombrar,
+// copiar y las transacciones pueden abarcar varios). Con las tablas en
+// exclusiva ningún otro acceso puede tener un archivo, así que no hace
+// falta tomar los locks por archivo
+void aplicar_lote(ComandoLote *lote, int n, int nodo) {
+    tomar_tablas(1);
+    
+    for (int k = 0; k < n; k++) {
+        ComandoLote *comando = &lote[k];
+        
+        if (comando->resultado == -9) {
+            continue; // Comando no válido
+        }
+        if (comando->tipo == OP_PROGRESO_REPLICACION) {
+            comando->resultado = aplicar_progreso(comando->datos, comando->longitud, nodo);
+            continue;
+        }
+        if (comando->tipo == OP_RESINCRONIZAR) {
+            comando->resultado = aplicar_resincronizacion(comando->datos, comando->longitud, nodo);
+            continue;
+        }
+        usar_shard(comando->nombre);
+        
+        if (comando->tipo == OP_CREAR) {
+            int idx = aplicar_crear(comando->nombre, comando->datos, comando->longitud, nodo);
+            comando->resultado = (idx >= 0) ? comando->longitud : idx;
+            continue;
+        }
+        if (comando->tipo == OP_RENOMBRAR) {
+            // El origen puede ser un directorio: no se busca en el índice
+            comando->resultado = aplicar_renombrado(comando->nombre, comando->datos, nodo);
+            continue;
+        }
+        if (comando->tipo == OP_COPIAR) {
+            comando->resultado = aplicar_copia(comando->nombre, comando->datos, nodo);
+            continue;
+        }
+        if (comando->tipo == OP_TRANSACCION) {
+            // Con las tablas en exclusiva no hace falta bloquear cada archivo
+            Transaccion tx;
+            comando->resultado = -9;
+            if (decodificar_transaccion(comando->datos, comando->longitud, &tx) == 0) {
+                comando->resultado = aplicar_transaccion(&tx, nodo);
+                tx_abortar(&tx);
+            }
+            continue;
+        }
+        
+        int pos = buscar_en_indice(comando->nombre);
+        if (pos < 0) {
+            comando->resultado = -1; // No existe
+        } else if (comando->tipo == OP_ESCRIBIR && comando->desplazamiento >= 0) {
+            comando->resultado = aplicar_escritura_parcial(sistema->indice[pos] - 1,
+                                                           comando->desplazamiento, comando->datos,
+                                                           comando->longitud, nodo);
+        } else if (comando->tipo == OP_ESCRIBIR) {
+            comando->resultado = aplicar_escritura(sistema->indice[pos] - 1, comando->datos,
+                                                   comando->longitud, nodo);
+        } else if (comando->tipo == OP_ANEXAR) {
+            comando->resultado = aplicar_anexo(sistema->indice[pos] - 1, comando->datos,
+                                               comando->longitud, nodo);
+        } else if (comando->tipo == OP_ELIMINAR) {
+            comando->resultado = aplicar_eliminacion(pos, nodo);
+        } else {
+            comando->resultado = -9;
+        }
+    }
     
-    // Buscar el archivo
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        if (strcmp(sistema->archivos[i].nombre, nombre) == 0) {
-            // Verificar si el archivo está bloqueado
-            if (sistema->archivos[i].bloqueado && 
-                sistema->archivos[i].nodo_bloqueo != id_nodo) {
-                sem_post(sem_archivos);
-                return -2; // Archivo bloqueado por otro nodo
+    // Los registros del WAL se anotan con las tablas tomadas y los comandos
+    // propios se replican también antes de soltarlas (ver anotar_operacion);
+    // los recibidos de otro nodo no se reenvían
+    uint64_t lsn = 0;
+    for (int k = 0; k < n; k++) {
+        if (lote[k].resultado >= 0) {
+            lsn = registrar_wal(lote[k].tipo, nodo, lote[k].nombre, lote[k].datos,
+                                lote[k].longitud, lote[k].desplazamiento);
+        }
+    }
+    for (int k = 0; k < n && nodo == id_nodo; k++) {
+        if (lote[k].resultado >= 0) {
+            replicar_operacion(lote[k].tipo, lote[k].nombre, lote[k].datos, lote[k].longitud,
+                               lote[k].desplazamiento);
+        }
+    }
+    
+    soltar_tablas();
+    
+    // Todo el grupo se hace duradero con una sola espera, ya sin las tablas
+    esperar_wal(lsn);
+}
+
+// Ejecutar un lote de comandos desde un archivo o tubería ("-": entrada estándar)
+// Devuelve el número de comandos procesados o -1 si no se pudo abrir o no es válido
+long ejecutar_lote(const char *ruta) {
+    FILE *entrada = (strcmp(ruta, "-") == 0) ? stdin : fopen(ruta, "rb");
+    if (entrada == NULL) {
+        perror("Error al abrir el lote");
+        return -1;
+    }
+    
+    // Un lote binario se reconoce por su primer byte, que se mira con
+    // getc/ungetc porque una tubería no se puede rebobinar. Ninguna orden de
+    // texto empieza por él, así que a partir de ahí la cabecera debe ser completa
+    int binario = 0;
+    int c = getc(entrada);
+    if (c == MAGIA_LOTE[0]) {
+        char primera[sizeof(MAGIA_LOTE)] = "";
+        primera[0] = (char)c;
+        if (fgets(primera + 1, sizeof(primera) - 1, entrada) == NULL ||
+            strcmp(primera, MAGIA_LOTE) != 0) {
+            fprintf(stderr, "Error: Cabecera de lote binario no válida\n");
+            if (entrada != stdin) {
+                fclose(entrada);
             }
-            
-            // Verificar si somos propietarios
-            if (sistema->archivos[i].propietario != id_nodo) {
-                sem_post(sem_archivos);
-                return -3; // No es el propietario
+            return -1;
+        }
+        binario = 1;
+    } else if (c != EOF) {
+        ungetc(c, entrada);
+    }
+    
+    ComandoLote *lote = malloc(TAM_LOTE * sizeof(ComandoLote));
+    size_t capacidad_salida = TAM_LOTE * (MAX_NOMBRE + 32);
+    char *salida = malloc(capacidad_salida);
+    if (lote == NULL || salida == NULL) {
+        perror("Error al reservar memoria para el lote");
+        free(lote);
+        free(salida);
+        if (entrada != stdin) {
+            fclose(entrada);
+        }
+        return -1;
+    }
+    
+    struct timespec inicio, fin;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+    
+    long total = 0, correctos = 0;
+    int fin_entrada = 0;
+    while (!fin_entrada) {
+        // Leer un grupo de comandos
+        int n = 0;
+        while (n < TAM_LOTE) {
+            int leido = leer_comando_lote(entrada, binario, &lote[n]);
+            if (leido == 0) {
+                fin_entrada = 1;
+                break;
             }
+            n++;
+        }
+        if (n == 0) {
+            break;
+        }
+        
+        aplicar_lote(lote, n, id_nodo);
+        
+        // Registrar en el log y preparar todos los resultados en memoria
+        size_t usado = 0;
+        for (int k = 0; k < n; k++) {
+            ComandoLote *comando = &lote[k];
+            const char *op = (comando->tipo >= 0 && comando->tipo < NUM_TIPOS_OPERACION)
+                             ? nombres_estadisticas[comando->tipo] : "?";
             
-            // Eliminar el archivo moviendo los demás hacia arriba
-            for (int j = i; j < sistema->num_archivos - 1; j++) {
-                memcpy(&sistema->archivos[j], &sistema->archivos[j + 1], sizeof(Archivo));
+            if (comando->resultado >= 0) {
+                registrar_log(comando->tipo, comando->nombre);
+                correctos++;
+                usado += snprintf(salida + usado, capacidad_salida - usado,
+                                  "%s %s: OK (%d)\n", op, comando->nombre, comando->resultado);
+            } else {
+                usado += snprintf(salida + usado, capacidad_salida - usado,
+                                  "%s %s: ERROR (%d)\n", op, comando->nombre, comando->resultado);
             }
-            
-            sistema->num_archivos--;
-            resultado = 0;
+            free(comando->datos);
+        }
+        
+        // Una sola escritura por grupo
+        fflush(stdout);
+        if (!modo_silencioso && write(STDOUT_FILENO, salida, usado) < 0) {
+            perror("Error al escribir los resultados");
+        }
+        total += n;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    double segundos = (fin.tv_sec - inicio.tv_sec) + (fin.tv_nsec - inicio.tv_nsec) / 1e9;
+    printf("[Nodo %d] Lote completado: %ld comandos (%ld correctos) en %.3f s (%.0f ops/s)\n",
+           id_nodo, total, correctos, segundos, segundos > 0 ? total / segundos : 0.0);
+    
+    free(lote);
+    free(salida);
+    if (entrada != stdin) {
+        fclose(entrada);
+    }
+    return total;
+}
+
+// Instante actual en microsegundos del reloj monotónico
+int64_t ahora_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Añadir n bytes al final de un buffer que crece al doble cuando se llena.
+// Devuelve 0 o -1 si no hay memoria
+int anadir_bytes(char **buffer, size_t *tam, size_t *capacidad, const void *datos, size_t n) {
+    if (*tam + n > *capacidad) {
+        size_t nueva = (*capacidad > 0) ? *capacidad : 4096;
+        while (nueva < *tam + n) {
+            nueva *= 2;
+        }
+        char *ampliado = realloc(*buffer, nueva);
+        if (ampliado == NULL) {
+            return -1;
+        }
+        *buffer = ampliado;
+        *capacidad = nueva;
+    }
+    
+    memcpy(*buffer + *tam, datos, n);
+    *tam += n;
+    return 0;
+}
+
+// Encolar una operación local ya aplicada para enviarla a los pares. No
+// espera a nadie: el emisor agrupa en un solo envío todo lo encolado
+void replicar_operacion(int tipo, const char *nombre, const char *datos, int longitud,
+                        int desplazamiento) {
+    if (!replicacion.activa) {
+        return;
+    }
+    
+    CabeceraRegistro cabecera;
+    cabecera.tipo = tipo;
+    cabecera.nodo = id_nodo;
+    cabecera.desplazamiento = desplazamiento;
+    cabecera.longitud_nombre = strlen(nombre);
+    cabecera.longitud_datos = longitud;
+    
+    pthread_mutex_lock(&replicacion.mutex);
+    
+    cabecera.secuencia = ++replicacion.ultima_secuencia;
+    replicacion.instantes[cabecera.secuencia % CAPACIDAD_TIEMPOS] = ahora_us();
+    
+    if (anadir_bytes(&replicacion.pendiente, &replicacion.tam_pendiente,
+                     &replicacion.capacidad_pendiente, &cabecera, sizeof(cabecera)) < 0 ||
+        anadir_bytes(&replicacion.pendiente, &replicacion.tam_pendiente,
+                     &replicacion.capacidad_pendiente, nombre, cabecera.longitud_nombre) < 0 ||
+        anadir_bytes(&replicacion.pendiente, &replicacion.tam_pendiente,
+                     &replicacion.capacidad_pendiente, datos, longitud) < 0) {
+        perror("Error al encolar un registro de replicación");
+    }
+    
+    pthread_cond_signal(&replicacion.hay_registros);
+    pthread_mutex_unlock(&replicacion.mutex);
+}
+
+// Escribir n bytes en un socket aunque send los acepte por partes.
+// Devuelve 0 o -1 si la conexión falla
+int enviar_todo(int fd, const char *datos, size_t n) {
+    while (n > 0) {
+        // MSG_NOSIGNAL: un par caído no debe terminar el proceso con SIGPIPE
+        ssize_t enviados = send(fd, datos, n, MSG_NOSIGNAL);
+        if (enviados < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        datos += enviados;
+        n -= enviados;
+    }
+    
+    return 0;
+}
+
+// Ruta del socket en el que escucha un nodo
+void ruta_socket(int nodo, char *ruta, size_t tam) {
+    snprintf(ruta, tam, "%s/nodo%d.sock", dir_replicacion, nodo);
+}
+
+// Posición absoluta del primer registro del historial con una secuencia
+// posterior a la dada (sólo desde el emisor)
+uint64_t posicion_tras_secuencia(uint64_t secuencia) {
+    size_t desplazamiento = 0;
+    
+    while (desplazamiento < replicacion.tam_historial) {
+        CabeceraRegistro cabecera;
+        memcpy(&cabecera, replicacion.historial + desplazamiento, sizeof(cabecera));
+        if (cabecera.secuencia > secuencia) {
             break;
         }
+        desplazamiento += sizeof(cabecera) + cabecera.longitud_nombre + cabecera.longitud_datos;
     }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    return replicacion.base_historial + desplazamiento;
+}
+
+// Descartar del historial lo que ya confirmaron todos los pares conectados
+// (uno desconectado no lo retiene: al volver recibe lo que le falta o, si
+// ya se descartó, una resincronización) y, si aun así supera
+// MAX_HISTORIAL_REPLICACION, lo más antiguo (sólo desde el emisor, con el
+// mutex de la replicación)
+void recortar_historial() {
+    uint64_t minimo = replicacion.secuencia_historial;
+    for (int k = 0; k < replicacion.num_pares; k++) {
+        uint64_t confirmado = atomic_load(&replicacion.pares[k].confirmado);
+        if (replicacion.pares[k].fd >= 0 && confirmado < minimo) {
+            minimo = confirmado;
+        }
+    }
     
-    if (resultado == 0) {
-        // Registrar operación en el log
-        registrar_log(3, nombre);
-        printf("[Nodo %d] Archivo %s eliminado correctamente\n", id_nodo, nombre);
+    size_t descartados = 0;
+    uint64_t ultima = replicacion.secuencia_base;
+    while (descartados < replicacion.tam_historial) {
+        CabeceraRegistro cabecera;
+        memcpy(&cabecera, replicacion.historial + descartados, sizeof(cabecera));
+        if (cabecera.secuencia > minimo &&
+            replicacion.tam_historial - descartados <= MAX_HISTORIAL_REPLICACION) {
+            break;
+        }
+        descartados += sizeof(cabecera) + cabecera.longitud_nombre + cabecera.longitud_datos;
+        ultima = cabecera.secuencia;
+    }
+    if (descartados == 0) {
+        return;
     }
     
-    return resultado;
+    memmove(replicacion.historial, replicacion.historial + descartados,
+            replicacion.tam_historial - descartados);
+    replicacion.tam_historial -= descartados;
+    replicacion.base_historial += descartados;
+    replicacion.secuencia_base = ultima;
 }
 
-// Función para bloquear un archivo (antes de modificarlo)
-int bloquear_archivo(const char *nombre) {
+// Poner al día a un par al que le faltan registros ya descartados del
+// historial (sólo desde el emisor, sin el mutex de la replicación): recibe
+// un único registro OP_RESINCRONIZAR con el contenido de los archivos de
+// este nodo, tomado con las tablas en exclusiva y numerado con la última
+// secuencia asignada. Como las operaciones se numeran con sus locks
+// tomados, la imagen contiene exactamente las anteriores, y el envío sigue
+// con las posteriores. Las escrituras de este nodo sobre archivos de otros
+// que ya se descartaron no se recuperan. Devuelve 0 o -1 si falla el envío
+// o falta memoria
+int resincronizar_par(ParReplicacion *par) {
+    Transaccion *imagen = malloc(sizeof(Transaccion));
+    if (imagen == NULL) {
+        return -1;
+    }
+    tx_inicio(imagen);
+    
+    int completa = 1;
+    tomar_tablas(1);
+    for (int k = 0; k < num_shards; k++) {
+        sistema = shards[k];
+        for (int i = 0; i < sistema->max_posicion; i++) {
+            Archivo *archivo = &sistema->archivos[i];
+            if (!archivo->en_uso || archivo->propietario != id_nodo) {
+                continue;
+            }
+            char *contenido = malloc(archivo->tamanio + 1);
+            if (contenido == NULL || leer_contenido(archivo, contenido) < 0 ||
+                tx_escribir(imagen, archivo->nombre, contenido, archivo->tamanio) < 0) {
+                completa = 0;
+            }
+            free(contenido);
+        }
+    }
+    pthread_mutex_lock(&replicacion.mutex);
+    uint64_t secuencia = replicacion.ultima_secuencia;
+    pthread_mutex_unlock(&replicacion.mutex);
+    soltar_tablas();
+    
+    int longitud = 0;
+    char *datos = completa ? codificar_transaccion(imagen, &longitud) : NULL;
+    int archivos = imagen->num_escrituras;
+    tx_abortar(imagen);
+    free(imagen);
+    if (datos == NULL) {
+        return -1;
+    }
+    
+    CabeceraRegistro cabecera = {
+        .secuencia = secuencia,
+        .tipo = OP_RESINCRONIZAR,
+        .nodo = id_nodo,
+        .desplazamiento = -1,
+        .longitud_nombre = 1, // El WAL del par necesita un nombre
+        .longitud_datos = longitud
+    };
     int resultado = -1;
+    if (enviar_todo(par->fd, (const char *)&cabecera, sizeof(cabecera)) == 0 &&
+        enviar_todo(par->fd, "-", 1) == 0 &&
+        enviar_todo(par->fd, datos, longitud) == 0) {
+        par->enviado = posicion_tras_secuencia(secuencia);
+        par->resincronizar = 0;
+        resultado = 0;
+        printf("[Replicación] Nodo %d resincronizado hasta la operación %llu (%d archivos)\n",
+               par->id, (unsigned long long)secuencia, archivos);
+    }
     
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+    free(datos);
+    return resultado;
+}
+
+// Intentar conectar con un par (sólo desde el emisor) y saludarlo. El par
+// responde con lo último que aplicó de esta época, y el envío sigue desde
+// ahí. Devuelve 0 o -1 si el par todavía no escucha o no responde
+int conectar_par(ParReplicacion *par) {
+    struct sockaddr_un direccion;
+    memset(&direccion, 0, sizeof(direccion));
+    direccion.sun_family = AF_UNIX;
+    ruta_socket(par->id, direccion.sun_path, sizeof(direccion.sun_path));
     
-    // Buscar el archivo
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        if (strcmp(sistema->archivos[i].nombre, nombre) == 0) {
-            // Verificar si el archivo ya está bloqueado
-            if (sistema->archivos[i].bloqueado) {
-                sem_post(sem_archivos);
-                return -2; // Archivo ya bloqueado
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&direccion, sizeof(direccion)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    // Un par que no responde al saludo en un segundo se reintenta más tarde
+    SaludoReplicacion saludo = {MAGIA_REPLICACION, id_nodo, replicacion.epoca};
+    struct timeval espera = {1, 0};
+    uint64_t aplicado;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &espera, sizeof(espera));
+    if (enviar_todo(fd, (const char *)&saludo, sizeof(saludo)) < 0 ||
+        recv(fd, &aplicado, sizeof(aplicado), MSG_WAITALL) != sizeof(aplicado)) {
+        close(fd);
+        return -1;
+    }
+    espera.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &espera, sizeof(espera));
+    
+    // Si el historial ya se recortó por encima de lo que tiene el par, hay
+    // que resincronizarlo antes de seguir
+    par->resincronizar = (aplicado < replicacion.secuencia_base);
+    par->fd = fd;
+    par->enviado = posicion_tras_secuencia(aplicado);
+    atomic_store(&par->confirmado, aplicado);
+    atomic_store(&par->caido, 0);
+    pthread_create(&par->hilo_confirmaciones, NULL, hilo_confirmaciones, par);
+    return 0;
+}
+
+// Cerrar la conexión con un par y esperar a su hilo de confirmaciones
+void desconectar_par(ParReplicacion *par) {
+    shutdown(par->fd, SHUT_RDWR);
+    pthread_join(par->hilo_confirmaciones, NULL);
+    close(par->fd);
+    par->fd = -1;
+}
+
+// Hilo de confirmaciones de un par: cada confirmación es la última
+// secuencia que el par ha aplicado, y de ella salen las latencias
+void *hilo_confirmaciones(void *arg) {
+    ParReplicacion *par = arg;
+    uint64_t confirmado;
+    
+    while (recv(par->fd, &confirmado, sizeof(confirmado), MSG_WAITALL) == sizeof(confirmado)) {
+        int64_t ahora = ahora_us();
+        
+        pthread_mutex_lock(&replicacion.mutex);
+        uint64_t anterior = atomic_load(&par->confirmado);
+        for (uint64_t s = anterior + 1; s <= confirmado; s++) {
+            // Sólo se conoce el instante de los últimos CAPACIDAD_TIEMPOS registros
+            if (replicacion.ultima_secuencia - s < CAPACIDAD_TIEMPOS) {
+                int64_t latencia = ahora - replicacion.instantes[s % CAPACIDAD_TIEMPOS];
+                replicacion.suma_latencias += latencia;
+                if (latencia > replicacion.max_latencia) {
+                    replicacion.max_latencia = latencia;
+                }
+                replicacion.confirmaciones++;
+            }
+        }
+        if (confirmado > anterior) {
+            atomic_store(&par->confirmado, confirmado);
+        }
+        pthread_cond_broadcast(&replicacion.hay_confirmaciones);
+        pthread_mutex_unlock(&replicacion.mutex);
+    }
+    
+    atomic_store(&par->caido, 1);
+    return NULL;
+}
+
+// Hilo emisor: pasa los registros encolados al historial y envía a cada par
+// todo lo que le falta en un solo envío, sin esperar confirmaciones entre
+// grupos (los envíos se encadenan). Reintenta conectar con los pares
+// ausentes cada segundo
+void *hilo_emisor_replicacion(void *arg) {
+    pthread_mutex_lock(&replicacion.mutex);
+    
+    for (;;) {
+        // Sólo este hilo toca el historial, así que puede enviarse sin el mutex
+        if (replicacion.tam_pendiente > 0) {
+            if (anadir_bytes(&replicacion.historial, &replicacion.tam_historial,
+                             &replicacion.capacidad_historial, replicacion.pendiente,
+                             replicacion.tam_pendiente) == 0) {
+                replicacion.tam_pendiente = 0;
+                replicacion.secuencia_historial = replicacion.ultima_secuencia;
+            }
+        }
+        int terminar = !replicacion.activa;
+        pthread_mutex_unlock(&replicacion.mutex);
+        
+        uint64_t fin = replicacion.base_historial + replicacion.tam_historial;
+        for (int k = 0; k < replicacion.num_pares; k++) {
+            ParReplicacion *par = &replicacion.pares[k];
+            
+            if (par->fd >= 0 && atomic_load(&par->caido)) {
+                desconectar_par(par);
+            }
+            if (par->fd < 0 && (terminar || conectar_par(par) < 0)) {
+                continue;
+            }
+            if (par->resincronizar && resincronizar_par(par) < 0) {
+                desconectar_par(par);
+                continue;
             }
             
-            // Bloquear el archivo
-            sistema->archivos[i].bloqueado = 1;
-            sistema->archivos[i].nodo_bloqueo = id_nodo;
-            resultado = 0;
+            if (par->enviado < fin) {
+                const char *desde = replicacion.historial + (par->enviado - replicacion.base_historial);
+                if (enviar_todo(par->fd, desde, fin - par->enviado) < 0) {
+                    desconectar_par(par);
+                } else {
+                    par->enviado = fin;
+                }
+            }
+        }
+        
+        pthread_mutex_lock(&replicacion.mutex);
+        
+        recortar_historial();
+        
+        if (terminar) {
+            break;
+        }
+        if (replicacion.tam_pendiente == 0) {
+            struct timespec limite;
+            clock_gettime(CLOCK_REALTIME, &limite);
+            limite.tv_sec += 1;
+            pthread_cond_timedwait(&replicacion.hay_registros, &replicacion.mutex, &limite);
+        }
+    }
+    
+    pthread_mutex_unlock(&replicacion.mutex);
+    return NULL;
+}
+
+// Hilo servidor: acepta las conexiones de los pares. Limita las conexiones
+// simultáneas, no las de toda la ejecución: antes de buscar hueco recoge los
+// receptores que ya terminaron (cada reconexión de un par deja uno)
+void *hilo_servidor_replicacion(void *arg) {
+    for (;;) {
+        int fd = accept(replicacion.fd_escucha, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; // detener_replicacion cerró el socket
+        }
+        
+        int libre = -1;
+        for (int k = 0; k < MAX_NODOS; k++) {
+            if (replicacion.receptores[k] >= 0 && atomic_load(&replicacion.receptor_terminado[k])) {
+                pthread_join(replicacion.hilos_receptores[k], NULL);
+                close(replicacion.receptores[k]);
+                replicacion.receptores[k] = -1;
+            }
+            if (libre < 0 && replicacion.receptores[k] < 0) {
+                libre = k;
+            }
+        }
+        
+        if (libre < 0) {
+            close(fd);
+            continue;
+        }
+        
+        replicacion.receptores[libre] = fd;
+        atomic_store(&replicacion.receptor_terminado[libre], 0);
+        if (pthread_create(&replicacion.hilos_receptores[libre], NULL, hilo_receptor_replicacion,
+                           (void *)(intptr_t)libre) != 0) {
+            close(fd);
+            replicacion.receptores[libre] = -1;
+        }
+    }
+    
+    return NULL;
+}
+
+// Hilo receptor de un par: tras el saludo, decodifica todos los registros
+// completos que llegan en cada lectura, descarta los que ya se aplicaron
+// (una reconexión reenvía lo no confirmado) y aplica el resto como un grupo
+// (una sola adquisición de lock_tabla, como un lote) con el nodo de origen.
+// El progreso se anota en el mismo grupo, así que se conserva con el
+// segmento y el WAL exactamente con lo aplicado. Después confirma la última
+// secuencia recibida
+void *hilo_receptor_replicacion(void *arg) {
+    int hueco = (int)(intptr_t)arg;
+    int fd = replicacion.receptores[hueco];
+    size_t capacidad = TAM_BUFFER_REPLICACION, usado = 0;
+    char *buffer = malloc(capacidad);
+    ComandoLote *lote = malloc(TAM_LOTE * sizeof(ComandoLote));
+    int corrupto = 0;
+    
+    SaludoReplicacion saludo;
+    if (recv(fd, &saludo, sizeof(saludo), MSG_WAITALL) != sizeof(saludo) ||
+        saludo.magia != MAGIA_REPLICACION || saludo.nodo >= MAX_NODOS ||
+        (int)saludo.nodo == id_nodo || saludo.epoca == 0) {
+        corrupto = 1;
+    }
+    int origen = corrupto ? 0 : (int)saludo.nodo;
+    
+    // Un solo receptor por origen a la vez: el de una conexión anterior
+    // puede seguir aplicando su último grupo
+    pthread_mutex_lock(&replicacion.origenes[origen]);
+    ProgresoReplicacion progreso = {saludo.epoca, 0};
+    if (!corrupto && principal->replicado[origen].epoca == saludo.epoca) {
+        progreso.secuencia = principal->replicado[origen].secuencia;
+    }
+    if (!corrupto &&
+        enviar_todo(fd, (const char *)&progreso.secuencia, sizeof(progreso.secuencia)) < 0) {
+        corrupto = 1;
+    }
+    
+    while (buffer != NULL && lote != NULL && !corrupto) {
+        ssize_t leidos = read(fd, buffer + usado, capacidad - usado);
+        if (leidos <= 0) {
+            break;
+        }
+        usado += leidos;
+        
+        // Aplicar por grupos todos los registros completos (el último hueco
+        // del grupo es para el progreso)
+        size_t consumidos = 0;
+        for (;;) {
+            int n = 0;
+            uint64_t ultima = progreso.secuencia;
+            
+            while (n < TAM_LOTE - 1 && consumidos + sizeof(CabeceraRegistro) <= usado) {
+                CabeceraRegistro cabecera;
+                memcpy(&cabecera, buffer + consumidos, sizeof(cabecera));
+                if (cabecera.longitud_nombre >= MAX_NOMBRE || cabecera.longitud_datos > INT32_MAX) {
+                    corrupto = 1;
+                    break;
+                }
+                
+                size_t total = sizeof(cabecera) + cabecera.longitud_nombre + cabecera.longitud_datos;
+                if (consumidos + total > usado) {
+                    // Registro incompleto: si no cabe en el buffer, ampliarlo
+                    if (total > capacidad) {
+                        char *ampliado = realloc(buffer, total);
+                        if (ampliado == NULL) {
+                            corrupto = 1;
+                        } else {
+                            buffer = ampliado;
+                            capacidad = total;
+                        }
+                    }
+                    break;
+                }
+                
+                const char *nombre = buffer + consumidos + sizeof(cabecera);
+                consumidos += total;
+                if (cabecera.secuencia <= ultima) {
+                    continue; // Ya aplicado
+                }
+                ultima = cabecera.secuencia;
+                
+                ComandoLote *comando = &lote[n++];
+                memset(comando, 0, sizeof(ComandoLote));
+                comando->tipo = cabecera.tipo;
+                memcpy(comando->nombre, nombre, cabecera.longitud_nombre);
+                comando->longitud = cabecera.longitud_datos;
+                comando->desplazamiento = cabecera.desplazamiento;
+                comando->datos = malloc(comando->longitud + 1);
+                if (comando->datos != NULL) {
+                    memcpy(comando->datos, nombre + cabecera.longitud_nombre, comando->longitud);
+                    comando->datos[comando->longitud] = '\0';
+                }
+                if (comando->datos == NULL ||
+                    (cabecera.tipo >= NUM_TIPOS_OPERACION && cabecera.tipo != OP_RESINCRONIZAR)) {
+                    comando->resultado = -9;
+                }
+            }
+            
+            if (ultima == progreso.secuencia) {
+                break; // Nada nuevo en el buffer
+            }
+            
+            progreso.secuencia = ultima;
+            ComandoLote *marca = &lote[n];
+            memset(marca, 0, sizeof(ComandoLote));
+            marca->tipo = OP_PROGRESO_REPLICACION;
+            strcpy(marca->nombre, "-"); // El WAL necesita un nombre
+            marca->longitud = sizeof(progreso);
+            marca->desplazamiento = -1;
+            marca->datos = malloc(sizeof(progreso));
+            if (marca->datos != NULL) {
+                memcpy(marca->datos, &progreso, sizeof(progreso));
+            } else {
+                marca->resultado = -9;
+            }
+            
+            aplicar_lote(lote, n + 1, origen);
+            
+            int conflictos = 0;
+            for (int k = 0; k < n; k++) {
+                if (lote[k].resultado < 0) {
+                    conflictos++;
+                }
+                free(lote[k].datos);
+            }
+            free(marca->datos);
+            
+            pthread_mutex_lock(&replicacion.mutex);
+            replicacion.recibidos += n;
+            replicacion.conflictos += conflictos;
+            pthread_mutex_unlock(&replicacion.mutex);
+            
+            // Confirmar: el origen ya puede dar el grupo por replicado aquí
+            if (enviar_todo(fd, (const char *)&ultima, sizeof(ultima)) < 0) {
+                corrupto = 1;
+                break;
+            }
+        }
+        
+        memmove(buffer, buffer + consumidos, usado - consumidos);
+        usado -= consumidos;
+    }
+    pthread_mutex_unlock(&replicacion.origenes[origen]);
+    
+    if (corrupto) {
+        printf("[Replicación] Conexión de un par cerrada por un registro no válido\n");
+    }
+    free(buffer);
+    free(lote);
+    // El servidor cierra la conexión y reutiliza el hueco
+    atomic_store(&replicacion.receptor_terminado[hueco], 1);
+    return NULL;
+}
+
+// Arrancar la replicación: escuchar en el socket de este nodo y preparar
+// las conexiones con los pares ("1,2,3"; NULL: todos los demás nodos).
+// Devuelve 0 o -1 si no se pudo crear el socket
+int iniciar_replicacion(const char *lista_pares) {
+    for (int nodo = 0; nodo < MAX_NODOS; nodo++) {
+        char marca[8];
+        snprintf(marca, sizeof(marca), "%d", nodo);
+        
+        int incluido = (lista_pares == NULL) ? nodo != id_nodo : 0;
+        if (lista_pares != NULL) {
+            // Buscar el número como elemento completo de la lista
+            const char *p = lista_pares;
+            while (!incluido && (p = strstr(p, marca)) != NULL) {
+                size_t largo = strlen(marca);
+                incluido = (p == lista_pares || p[-1] == ',') && (p[largo] == ',' || p[largo] == '\0');
+                p += largo;
+            }
+        }
+        
+        if (incluido && nodo != id_nodo) {
+            ParReplicacion *par = &replicacion.pares[replicacion.num_pares++];
+            par->id = nodo;
+            par->fd = -1;
+        }
+    }
+    
+    struct sockaddr_un direccion;
+    memset(&direccion, 0, sizeof(direccion));
+    direccion.sun_family = AF_UNIX;
+    ruta_socket(id_nodo, direccion.sun_path, sizeof(direccion.sun_path));
+    unlink(direccion.sun_path);
+    
+    replicacion.fd_escucha = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (replicacion.fd_escucha < 0 ||
+        bind(replicacion.fd_escucha, (struct sockaddr *)&direccion, sizeof(direccion)) < 0 ||
+        listen(replicacion.fd_escucha, MAX_NODOS) < 0) {
+        perror("Error al crear el socket de replicación");
+        return -1;
+    }
+    
+    // La época distingue esta ejecución de las anteriores de este nodo, cuya
+    // numeración empezaba también en 1
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    replicacion.epoca = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
+    for (int k = 0; k < MAX_NODOS; k++) {
+        pthread_mutex_init(&replicacion.origenes[k], NULL);
+        replicacion.receptores[k] = -1;
+    }
+    
+    replicacion.activa = 1;
+    pthread_create(&replicacion.hilo_servidor, NULL, hilo_servidor_replicacion, NULL);
+    pthread_create(&replicacion.hilo_emisor, NULL, hilo_emisor_replicacion, NULL);
+    
+    printf("[Replicación] Nodo %d escuchando en %s (%d pares)\n",
+           id_nodo, direccion.sun_path, replicacion.num_pares);
+    return 0;
+}
+
+// Esperar a que todos los pares confirmen las operaciones encoladas hasta
+// ahora. Tras esperar con éxito, una lectura en cualquier par ve las
+// escrituras de este nodo. Devuelve cuántos pares están al día
+int esperar_replicacion(int espera_ms) {
+    struct timespec limite;
+    clock_gettime(CLOCK_REALTIME, &limite);
+    limite.tv_sec += espera_ms / 1000;
+    limite.tv_nsec += (espera_ms % 1000) * 1000000L;
+    if (limite.tv_nsec >= 1000000000L) {
+        limite.tv_sec++;
+        limite.tv_nsec -= 1000000000L;
+    }
+    
+    pthread_mutex_lock(&replicacion.mutex);
+    
+    uint64_t objetivo = replicacion.ultima_secuencia;
+    int al_dia;
+    for (;;) {
+        al_dia = 0;
+        for (int k = 0; k < replicacion.num_pares; k++) {
+            if (atomic_load(&replicacion.pares[k].confirmado) >= objetivo) {
+                al_dia++;
+            }
+        }
+        if (al_dia == replicacion.num_pares ||
+            pthread_cond_timedwait(&replicacion.hay_confirmaciones, &replicacion.mutex,
+                                   &limite) == ETIMEDOUT) {
             break;
         }
     }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    pthread_mutex_unlock(&replicacion.mutex);
+    return al_dia;
+}
+
+// Parar la replicación: enviar lo encolado, cerrar las conexiones y
+// esperar a los hilos (antes de finalizar_sistema)
+void detener_replicacion() {
+    if (!replicacion.activa) {
+        return;
+    }
+    
+    pthread_mutex_lock(&replicacion.mutex);
+    replicacion.activa = 0;
+    pthread_cond_signal(&replicacion.hay_registros);
+    pthread_mutex_unlock(&replicacion.mutex);
+    pthread_join(replicacion.hilo_emisor, NULL);
+    
+    for (int k = 0; k < replicacion.num_pares; k++) {
+        if (replicacion.pares[k].fd >= 0) {
+            desconectar_par(&replicacion.pares[k]);
+        }
+    }
+    
+    // shutdown despierta al accept del servidor y a los read de los receptores
+    shutdown(replicacion.fd_escucha, SHUT_RDWR);
+    pthread_join(replicacion.hilo_servidor, NULL);
+    close(replicacion.fd_escucha);
+    for (int k = 0; k < MAX_NODOS; k++) {
+        if (replicacion.receptores[k] < 0) {
+            continue;
+        }
+        shutdown(replicacion.receptores[k], SHUT_RDWR);
+        pthread_join(replicacion.hilos_receptores[k], NULL);
+        close(replicacion.receptores[k]);
+    }
+    
+    char ruta[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    ruta_socket(id_nodo, ruta, sizeof(ruta));
+    unlink(ruta);
+    
+    free(replicacion.pendiente);
+    free(replicacion.historial);
+}
+
+// Mostrar el estado de la replicación
+void mostrar_replicacion() {
+    pthread_mutex_lock(&replicacion.mutex);
+    
+    printf("--- REPLICACIÓN (Nodo %d) ---\n", id_nodo);
+    printf("Operaciones enviadas: %llu\n", (unsigned long long)replicacion.ultima_secuencia);
+    printf("Historial retenido: %zu bytes (operaciones desde la %llu)\n", replicacion.tam_historial,
+           (unsigned long long)replicacion.secuencia_base + 1);
+    for (int k = 0; k < replicacion.num_pares; k++) {
+        ParReplicacion *par = &replicacion.pares[k];
+        printf("Par %d: %-12s confirmadas %llu\n", par->id,
+               par->fd >= 0 ? "CONECTADO" : "DESCONECTADO",
+               (unsigned long long)atomic_load(&par->confirmado));
+    }
+    if (replicacion.confirmaciones > 0) {
+        printf("Latencia de confirmación: media %.1f us, máxima %lld us\n",
+               (double)replicacion.suma_latencias / replicacion.confirmaciones,
+               (long long)replicacion.max_latencia);
+    }
+    printf("Operaciones recibidas de los pares: %llu (%llu rechazadas)\n",
+           (unsigned long long)replicacion.recibidos, (unsigned long long)replicacion.conflictos);
+    
+    pthread_mutex_unlock(&replicacion.mutex);
+}
+
+// Benchmark de replicación: escrituras de 'tamanio' bytes sobre un archivo
+// y espera a que todos los pares las confirmen
+void benchmark_replicacion(int operaciones, int tamanio) {
+    char nombre[MAX_NOMBRE];
+    snprintf(nombre, sizeof(nombre), "bench_replicacion_%d", id_nodo);
+    
+    char *contenido = malloc(tamanio + 1);
+    if (contenido == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&replicacion.mutex);
+    replicacion.confirmaciones = 0;
+    replicacion.suma_latencias = 0;
+    replicacion.max_latencia = 0;
+    pthread_mutex_unlock(&replicacion.mutex);
     
-    if (resultado == 0) {
-        printf("[Nodo %d] Archivo %s bloqueado correctamente\n", id_nodo, nombre);
+    modo_silencioso = 1;
+    memset(contenido, 'a', tamanio);
+    contenido[tamanio] = '\0';
+    if (crear_archivo(nombre, contenido) == -1) {
+        escribir_archivo(nombre, contenido);
     }
     
-    return resultado;
+    int64_t inicio = ahora_us();
+    for (int k = 0; k < operaciones; k++) {
+        // Cambiar el contenido para que ninguna escritura se descarte por igual
+        contenido[k % tamanio] = 'a' + (k / tamanio) % 26;
+        escribir_archivo(nombre, contenido);
+    }
+    int64_t encolado = ahora_us();
+    int al_dia = esperar_replicacion(ESPERA_REPLICACION_MS);
+    int64_t fin = ahora_us();
+    modo_silencioso = 0;
+    
+    double segundos = (fin - inicio) / 1e6;
+    printf("[Replicación] %d escrituras de %d bytes: locales en %.3f s, replicadas en %.3f s "
+           "(%.0f ops/s) en %d de %d pares\n",
+           operaciones, tamanio, (encolado - inicio) / 1e6, segundos,
+           segundos > 0 ? operaciones / segundos : 0.0, al_dia, replicacion.num_pares);
+    mostrar_replicacion();
+    
+    free(contenido);
 }
 
-// Función para desbloquear un archivo
-int desbloquear_archivo(const char *nombre) {
-    int resultado = -1;
+// Benchmark de lecturas: mide cómo escala leer_archivo al pasar de 1 a
+// MAX_NODOS procesos lectores concurrentes sobre la misma memoria compartida
+void benchmark_lecturas(int segundos) {
+    int num_archivos = MAX_ARCHIVOS / 2;
+    char nombres[MAX_ARCHIVOS][MAX_NOMBRE];
     
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+    // Cada proceso hijo deja su número de lecturas en memoria compartida
+    long *lecturas = mmap(NULL, MAX_NODOS * sizeof(long), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lecturas == MAP_FAILED) {
+        perror("Error al crear la memoria de resultados");
+        return;
+    }
     
-    // Buscar el archivo
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        if (strcmp(sistema->archivos[i].nombre, nombre) == 0) {
-            // Verificar si somos quien tiene el bloqueo
-            if (sistema->archivos[i].bloqueado && 
-                sistema->archivos[i].nodo_bloqueo != id_nodo) {
-                sem_post(sem_archivos);
-                return -2; // No tiene el bloqueo
-            }
+    // Preparar los archivos que se van a leer
+    modo_silencioso = 1;
+    for (int i = 0; i < num_archivos; i++) {
+        snprintf(nombres[i], MAX_NOMBRE, "bench_%d", i);
+        crear_archivo(nombres[i], "Contenido de prueba para el benchmark de lecturas");
+    }
+    
+    printf("=== BENCHMARK DE LECTURAS (%d s por ronda) ===\n", segundos);
+    printf("%-10s %-15s %-10s\n", "Procesos", "Lecturas/s", "Escalado");
+    
+    double base = 0;
+    for (int n = 1; n <= MAX_NODOS; n++) {
+        for (int p = 0; p < n; p++) {
+            pid_t pid = fork();
             
-            // Desbloquear el archivo
-            sistema->archivos[i].bloqueado = 0;
-            sistema->archivos[i].nodo_bloqueo = -1;
-            resultado = 0;
-            break;
+            if (pid == 0) {
+                // Proceso lector: leer archivos en bucle durante el tiempo indicado
+                char buffer[MAX_CONTENIDO];
+                struct timespec ahora, fin;
+                clock_gettime(CLOCK_MONOTONIC, &fin);
+                fin.tv_sec += segundos;
+                
+                id_nodo = p;
+                long cuenta = 0;
+                do {
+                    // Consultar el reloj sólo cada 1024 lecturas
+                    for (int k = 0; k < 1024; k++) {
+                        leer_archivo(nombres[(p + cuenta) % num_archivos], buffer,
+                                     sizeof(buffer));
+                        cuenta++;
+                    }
+                    clock_gettime(CLOCK_MONOTONIC, &ahora);
+                } while (ahora.tv_sec < fin.tv_sec ||
+                         (ahora.tv_sec == fin.tv_sec && ahora.tv_nsec < fin.tv_nsec));
+                
+                lecturas[p] = cuenta;
+                _exit(0);
+            } else if (pid < 0) {
+                perror("Error al crear proceso lector");
+            }
+        }
+        
+        // Esperar a todos los lectores de esta ronda
+        while (wait(NULL) > 0);
+        
+        long total = 0;
+        for (int p = 0; p < n; p++) {
+            total += lecturas[p];
+            lecturas[p] = 0;
+        }
+        
+        double por_segundo = (double)total / segundos;
+        if (n == 1) {
+            base = por_segundo;
         }
+        printf("%-10d %-15.0f %.2fx\n", n, por_segundo, base > 0 ? por_segundo / base : 0.0);
     }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    // Limpiar los archivos de prueba
+    for (int i = 0; i < num_archivos; i++) {
+        eliminar_archivo(nombres[i]);
+    }
+    modo_silencioso = 0;
     
-    if (resultado == 0) {
-        printf("[Nodo %d] Archivo %s desbloqueado correctamente\n", id_nodo, nombre);
+    munmap(lecturas, MAX_NODOS * sizeof(long));
+}
+
+// Índice de la cubeta de un histograma de latencia para ns nanosegundos:
+// valores exactos por debajo de 2^BITS_SUBCUBETAS y, a partir de ahí, los
+// BITS_SUBCUBETAS bits que siguen al más significativo
+int cubeta_latencia(uint64_t ns) {
+    if (ns < (1u << BITS_SUBCUBETAS)) {
+        return (int)ns;
     }
     
-    return resultado;
+    int msb = 63 - __builtin_clzll(ns);
+    int desplazamiento = msb - BITS_SUBCUBETAS;
+    return (msb - BITS_SUBCUBETAS + 1) * (1 << BITS_SUBCUBETAS) +
+           (int)((ns >> desplazamiento) & ((1u << BITS_SUBCUBETAS) - 1));
 }
 
-// Función para registrar una operación en el log
-void registrar_log(int tipo_operacion, const char *nombre_archivo) {
-    // Bloquear semáforo de logs
-    sem_wait(sem_logs);
+// Mayor valor (ns) que cae en una cubeta
+uint64_t limite_cubeta(int cubeta) {
+    int subcubetas = 1 << BITS_SUBCUBETAS;
+    if (cubeta < subcubetas) {
+        return cubeta;
+    }
     
-    // Crear entrada de log
-    int idx = sistema->indice_log;
-    sistema->log[idx].timestamp = time(NULL);
-    sistema->log[idx].nodo = id_nodo;
-    sistema->log[idx].tipo_operacion = tipo_operacion;
-    strncpy(sistema->log[idx].nombre_archivo, nombre_archivo, MAX_NOMBRE - 1);
+    int desplazamiento = cubeta / subcubetas - 1;
+    uint64_t inferior = (uint64_t)(subcubetas + cubeta % subcubetas) << desplazamiento;
+    return inferior + ((uint64_t)1 << desplazamiento) - 1;
+}
+
+// Percentil (0-100) de un histograma, en ns
+uint64_t percentil_latencia(const HistogramaLatencia *histograma, double percentil) {
+    if (histograma->operaciones == 0) {
+        return 0;
+    }
     
-    // Actualizar índice (circular)
-    sistema->indice_log = (sistema->indice_log + 1) % MAX_OPERACIONES;
+    uint64_t objetivo = (uint64_t)(histograma->operaciones * percentil / 100.0);
+    if (objetivo >= histograma->operaciones) {
+        objetivo = histograma->operaciones - 1;
+    }
     
-    // Desbloquear semáforo de logs
-    sem_post(sem_logs);
+    uint64_t acumulado = 0;
+    for (int c = 0; c < NUM_CUBETAS_LATENCIA; c++) {
+        acumulado += histograma->cubetas[c];
+        if (acumulado > objetivo) {
+            uint64_t limite = limite_cubeta(c);
+            return limite < histograma->max_ns ? limite : histograma->max_ns;
+        }
+    }
+    return histograma->max_ns;
 }
 
-// Función para mostrar los archivos existentes
-void mostrar_archivos() {
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
+// Leer una mezcla de pesos "crear=10,leer=60,...". Las operaciones que no
+// aparecen no se ejecutan. Devuelve la suma de los pesos o -1 si la mezcla
+// no es válida
+int parsear_mezcla(const char *texto, int *pesos) {
+    memset(pesos, 0, NUM_OPERACIONES_CARGA * sizeof(int));
     
-    printf("--- ARCHIVOS (%d) ---\n", sistema->num_archivos);
-    printf("%-20s %-10s %-10s %-20s %-10s\n", 
-           "Nombre", "Tamaño", "Propietario", "Última Modificación", "Estado");
+    char copia[MAX_CONTENIDO];
+    snprintf(copia, sizeof(copia), "%s", texto);
     
-    for (int i = 0; i < sistema->num_archivos; i++) {
-        // Formatear timestamp
-        struct tm *tm_info = localtime(&sistema->archivos[i].ultima_modificacion);
-        char buffer[20];
-        strftime(buffer, 20, "%Y-%m-%d %H:%M:%S", tm_info);
-        
-        // Estado de bloqueo
-        char estado[20];
-        if (sistema->archivos[i].bloqueado) {
-            sprintf(estado, "Bloq. por %d", sistema->archivos[i].nodo_bloqueo);
-        } else {
-            strcpy(estado, "Disponible");
+    char *contexto = NULL;
+    for (char *par = strtok_r(copia, ",", &contexto); par != NULL;
+         par = strtok_r(NULL, ",", &contexto)) {
+        char *igual = strchr(par, '=');
+        if (igual == NULL) {
+            return -1;
         }
+        *igual = '\0';
         
-        printf("%-20s %-10d %-10d %-20s %-10s\n", 
-               sistema->archivos[i].nombre,
-               sistema->archivos[i].tamanio,
-               sistema->archivos[i].propietario,
-               buffer,
-               estado);
+        int op = 0;
+        while (op < NUM_OPERACIONES_CARGA && strcmp(par, nombres_carga[op]) != 0) {
+            op++;
+        }
+        if (op == NUM_OPERACIONES_CARGA || atoi(igual + 1) < 0) {
+            return -1;
+        }
+        pesos[op] = atoi(igual + 1);
     }
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    int total = 0;
+    for (int op = 0; op < NUM_OPERACIONES_CARGA; op++) {
+        total += pesos[op];
+    }
+    return total > 0 ? total : -1;
 }
 
-// Función para mostrar el log de operaciones
-void mostrar_log() {
-    // Bloquear semáforo de logs
-    sem_wait(sem_logs);
+// Benchmark de carga: procesos nodo hijos lanzan una mezcla aleatoria de
+// operaciones sobre un conjunto común de archivos y miden cada una. Cada hijo
+// rellena sus propios histogramas en memoria compartida y el padre los
+// combina al final
+void benchmark_carga(int procesos, int segundos, const char *mezcla) {
+    int pesos[NUM_OPERACIONES_CARGA] = {10, 50, 25, 10, 5};
+    int total_pesos = (mezcla != NULL) ? parsear_mezcla(mezcla, pesos) : 100;
+    if (total_pesos < 0) {
+        printf("Error: Mezcla no válida (p. ej. crear=10,leer=50,escribir=25,eliminar=10,bloquear=5)\n");
+        return;
+    }
     
-    printf("--- LOG DE OPERACIONES ---\n");
-    printf("%-20s %-10s %-15s %-20s\n", 
-           "Timestamp", "Nodo", "Operación", "Archivo");
+    int num_archivos = MAX_ARCHIVOS / 2;
+    char nombres[MAX_ARCHIVOS][MAX_NOMBRE];
     
-    // Determinar cuántas entradas mostrar
-    int total_entradas = MAX_OPERACIONES; // Máximo posible
+    size_t tam_resultados = (size_t)MAX_NODOS * NUM_OPERACIONES_CARGA * sizeof(HistogramaLatencia);
+    HistogramaLatencia *resultados = mmap(NULL, tam_resultados, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (resultados == MAP_FAILED) {
+        perror("Error al crear la memoria de resultados");
+        return;
+    }
     
-    for (int i = 0; i < total_entradas; i++) {
-        int idx = (sistema->indice_log - i - 1);
-        if (idx < 0) idx += MAX_OPERACIONES;
-        
-        // Si encontramos una entrada vacía, paramos
-        if (sistema->log[idx].timestamp == 0) {
-            break;
+    // Preparar los archivos: empiezan existiendo la mitad
+    modo_silencioso = 1;
+    for (int i = 0; i < num_archivos; i++) {
+        snprintf(nombres[i], MAX_NOMBRE, "carga_%d", i);
+        if (i % 2 == 0) {
+            crear_archivo(nombres[i], "Contenido inicial del benchmark de carga");
         }
+    }
+    
+    printf("=== BENCHMARK DE CARGA (%d procesos, %d s, %d archivos) ===\n",
+           procesos, segundos, num_archivos);
+    printf("Mezcla:");
+    for (int op = 0; op < NUM_OPERACIONES_CARGA; op++) {
+        printf(" %s %.0f%%", nombres_carga[op], 100.0 * pesos[op] / total_pesos);
+    }
+    printf("\n");
+    
+    for (int p = 0; p < procesos; p++) {
+        pid_t pid = fork();
         
-        // Formatear timestamp
-        struct tm *tm_info = localtime(&sistema->log[idx].timestamp);
-        char buffer[20];
-        strftime(buffer, 20, "%Y-%m-%d %H:%M:%S", tm_info);
+        if (pid == 0) {
+            HistogramaLatencia *propios = &resultados[p * NUM_OPERACIONES_CARGA];
+            char buffer[MAX_CONTENIDO];
+            char contenido[64];
+            unsigned int semilla = getpid();
+            struct timespec antes, despues;
+            clock_gettime(CLOCK_MONOTONIC, &antes);
+            int64_t fin = antes.tv_sec * 1000000000LL + antes.tv_nsec + segundos * 1000000000LL;
+            int64_t ahora;
+            
+            id_nodo = p;
+            long k = 0;
+            do {
+                int r = rand_r(&semilla) % total_pesos;
+                int op = 0;
+                while (r >= pesos[op]) {
+                    r -= pesos[op++];
+                }
+                const char *nombre = nombres[rand_r(&semilla) % num_archivos];
+                int resultado = 0;
+                
+                clock_gettime(CLOCK_MONOTONIC, &antes);
+                switch (op) {
+                    case CARGA_CREAR:
+                        snprintf(contenido, sizeof(contenido), "creado por %d (%ld)", p, k);
+                        resultado = crear_archivo(nombre, contenido);
+                        break;
+                    case CARGA_LEER:
+                        resultado = leer_archivo(nombre, buffer, sizeof(buffer));
+                        break;
+                    case CARGA_ESCRIBIR:
+                        snprintf(contenido, sizeof(contenido), "escrito por %d (%ld)", p, k);
+                        resultado = escribir_archivo(nombre, contenido);
+                        break;
+                    case CARGA_ELIMINAR:
+                        resultado = eliminar_archivo(nombre);
+                        break;
+                    case CARGA_BLOQUEAR:
+                        // Se mide el ciclo completo de bloquear y soltar
+                        resultado = bloquear_archivo(nombre);
+                        if (resultado == 0) {
+                            desbloquear_archivo(nombre);
+                        }
+                        break;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &despues);
+                
+                ahora = despues.tv_sec * 1000000000LL + despues.tv_nsec;
+                uint64_t ns = ahora - (antes.tv_sec * 1000000000LL + antes.tv_nsec);
+                HistogramaLatencia *histograma = &propios[op];
+                histograma->operaciones++;
+                histograma->cubetas[cubeta_latencia(ns)]++;
+                if (ns > histograma->max_ns) {
+                    histograma->max_ns = ns;
+                }
+                if (resultado < 0) {
+                    histograma->errores++;
+                }
+                k++;
+            } while (ahora < fin);
+            
+            _exit(0);
+        } else if (pid < 0) {
+            perror("Error al crear proceso de carga");
+        }
+    }
+    
+    // Esperar a todos los procesos
+    while (wait(NULL) > 0);
+    
+    // "Operación" ocupa un byte más de los caracteres que muestra
+    printf("%-11s %-10s %-8s %-10s %-9s %-9s %-9s %-9s\n", "Operación", "Total", "Fallos",
+           "Ops/s", "p50(us)", "p99(us)", "p999(us)", "máx(us)");
+    
+    HistogramaLatencia combinado, todas;
+    memset(&todas, 0, sizeof(todas));
+    for (int op = 0; op < NUM_OPERACIONES_CARGA; op++) {
+        memset(&combinado, 0, sizeof(combinado));
+        for (int p = 0; p < procesos; p++) {
+            HistogramaLatencia *histograma = &resultados[p * NUM_OPERACIONES_CARGA + op];
+            combinado.operaciones += histograma->operaciones;
+            combinado.errores += histograma->errores;
+            if (histograma->max_ns > combinado.max_ns) {
+                combinado.max_ns = histograma->max_ns;
+            }
+            for (int c = 0; c < NUM_CUBETAS_LATENCIA; c++) {
+                combinado.cubetas[c] += histograma->cubetas[c];
+            }
+        }
         
-        // Tipo de operación
-        char operacion[15];
-        switch(sistema->log[idx].tipo_operacion) {
-            case 0:
-                strcpy(operacion, "Crear");
-                break;
-            case 1:
-                strcpy(operacion, "Leer");
-                break;
-            case 2:
-                strcpy(operacion, "Escribir");
-                break;
-            case 3:
-                strcpy(operacion, "Eliminar");
-                break;
-            default:
-                strcpy(operacion, "Desconocida");
-                break;
+        todas.operaciones += combinado.operaciones;
+        todas.errores += combinado.errores;
+        if (combinado.max_ns > todas.max_ns) {
+            todas.max_ns = combinado.max_ns;
+        }
+        for (int c = 0; c < NUM_CUBETAS_LATENCIA; c++) {
+            todas.cubetas[c] += combinado.cubetas[c];
         }
         
-        printf("%-20s %-10d %-15s %-20s\n", 
-               buffer,
-               sistema->log[idx].nodo,
-               operacion,
-               sistema->log[idx].nombre_archivo);
+        if (combinado.operaciones > 0) {
+            mostrar_histograma(nombres_carga[op], &combinado, segundos);
+        }
     }
+    mostrar_histograma("TOTAL", &todas, segundos);
     
-    // Desbloquear semáforo de logs
-    sem_post(sem_logs);
-}
-
-// Función para mostrar el estado de los nodos
-void mostrar_estado_nodos() {
-    // Bloquear semáforo
-    sem_wait(sem_archivos);
-    
-    printf("--- NODOS ACTIVOS ---\n");
-    for (int i = 0; i < MAX_NODOS; i++) {
-        printf("Nodo %d: %s\n", i, sistema->nodos_activos[i] ? "ACTIVO" : "INACTIVO");
+    // Limpiar los archivos de prueba
+    for (int i = 0; i < num_archivos; i++) {
+        eliminar_archivo(nombres[i]);
     }
+    modo_silencioso = 0;
     
-    // Desbloquear semáforo
-    sem_post(sem_archivos);
+    munmap(resultados, tam_resultados);
+}
+
+// Mostrar una fila de resultados del benchmark de carga
+void mostrar_histograma(const char *nombre, const HistogramaLatencia *histograma, int segundos) {
+    printf("%-10s %-10llu %-8llu %-10.0f %-9.1f %-9.1f %-9.1f %-9.1f\n", nombre,
+           (unsigned long long)histograma->operaciones, (unsigned long long)histograma->errores,
+           (double)histograma->operaciones / segundos,
+           percentil_latencia(histograma, 50) / 1000.0,
+           percentil_latencia(histograma, 99) / 1000.0,
+           percentil_latencia(histograma, 99.9) / 1000.0,
+           histograma->max_ns / 1000.0);
 }
 
 // Manejador de señal SIGINT (Ctrl+C)
@@ -547,9 +7411,64 @@ void manejador_sigint(int sig) {
 }
 
 int main(int argc, char *argv[]) {
+    inicializar_crc32c();
+    
+    // Modo benchmark: escalado de lecturas con varios procesos
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        int segundos = (argc > 2) ? atoi(argv[2]) : 2;
+        if (segundos <= 0) {
+            segundos = 2;
+        }
+        
+        id_nodo = 0;
+        inicializar_sistema();
+        benchmark_lecturas(segundos);
+        finalizar_sistema();
+        return 0;
+    }
+    
+    // Modo carga: mezcla de operaciones con varios procesos nodo
+    if (argc >= 2 && strcmp(argv[1], "carga") == 0) {
+        int procesos = (argc > 2) ? atoi(argv[2]) : MAX_NODOS;
+        int segundos = (argc > 3) ? atoi(argv[3]) : 2;
+        if (procesos <= 0 || procesos > MAX_NODOS) {
+            procesos = MAX_NODOS;
+        }
+        if (segundos <= 0) {
+            segundos = 2;
+        }
+        
+        id_nodo = 0;
+        inicializar_sistema();
+        benchmark_carga(procesos, segundos, (argc > 4) ? argv[4] : NULL);
+        finalizar_sistema();
+        return 0;
+    }
+    
     // Verificar argumentos
-    if (argc != 2) {
-        printf("Uso: %s <id_nodo>\n", argv[0]);
+    if (argc < 2) {
+        printf("Uso: %s <id_nodo> [opciones]\n", argv[0]);
+        printf("     %s bench [segundos]\n", argv[0]);
+        printf("     %s carga [procesos [segundos [mezcla]]]  (mezcla: crear=10,leer=50,...)\n",
+               argv[0]);
+        printf("Opciones:\n");
+        printf("  --bloques <n>   Bloques de %d bytes de la región de datos (def. %d)\n",
+               TAM_BLOQUE, NUM_BLOQUES_DATOS);
+        printf("  --shm <nombre>  Segmento persistente con shm_open (p. ej. /sistema_archivos)\n");
+        printf("  --archivo <ruta> Segmento persistente en un archivo en disco\n");
+        printf("  --checkpoint <s> Checkpoint automático cada s segundos (requiere --wal)\n");
+        printf("  --log-archivo <ruta> Copia el log de operaciones en un archivo proyectado\n");
+        printf("  --lease <s>     Duración de los bloqueos sin actividad del nodo (def. %d s)\n",
+               DURACION_LEASE_MS / 1000);
+        printf("  --lote <ruta>   Ejecutar un lote de comandos (\"-\": entrada estándar) y salir\n");
+        printf("  --replicacion <dir> Replicar las operaciones por sockets Unix en dir\n");
+        printf("  --pares <lista> Nodos a los que replicar, p. ej. 1,2 (def. todos los demás)\n");
+        printf("  --wal <ruta>    Write-ahead log con recuperación tras una caída\n");
+        printf("  --compresion [bytes] Comprimir los contenidos desde ese tamaño (def. %d)\n",
+               UMBRAL_COMPRESION);
+        printf("  --shards <k>    Repartir los archivos en k segmentos independientes (máx. %d)\n",
+               MAX_SHARDS);
+        printf("  --importar <ruta> Cargar una instantánea exportada al arrancar\n");
         return 1;
     }
     
@@ -560,6 +7479,62 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    // Parsear opciones
+    const char *lista_pares = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--bloques") == 0 && i + 1 < argc) {
+            num_bloques_datos = atoi(argv[++i]);
+            if (num_bloques_datos <= 0) {
+                printf("Error: El número de bloques debe ser positivo\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            nombre_shm = argv[++i];
+        } else if (strcmp(argv[i], "--archivo") == 0 && i + 1 < argc) {
+            ruta_persistente = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            intervalo_checkpoint = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-archivo") == 0 && i + 1 < argc) {
+            ruta_log_durable = argv[++i];
+        } else if (strcmp(argv[i], "--lease") == 0 && i + 1 < argc) {
+            duracion_lease = atoll(argv[++i]) * 1000;
+            if (duracion_lease <= 0) {
+                printf("Error: La duración del lease debe ser positiva\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--lote") == 0 && i + 1 < argc) {
+            ruta_lote = argv[++i];
+        } else if (strcmp(argv[i], "--importar") == 0 && i + 1 < argc) {
+            ruta_importacion = argv[++i];
+        } else if (strcmp(argv[i], "--replicacion") == 0 && i + 1 < argc) {
+            dir_replicacion = argv[++i];
+        } else if (strcmp(argv[i], "--pares") == 0 && i + 1 < argc) {
+            lista_pares = argv[++i];
+        } else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+            ruta_wal = argv[++i];
+        } else if (strcmp(argv[i], "--compresion") == 0) {
+            // El umbral es opcional
+            umbral_compresion = (i + 1 < argc && argv[i + 1][0] != '-')
+                                ? atoi(argv[++i]) : UMBRAL_COMPRESION;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            num_shards = atoi(argv[++i]);
+            if (num_shards < 1 || num_shards > MAX_SHARDS) {
+                printf("Error: El número de shards debe estar entre 1 y %d\n", MAX_SHARDS);
+                return 1;
+            }
+        } else {
+            printf("Error: Opción desconocida: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    // Sin WAL un checkpoint no deja una imagen que sobreviva a una caída
+    // (ver checkpoint_sistema)
+    if (intervalo_checkpoint > 0 && ruta_wal == NULL) {
+        printf("Error: --checkpoint requiere --wal\n");
+        return 1;
+    }
+    
     // Configurar manejador de señal para SIGINT
     signal(SIGINT, manejador_sigint);
     
@@ -569,11 +7544,43 @@ int main(int argc, char *argv[]) {
     // Inicializar el sistema de archivos
     inicializar_sistema();
     
-    // Crear hilos para sincronización y monitoreo
-    pthread_t hilo_sync, hilo_mon;
-    pthread_create(&hilo_sync, NULL, hilo_sincronizacion, NULL);
+    if (dir_replicacion != NULL && iniciar_replicacion(lista_pares) < 0) {
+        finalizar_sistema();
+        return 1;
+    }
+    
+    if (ruta_importacion != NULL && importar_instantanea(ruta_importacion) < 0) {
+        detener_replicacion();
+        finalizar_sistema();
+        return 1;
+    }
+    
+    // Modo por lotes: ejecutar el lote sin hilos ni interfaz interactiva
+    if (ruta_lote != NULL) {
+        long procesados = ejecutar_lote(ruta_lote);
+        if (replicacion.activa) {
+            esperar_replicacion(ESPERA_REPLICACION_MS);
+        }
+        detener_replicacion();
+        finalizar_sistema();
+        return procesados < 0 ? 1 : 0;
+    }
+    
+    // Crear hilos para sincronización (uno por shard), latido y monitoreo
+    pthread_t hilos_sync[MAX_SHARDS], hilo_lat, hilo_mon;
+    for (int k = 0; k < num_shards; k++) {
+        pthread_create(&hilos_sync[k], NULL, hilo_sincronizacion, (void *)(intptr_t)k);
+    }
+    pthread_create(&hilo_lat, NULL, hilo_latido, NULL);
     pthread_create(&hilo_mon, NULL, hilo_monitor, NULL);
     
+    // Checkpoints automáticos sólo en modo persistente o con WAL
+    pthread_t hilo_ckpt;
+    int con_checkpoints = wal.fd >= 0 && intervalo_checkpoint > 0;
+    if (con_checkpoints) {
+        pthread_create(&hilo_ckpt, NULL, hilo_checkpoint, NULL);
+    }
+    
     char comando[MAX_CONTENIDO];
     char buffer[MAX_CONTENIDO];
     
@@ -581,12 +7588,31 @@ int main(int argc, char *argv[]) {
     printf("  crear <nombre> <contenido>  - Crear nuevo archivo\n");
     printf("  leer <nombre>               - Leer archivo\n");
     printf("  escribir <nombre> <texto>   - Escribir en archivo\n");
+    printf("  anexar <nombre> <texto>     - Añadir texto al final del archivo\n");
+    printf("  sobrescribir <nombre> <desplazamiento> <texto> - Escribir desde un byte\n");
+    printf("  verificar <nombre>          - Comprobar la CRC32C del contenido\n");
     printf("  eliminar <nombre>           - Eliminar archivo\n");
-    printf("  bloquear <nombre>           - Bloquear archivo\n");
+    printf("  bloquear <nombre> [ms]      - Bloquear archivo (esperando hasta ms si está ocupado)\n");
     printf("  desbloquear <nombre>        - Desbloquear archivo\n");
     printf("  lista                       - Listar archivos\n");
+    printf("  listar [ruta]               - Listar un directorio y su contenido\n");
+    printf("  renombrar <origen> <destino> - Renombrar un archivo o directorio\n");
+    printf("  copiar <origen> <destino>   - Copiar un archivo compartiendo su contenido\n");
+    printf("  tx inicio|confirmar|abortar - Transacción sobre varios archivos\n");
+    printf("  tx escribir <nombre> <texto> - Preparar una escritura de la transacción\n");
     printf("  log                         - Mostrar log de operaciones\n");
+    printf("  log [nodo <n>] [archivo <nombre>] [desde <t>] [hasta <t>] - Consultar el log\n");
+    printf("                                (t: segundos desde la época, o -s: hace s segundos)\n");
     printf("  nodos                       - Mostrar estado de nodos\n");
+    printf("  checkpoint                  - Sincronizar el segmento persistente con disco\n");
+    printf("  wal                         - Estado del write-ahead log\n");
+    printf("  stats [nodo]                - Contención de locks y tiempo por operación\n");
+    printf("  stats volcar <ruta>         - Volcar las estadísticas tabuladas (\"-\": pantalla)\n");
+    printf("  stats reiniciar             - Poner a cero las estadísticas de este nodo\n");
+    printf("  lote <ruta>                 - Ejecutar un lote de comandos\n");
+    printf("  exportar <ruta>             - Guardar todos los archivos en una instantánea\n");
+    printf("  importar <ruta>             - Cargar los archivos de una instantánea\n");
+    printf("  replicacion [n [bytes]]     - Estado de la replicación (o medirla con n escrituras)\n");
     printf("  salir                       - Salir del sistema\n");
     
     // Bucle principal de comandos
@@ -596,6 +7622,7 @@ int main(int argc, char *argv[]) {
             break;
         }
         comando[strcspn(comando, "\n")] = 0;
+        latir();
         
         // Tokenizar el comando
         char *token = strtok(comando, " ");
@@ -621,7 +7648,9 @@ int main(int argc, char *argv[]) {
             }
             
             // Crear el archivo
-            crear_archivo(nombre, token);
+            if (crear_archivo(nombre, token) == -4) {
+                printf("Error: Ruta '%s' no válida o en conflicto con otra entrada\n", nombre);
+            }
             
         } else if (strcmp(token, "leer") == 0) {
             // Obtener nombre del archivo
@@ -631,9 +7660,19 @@ int main(int argc, char *argv[]) {
                 continue;
             }
             
-            // Leer el archivo
-            if (leer_archivo(token, buffer) >= 0) {
-                printf("Contenido de '%s':\n%s\n", token, buffer);
+            // Leer el archivo sin copiarlo: se envía desde la memoria compartida
+            VistaArchivo vista;
+            if (abrir_vista(token, &vista) == 0) {
+                snprintf(buffer, sizeof(buffer), "[Nodo %d] Archivo %s leído correctamente "
+                         "(%d bytes)\nContenido de '%s':\n",
+                         id_nodo, token, vista.longitud, token);
+                fflush(stdout);
+                enviar_vista(STDOUT_FILENO, &vista, buffer);
+                if (!vista_vigente(&vista)) {
+                    printf("(El archivo '%s' cambió mientras se mostraba: éste era su "
+                           "contenido al empezar)\n", token);
+                }
+                cerrar_vista(&vista);
             } else {
                 printf("Error: No se pudo leer el archivo '%s'\n", token);
             }
@@ -660,6 +7699,72 @@ int main(int argc, char *argv[]) {
                 printf("Error al escribir en el archivo '%s'\n", nombre);
             }
             
+        } else if (strcmp(token, "anexar") == 0) {
+            // Obtener nombre del archivo
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                printf("Error: Falta el nombre del archivo\n");
+                continue;
+            }
+            char nombre[MAX_NOMBRE];
+            strncpy(nombre, token, MAX_NOMBRE - 1);
+            
+            // Obtener el texto a añadir
+            token = strtok(NULL, "");
+            if (token == NULL) {
+                printf("Error: Falta el contenido\n");
+                continue;
+            }
+            
+            // Añadir al archivo
+            if (anexar_archivo(nombre, token) < 0) {
+                printf("Error al ampliar el archivo '%s'\n", nombre);
+            }
+            
+        } else if (strcmp(token, "sobrescribir") == 0) {
+            // Obtener nombre del archivo
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                printf("Error: Falta el nombre del archivo\n");
+                continue;
+            }
+            char nombre[MAX_NOMBRE];
+            strncpy(nombre, token, MAX_NOMBRE - 1);
+            
+            // Obtener el desplazamiento y el texto
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                printf("Error: Falta el desplazamiento\n");
+                continue;
+            }
+            int desplazamiento = atoi(token);
+            token = strtok(NULL, "");
+            if (token == NULL) {
+                printf("Error: Falta el contenido\n");
+                continue;
+            }
+            
+            // Escribir en el archivo
+            int res = escribir_parcial_archivo(nombre, desplazamiento, token);
+            if (res == -4) {
+                printf("Error: El desplazamiento %d está fuera del archivo '%s'\n",
+                       desplazamiento, nombre);
+            } else if (res < 0) {
+                printf("Error al escribir en el archivo '%s'\n", nombre);
+            }
+            
+        } else if (strcmp(token, "verificar") == 0) {
+            // Obtener nombre del archivo
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                printf("Error: Falta el nombre del archivo\n");
+                continue;
+            }
+            
+            if (verificar_archivo(token) < 0) {
+                printf("Error: No existe el archivo '%s'\n", token);
+            }
+            
         } else if (strcmp(token, "eliminar") == 0) {
             // Obtener nombre del archivo
             token = strtok(NULL, " ");
@@ -684,8 +7789,17 @@ int main(int argc, char *argv[]) {
                 continue;
             }
             
-            // Bloquear el archivo
-            if (bloquear_archivo(token) < 0) {
+            // Bloquear el archivo, esperando si se indica un tiempo
+            char *espera = strtok(NULL, " ");
+            int res = (espera != NULL) ? bloquear_archivo_espera(token, atoi(espera))
+                                       : bloquear_archivo(token);
+            if (res == -2 && espera != NULL) {
+                printf("Error: El archivo '%s' sigue bloqueado tras %s ms\n", token, espera);
+            } else if (res == -5) {
+                printf("Error: Demasiados nodos esperando el archivo '%s'\n", token);
+            } else if (res == -6) {
+                printf("Espera del archivo '%s' interrumpida\n", token);
+            } else if (res < 0) {
                 printf("Error al bloquear el archivo '%s'\n", token);
             }
             
@@ -705,12 +7819,218 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(token, "lista") == 0) {
             mostrar_archivos();
             
+        } else if (strcmp(token, "listar") == 0) {
+            // Sin ruta se lista la raíz
+            token = strtok(NULL, " ");
+            if (listar_directorio(token != NULL ? token : "") < 0) {
+                printf("Error: No existe la ruta '%s'\n", token);
+            }
+            
+        } else if (strcmp(token, "renombrar") == 0) {
+            // Obtener origen y destino
+            char *origen = strtok(NULL, " ");
+            char *destino = strtok(NULL, " ");
+            if (origen == NULL || destino == NULL) {
+                printf("Error: Faltan el origen y el destino\n");
+                continue;
+            }
+            
+            int res = renombrar(origen, destino);
+            if (res == -3) {
+                printf("Error: No eres el propietario de todos los archivos de '%s'\n", origen);
+            } else if (res == -4) {
+                printf("Error: Destino '%s' no válido o ya existente\n", destino);
+            } else if (res == -6) {
+                printf("Error: Un directorio no puede cambiar de shard ('%s' y '%s')\n",
+                       origen, destino);
+            } else if (res < 0) {
+                printf("Error al renombrar '%s'\n", origen);
+            }
+            
+        } else if (strcmp(token, "tx") == 0) {
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                printf("Error: Falta la acción (inicio, escribir, confirmar o abortar)\n");
+            } else if (strcmp(token, "inicio") == 0) {
+                if (transaccion_abierta) {
+                    printf("Error: Ya hay una transacción abierta\n");
+                    continue;
+                }
+                tx_inicio(&transaccion);
+                transaccion_abierta = 1;
+                printf("Transacción iniciada\n");
+            } else if (!transaccion_abierta) {
+                printf("Error: No hay ninguna transacción abierta\n");
+            } else if (strcmp(token, "escribir") == 0) {
+                char *nombre = strtok(NULL, " ");
+                char *texto = strtok(NULL, "");
+                if (nombre == NULL || texto == NULL) {
+                    printf("Error: Faltan el nombre y el contenido\n");
+                } else if (tx_escribir(&transaccion, nombre, texto, strlen(texto)) < 0) {
+                    printf("Error: No se pudo preparar la escritura de '%s'\n", nombre);
+                } else {
+                    printf("Escritura de '%s' preparada (%d en la transacción)\n",
+                           nombre, transaccion.num_escrituras);
+                }
+            } else if (strcmp(token, "confirmar") == 0) {
+                transaccion_abierta = 0;
+                int res = tx_confirmar(&transaccion);
+                if (res == -1) {
+                    printf("Error: Algún archivo de la transacción no existe\n");
+                } else if (res == -2) {
+                    printf("Error: Algún archivo de la transacción está bloqueado\n");
+                } else if (res == -4) {
+                    printf("Error: La transacción está vacía\n");
+                } else if (res < 0) {
+                    printf("Error: Sin espacio; la transacción no se aplicó\n");
+                }
+            } else if (strcmp(token, "abortar") == 0) {
+                tx_abortar(&transaccion);
+                transaccion_abierta = 0;
+                printf("Transacción abortada\n");
+            } else {
+                printf("Error: Acción de transacción desconocida: %s\n", token);
+            }
+            
+        } else if (strcmp(token, "copiar") == 0) {
+            // Obtener origen y destino
+            char *origen = strtok(NULL, " ");
+            char *destino = strtok(NULL, " ");
+            if (origen == NULL || destino == NULL) {
+                printf("Error: Faltan el origen y el destino\n");
+                continue;
+            }
+            
+            int res = copiar_archivo(origen, destino);
+            if (res == -5) {
+                printf("Error: No existe el archivo '%s'\n", origen);
+            } else if (res == -1) {
+                printf("Error: El archivo '%s' ya existe\n", destino);
+            } else if (res == -4) {
+                printf("Error: Destino '%s' no válido\n", destino);
+            } else if (res < 0) {
+                printf("Error al copiar '%s'\n", origen);
+            }
+            
         } else if (strcmp(token, "log") == 0) {
-            mostrar_log();
+            // Condiciones opcionales de la consulta
+            FiltroLog filtro = {-1, NULL, 0, 0};
+            int hay_filtro = 0, valido = 1;
+            char *campo;
+            while (valido && (campo = strtok(NULL, " ")) != NULL) {
+                char *valor = strtok(NULL, " ");
+                if (valor == NULL) {
+                    valido = 0;
+                } else if (strcmp(campo, "nodo") == 0) {
+                    filtro.nodo = atoi(valor);
+                    valido = (filtro.nodo >= 0 && filtro.nodo < MAX_NODOS);
+                } else if (strcmp(campo, "archivo") == 0) {
+                    filtro.nombre = valor;
+                } else if (strcmp(campo, "desde") == 0) {
+                    filtro.desde = leer_instante(valor);
+                    valido = (filtro.desde != 0);
+                } else if (strcmp(campo, "hasta") == 0) {
+                    filtro.hasta = leer_instante(valor);
+                    valido = (filtro.hasta != 0);
+                } else {
+                    valido = 0;
+                }
+                hay_filtro = 1;
+            }
+            
+            if (!valido) {
+                printf("Uso: log [nodo <n>] [archivo <nombre>] [desde <t>] [hasta <t>]\n");
+            } else {
+                mostrar_log(hay_filtro ? &filtro : NULL);
+            }
             
         } else if (strcmp(token, "nodos") == 0) {
             mostrar_estado_nodos();
             
+        } else if (strcmp(token, "lote") == 0) {
+            // Obtener la ruta del lote
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                printf("Error: Falta la ruta del lote\n");
+                continue;
+            }
+            
+            ejecutar_lote(token);
+            
+        } else if (strcmp(token, "replicacion") == 0) {
+            if (!replicacion.activa) {
+                printf("Error: La replicación no está activa (--replicacion)\n");
+                continue;
+            }
+            
+            // Con un número de operaciones se mide; si no, se muestra el estado
+            token = strtok(NULL, " ");
+            if (token != NULL) {
+                char *tamanio = strtok(NULL, " ");
+                benchmark_replicacion(atoi(token) > 0 ? atoi(token) : 1,
+                                      tamanio != NULL && atoi(tamanio) > 0 ? atoi(tamanio) : 64);
+            } else {
+                esperar_replicacion(ESPERA_REPLICACION_MS);
+                mostrar_replicacion();
+            }
+            
+        } else if (strcmp(token, "stats") == 0) {
+            token = strtok(NULL, " ");
+            if (token == NULL) {
+                mostrar_estadisticas(-1);
+                mostrar_deduplicacion();
+            } else if (strcmp(token, "volcar") == 0) {
+                char *ruta = strtok(NULL, " ");
+                if (ruta == NULL) {
+                    printf("Error: Falta la ruta del volcado\n");
+                } else if (volcar_estadisticas(ruta) < 0) {
+                    perror("Error al volcar las estadísticas");
+                }
+            } else if (strcmp(token, "reiniciar") == 0) {
+                reiniciar_estadisticas();
+                printf("Estadísticas del nodo %d reiniciadas\n", id_nodo);
+            } else if (atoi(token) >= 0 && atoi(token) < MAX_NODOS) {
+                mostrar_estadisticas(atoi(token));
+            } else {
+                printf("Error: Nodo no válido\n");
+            }
+            
+        } else if (strcmp(token, "wal") == 0) {
+            if (!wal.activo) {
+                printf("Error: El WAL no está activo (--wal)\n");
+                continue;
+            }
+            mostrar_wal();
+            
+        } else if (strcmp(token, "exportar") == 0) {
+            char *ruta = strtok(NULL, " ");
+            if (ruta == NULL) {
+                printf("Error: Falta la ruta de la instantánea\n");
+                continue;
+            }
+            int exportados = exportar_instantanea(ruta);
+            if (exportados < 0) {
+                perror("Error al exportar la instantánea");
+            } else {
+                printf("Instantánea %s guardada: %d archivos\n", ruta, exportados);
+            }
+            
+        } else if (strcmp(token, "importar") == 0) {
+            char *ruta = strtok(NULL, " ");
+            if (ruta == NULL) {
+                printf("Error: Falta la ruta de la instantánea\n");
+                continue;
+            }
+            importar_instantanea(ruta);
+            
+        } else if (strcmp(token, "checkpoint") == 0) {
+            if (checkpoint_sistema() == 0) {
+                printf("Checkpoint %llu completado\n",
+                       (unsigned long long)principal->cabecera.checkpoints);
+            } else {
+                printf("Error: El checkpoint sólo está disponible en modo persistente o con WAL\n");
+            }
+            
         } else if (strcmp(token, "salir") == 0) {
             continuar = 0;
             
@@ -722,11 +8042,19 @@ int main(int argc, char *argv[]) {
     // Finalizar el sistema y liberar recursos
     printf("Cerrando el nodo %d...\n", id_nodo);
     continuar = 0;
+    despertar_sincronizacion();
     
     // Esperar a los hilos
-    pthread_join(hilo_sync, NULL);
+    for (int k = 0; k < num_shards; k++) {
+        pthread_join(hilos_sync[k], NULL);
+    }
+    pthread_join(hilo_lat, NULL);
     pthread_join(hilo_mon, NULL);
+    if (con_checkpoints) {
+        pthread_join(hilo_ckpt, NULL);
+    }
     
+    detener_replicacion();
     finalizar_sistema();
     
     printf("Nodo %d finalizado correctamente.\n", id_nodo);